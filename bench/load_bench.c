@@ -0,0 +1,704 @@
+/* load_bench.c - drive a running daemon with synthetic file changes */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generates a watchtab of the given number of entries, one file each,
+ * starts the daemon on it in the foreground, and follows its log to time
+ * the load, until every entry is watched. Files are then appended to at
+ * the given average rate, in one of these shapes:
+ *   - uniform: evenly spaced changes, on random files
+ *   - bursty: groups of back-to-back changes, then a pause
+ *   - hotkey: evenly spaced changes, 90% of them on 1% of the files
+ * Each command is this program again, which reports the entry and the
+ * time it has started through a FIFO. The trigger latency of a report is
+ * counted from the earliest change of the file not yet reported, changes
+ * made before the file is watched again being merged into that report, or
+ * lost when no report follows. Finally the watchtab is rewritten with one
+ * more entry, to time a reload.
+ *
+ * Results are printed on a single line as a JSON object, along with the
+ * resident set and the CPU time of the daemon during the changes, all
+ * taken from /proc, so this runs on Linux only. The run is reproducible
+ * for a given seed, up to the scheduling of the system.
+ *
+ * Usage: load_bench [-k] [-b burst] [-d seconds] [-l label] [-n entries]
+ *            [-r rate] [-s shape] [-S seed] [-u user] [-w directory]
+ *            daemon [daemon options]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* number of files per generated directory */
+#define PER_DIR 1000
+
+/* seconds without progress before giving up waiting for the daemon */
+#define STALL_S 10
+
+/* seconds after the last change to wait for the last reports */
+#define DRAIN_S 2
+
+/* size of the buffer of lines read from the daemon and the FIFO */
+#define LINE_MAX_LEN 4096
+
+/* shapes of the change stream */
+enum shape { SHAPE_UNIFORM, SHAPE_BURSTY, SHAPE_HOTKEY };
+
+
+/* struct lines - line splitter of a descriptor */
+struct lines {
+	int		fd;
+	char		buf[LINE_MAX_LEN];
+	size_t		len;
+	int		eof;
+};
+
+/* struct samples - growable array of latencies in nanoseconds */
+struct samples {
+	uint64_t	*v;
+	size_t		len;
+	size_t		cap;
+};
+
+
+/* workdir - directory of the generated files */
+static const char *workdir = "/tmp/load_bench";
+
+/* rng_state - xorshift state */
+static uint64_t rng_state = 1;
+
+/* armed - number of "Waiting for events" lines seen */
+static unsigned long armed = 0;
+
+/* reloaded - number of reload lines seen */
+static unsigned long reloaded = 0;
+
+/* loaded - whether the initial load line has been seen */
+static int loaded = 0;
+
+
+/* now_ns - monotonic time in nanoseconds */
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+/* rng - next pseudo-random number */
+static uint64_t
+rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+
+/* file_path - path of the file of an entry */
+static void
+file_path(char *buf, size_t size, unsigned long id) {
+	snprintf(buf, size, "%s/files/%lu/%lu", workdir, id / PER_DIR, id);
+}
+
+
+/* report_main - command run by the daemon, reporting its start */
+static int
+report_main(const char *id, const char *fifo) {
+	char line[64];
+	uint64_t now = now_ns();
+	int fd, len;
+
+	fd = open(fifo, O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	len = snprintf(line, sizeof line, "%s %llu\n", id,
+	    (unsigned long long)now);
+	if (write(fd, line, (size_t)len) != len)
+		return EXIT_FAILURE;
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+
+/* make_dir - create a directory if needed */
+static int
+make_dir(const char *path) {
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* write_watchtab - write the watchtab for the given number of entries */
+static int
+write_watchtab(const char *path, unsigned long n, const char *user,
+    const char *self, const char *fifo) {
+	char file[256];
+	unsigned long i;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		file_path(file, sizeof file, i);
+		fprintf(f, "%s\twrite\t0\t%s\t\t%s -R %lu %s\n",
+		    file, user, self, i, fifo);
+	}
+	if (fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* populate - create the files and the watchtab */
+static int
+populate(unsigned long n, const char *user, const char *self,
+    const char *fifo, const char *tab) {
+	char path[256];
+	unsigned long i;
+	int fd;
+
+	snprintf(path, sizeof path, "%s/files", workdir);
+	if (make_dir(workdir) < 0 || make_dir(path) < 0)
+		return -1;
+	for (i = 0; i <= n; i++) {
+		if (i % PER_DIR == 0) {
+			snprintf(path, sizeof path, "%s/files/%lu", workdir,
+			    i / PER_DIR);
+			if (make_dir(path) < 0)
+				return -1;
+		}
+		file_path(path, sizeof path, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(path);
+			return -1;
+		}
+		close(fd);
+	}
+
+	unlink(fifo);
+	if (mkfifo(fifo, 0600) < 0) {
+		perror(fifo);
+		return -1;
+	}
+	return write_watchtab(tab, n, user, self, fifo);
+}
+
+
+/* cleanup - remove the generated files */
+static void
+cleanup(unsigned long n, const char *fifo, const char *tab) {
+	char path[256];
+	unsigned long i;
+
+	for (i = 0; i <= n; i++) {
+		file_path(path, sizeof path, i);
+		unlink(path);
+		if (i % PER_DIR == PER_DIR - 1 || i == n) {
+			snprintf(path, sizeof path, "%s/files/%lu", workdir,
+			    i / PER_DIR);
+			rmdir(path);
+		}
+	}
+	snprintf(path, sizeof path, "%s/files", workdir);
+	rmdir(path);
+	unlink(fifo);
+	unlink(tab);
+	snprintf(path, sizeof path, "%s/daemon.log", workdir);
+	unlink(path);
+	rmdir(workdir);
+}
+
+
+/* start_daemon - run the daemon in the foreground, logging into a pipe */
+static pid_t
+start_daemon(char **argv, int argc, const char *tab, int *log_fd) {
+	char **args;
+	int fds[2], i, devnull;
+	pid_t pid;
+
+	args = calloc((size_t)argc + 5, sizeof *args);
+	if (!args || pipe(fds) < 0) {
+		perror("start_daemon");
+		return -1;
+	}
+	for (i = 0; i < argc; i++)
+		args[i] = argv[i];
+	args[i++] = "-d";
+	args[i++] = "-w";
+	args[i++] = "1";
+	args[i++] = (char *)tab;
+	args[i] = 0;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		devnull = open("/dev/null", O_RDWR);
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[0]);
+		execv(args[0], args);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	*log_fd = fds[0];
+	free(args);
+	return pid;
+}
+
+
+/* read_lines - read what is available, calling fn on each whole line */
+static void
+read_lines(struct lines *l, void (*fn)(char *, void *), void *data) {
+	char *nl, *start;
+	ssize_t n;
+
+	while (1) {
+		n = read(l->fd, l->buf + l->len, sizeof l->buf - l->len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			l->eof = 1;
+		if (n <= 0)
+			return;
+		l->len += (size_t)n;
+		l->buf[l->len] = 0;
+
+		start = l->buf;
+		while ((nl = strchr(start, '\n')) != 0) {
+			*nl = 0;
+			fn(start, data);
+			start = nl + 1;
+		}
+		l->len -= (size_t)(start - l->buf);
+		memmove(l->buf, start, l->len);
+
+		/* A line longer than the buffer is dropped */
+		if (l->len == sizeof l->buf - 1)
+			l->len = 0;
+	}
+}
+
+
+/* daemon_line - follow the progress of the daemon in its log */
+static void
+daemon_line(char *line, void *data) {
+	(void)data;
+	if (strncmp(line, "Waiting for events on ", 22) == 0)
+		armed++;
+	else if (strstr(line, "reloaded successfully"))
+		reloaded++;
+	else if (strstr(line, "loaded successfully"))
+		loaded = 1;
+}
+
+
+/* struct report_ctx - state shared with report_line */
+struct report_ctx {
+	uint64_t	*pending;	/* earliest unreported change, by entry */
+	unsigned long	n;
+	struct samples	latency;
+	unsigned long	triggers;
+	unsigned long	spurious;
+};
+
+
+/* report_line - account for the start of a command */
+static void
+report_line(char *line, void *data) {
+	struct report_ctx *ctx = data;
+	unsigned long long id, ns;
+	uint64_t *v;
+
+	if (sscanf(line, "%llu %llu", &id, &ns) != 2 || id >= ctx->n)
+		return;
+	ctx->triggers++;
+	if (!ctx->pending[id] || ns < ctx->pending[id]) {
+		ctx->spurious++;
+		return;
+	}
+
+	if (ctx->latency.len == ctx->latency.cap) {
+		ctx->latency.cap = ctx->latency.cap ? ctx->latency.cap * 2 : 4096;
+		v = realloc(ctx->latency.v,
+		    ctx->latency.cap * sizeof *ctx->latency.v);
+		if (!v) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		ctx->latency.v = v;
+	}
+	ctx->latency.v[ctx->latency.len++] = ns - ctx->pending[id];
+	ctx->pending[id] = 0;
+}
+
+
+/* pump - wait up to the deadline, following the log and the reports */
+/*   Return -1 when the daemon has exited. */
+static int
+pump(struct lines *log, struct lines *reports, struct report_ctx *ctx,
+    uint64_t deadline) {
+	struct pollfd pfd[2];
+	uint64_t now = now_ns();
+	int timeout;
+
+	timeout = deadline > now ? (int)((deadline - now + 999999) / 1000000)
+	    : 0;
+	pfd[0].fd = log->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = reports->fd;
+	pfd[1].events = POLLIN;
+	if (poll(pfd, 2, timeout) < 0 && errno != EINTR) {
+		perror("poll");
+		return -1;
+	}
+	read_lines(log, daemon_line, 0);
+	read_lines(reports, report_line, ctx);
+	return log->eof ? -1 : 0;
+}
+
+
+/* proc_usage - resident set, peak and CPU time of a process */
+static void
+proc_usage(pid_t pid, long *rss_kb, long *hwm_kb, double *cpu_s) {
+	char path[64], line[256], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	*rss_kb = *hwm_kb = 0;
+	*cpu_s = 0;
+
+	snprintf(path, sizeof path, "/proc/%ld/status", (long)pid);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof line, f)) {
+			if (strncmp(line, "VmRSS:", 6) == 0)
+				*rss_kb = strtol(line + 6, 0, 10);
+			else if (strncmp(line, "VmHWM:", 6) == 0)
+				*hwm_kb = strtol(line + 6, 0, 10);
+		}
+		fclose(f);
+	}
+
+	/* utime and stime are fields 14 and 15, after the command name */
+	snprintf(path, sizeof path, "/proc/%ld/stat", (long)pid);
+	f = fopen(path, "r");
+	if (f) {
+		if (fgets(line, sizeof line, f)
+		    && (p = strrchr(line, ')')) != 0
+		    && sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+		    "%*u %*u %lu %lu", &utime, &stime) == 2)
+			*cpu_s = (double)(utime + stime)
+			    / sysconf(_SC_CLK_TCK);
+		fclose(f);
+	}
+}
+
+
+/* cmp_u64 - qsort() comparison of latencies */
+static int
+cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* pct_us - percentile of sorted latencies, in microseconds */
+static double
+pct_us(const struct samples *s, double pct) {
+	size_t i;
+
+	if (!s->len)
+		return 0;
+	i = (size_t)(pct / 100 * (double)(s->len - 1) + 0.5);
+	return s->v[i] / 1e3;
+}
+
+
+/* touch_file - append a byte to the file of an entry */
+static int
+touch_file(unsigned long id, uint64_t *when) {
+	char path[256];
+	int fd;
+
+	file_path(path, sizeof path, id);
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd < 0)
+		return -1;
+	*when = now_ns();
+	if (write(fd, "x", 1) != 1) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+
+/* usage - print usage text */
+static int
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-k] [-b burst] [-d seconds] [-l label] "
+	    "[-n entries]\n"
+	    "           [-r rate] [-s uniform|bursty|hotkey] [-S seed] "
+	    "[-u user]\n"
+	    "           [-w directory] daemon [daemon options]\n", name);
+	return EXIT_FAILURE;
+}
+
+
+int
+main(int argc, char **argv) {
+	const char *shape_names[] = { "uniform", "bursty", "hotkey" };
+	const char *label = "", *user = "";
+	unsigned long n = 1000, burst = 50, hot, i, id, changes = 0;
+	unsigned long merged = 0, lost = 0, failed = 0, seen, watched;
+	double rate = 200, duration = 5, cpu_before, cpu_after;
+	enum shape shape = SHAPE_UNIFORM;
+	double gen_s, load_s = 0, armed_s, reload_s = 0, phase_s;
+	unsigned long long seed = 1;
+	uint64_t t0, t1;
+	uint64_t next, end, interval, last_progress, when;
+	struct report_ctx ctx;
+	struct lines log, reports;
+	struct rlimit rl;
+	char self[1024], fifo[256], tab[256];
+	long rss_kb, hwm_kb;
+	int keep = 0, c, status;
+	ssize_t len;
+	pid_t pid;
+
+	/* Command mode, run by the daemon */
+	if (argc == 4 && strcmp(argv[1], "-R") == 0)
+		return report_main(argv[2], argv[3]);
+
+	while ((c = getopt(argc, argv, "+b:d:kl:n:r:s:S:u:w:")) != -1) {
+		switch (c) {
+		    case 'b':
+			burst = strtoul(optarg, 0, 10);
+			break;
+		    case 'd':
+			duration = strtod(optarg, 0);
+			break;
+		    case 'k':
+			keep = 1;
+			break;
+		    case 'l':
+			label = optarg;
+			break;
+		    case 'n':
+			n = strtoul(optarg, 0, 10);
+			break;
+		    case 'r':
+			rate = strtod(optarg, 0);
+			break;
+		    case 's':
+			for (i = 0; i < 3; i++)
+				if (strcmp(optarg, shape_names[i]) == 0)
+					break;
+			if (i == 3)
+				return usage(argv[0]);
+			shape = (enum shape)i;
+			break;
+		    case 'S':
+			seed = strtoull(optarg, 0, 10);
+			break;
+		    case 'u':
+			user = optarg;
+			break;
+		    case 'w':
+			workdir = optarg;
+			break;
+		    default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind >= argc || n == 0 || rate <= 0 || duration <= 0)
+		return usage(argv[0]);
+	if (burst == 0) burst = 1;
+	rng_state = seed ? seed : 1;
+	hot = n / 100 ? n / 100 : 1;
+
+	len = readlink("/proc/self/exe", self, sizeof self - 1);
+	if (len < 0) {
+		perror("readlink");
+		return EXIT_FAILURE;
+	}
+	self[len] = 0;
+	snprintf(fifo, sizeof fifo, "%s/reports", workdir);
+	snprintf(tab, sizeof tab, "%s/watchtab", workdir);
+
+	t0 = now_ns();
+	if (populate(n, user, self, fifo, tab) < 0)
+		return EXIT_FAILURE;
+	gen_s = (now_ns() - t0) / 1e9;
+	fprintf(stderr, "generated %lu entries in %.2f s\n", n, gen_s);
+
+	memset(&ctx, 0, sizeof ctx);
+	ctx.n = n;
+	ctx.pending = calloc(n, sizeof *ctx.pending);
+	if (!ctx.pending) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	/* The FIFO is kept open for writing too, never reaching its end */
+	memset(&reports, 0, sizeof reports);
+	reports.fd = open(fifo, O_RDWR | O_NONBLOCK);
+	if (reports.fd < 0) {
+		perror(fifo);
+		return EXIT_FAILURE;
+	}
+
+	/* One descriptor per entry in the daemon */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	/* Load: until the watchtab is parsed, then until all are watched */
+	memset(&log, 0, sizeof log);
+	t0 = now_ns();
+	pid = start_daemon(argv + optind, argc - optind, tab, &log.fd);
+	if (pid < 0)
+		return EXIT_FAILURE;
+	last_progress = t0;
+	seen = 0;
+	while (armed < n) {
+		if (pump(&log, &reports, &ctx, now_ns() + 100000000) < 0) {
+			fprintf(stderr, "daemon exited during load\n");
+			return EXIT_FAILURE;
+		}
+		if (loaded && !load_s)
+			load_s = (now_ns() - t0) / 1e9;
+		if (armed != seen) {
+			seen = armed;
+			last_progress = now_ns();
+		}
+		else if (now_ns() - last_progress > STALL_S * 1000000000ULL)
+			break;
+	}
+	armed_s = (now_ns() - t0) / 1e9;
+	watched = armed;
+	fprintf(stderr, "%lu entries watched in %.2f s\n", watched, armed_s);
+
+	/* Changes at the requested average rate */
+	interval = (uint64_t)(1e9 / rate);
+	proc_usage(pid, &rss_kb, &hwm_kb, &cpu_before);
+	t1 = now_ns();
+	next = t1;
+	end = t1 + (uint64_t)(duration * 1e9);
+	while (next < end) {
+		if (pump(&log, &reports, &ctx, next) < 0)
+			break;
+		while (now_ns() >= next && next < end) {
+			id = shape == SHAPE_HOTKEY && rng() % 100 < 90
+			    ? rng() % hot : rng() % n;
+			if (touch_file(id, &when) < 0)
+				failed++;
+			else if (ctx.pending[id])
+				merged++;
+			else
+				ctx.pending[id] = when;
+			changes++;
+			if (shape != SHAPE_BURSTY)
+				next += interval;
+			else if (changes % burst == 0)
+				next += interval * burst;
+		}
+	}
+
+	/* Wait for the last reports */
+	end = now_ns() + DRAIN_S * 1000000000ULL;
+	while (now_ns() < end)
+		if (pump(&log, &reports, &ctx, end) < 0)
+			break;
+	proc_usage(pid, &rss_kb, &hwm_kb, &cpu_after);
+	phase_s = (now_ns() - t1) / 1e9;
+	for (i = 0; i < n; i++)
+		if (ctx.pending[i])
+			lost++;
+
+	/* Reload: the same watchtab with one more entry */
+	seen = reloaded;
+	t0 = now_ns();
+	if (write_watchtab(tab, n + 1, user, self, fifo) < 0)
+		return EXIT_FAILURE;
+	while (reloaded == seen && now_ns() - t0 < STALL_S * 1000000000ULL)
+		if (pump(&log, &reports, &ctx, now_ns() + 100000000) < 0)
+			break;
+	if (reloaded != seen)
+		reload_s = (now_ns() - t0) / 1e9;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+
+	qsort(ctx.latency.v, ctx.latency.len, sizeof *ctx.latency.v, cmp_u64);
+	printf("{\"bench\":\"load\",\"label\":\"%s\",\"entries\":%lu,"
+	    "\"shape\":\"%s\",\"rate\":%.0f,\"duration_s\":%.2f,"
+	    "\"seed\":%llu,\"generate_s\":%.4f,\"load_s\":%.4f,"
+	    "\"armed\":%lu,\"armed_s\":%.4f,\"reload_s\":%.4f,"
+	    "\"changes\":%lu,\"failed\":%lu,\"merged\":%lu,\"lost\":%lu,"
+	    "\"triggers\":%lu,\"spurious\":%lu,\"spawns_per_s\":%.1f,"
+	    "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+	    "\"p999\":%.1f,\"max\":%.1f},\"rss_kb\":%ld,\"hwm_kb\":%ld,"
+	    "\"cpu_s\":%.3f,\"cpu_pct\":%.1f}\n",
+	    label, n, shape_names[shape], rate, duration, seed, gen_s, load_s,
+	    watched, armed_s, reload_s, changes, failed, merged, lost,
+	    ctx.triggers, ctx.spurious, ctx.triggers / phase_s,
+	    pct_us(&ctx.latency, 50), pct_us(&ctx.latency, 90),
+	    pct_us(&ctx.latency, 99), pct_us(&ctx.latency, 99.9),
+	    pct_us(&ctx.latency, 100), rss_kb, hwm_kb,
+	    cpu_after - cpu_before, 100 * (cpu_after - cpu_before) / phase_s);
+
+	if (!keep)
+		cleanup(n + 1, fifo, tab);
+	free(ctx.pending);
+	free(ctx.latency.v);
+	return EXIT_SUCCESS;
+}
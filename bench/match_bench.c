@@ -0,0 +1,230 @@
+/* match_bench.c - measure glob matching throughput */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compiles a pattern, then matches generated names created in its base
+ * directory the way a directory event is handled, feeding only the name
+ * from the state of the directory, and reports the time per name and the
+ * number of names per second, next to fnmatch(3) on the full path.
+ *
+ * A small set of names is reused, so that the figures are those of the
+ * matchers rather than of memory. One name out of two matches the
+ * default pattern.
+ *
+ * Before measuring, the automaton is checked on a fixed set of patterns
+ * and paths against fnmatch(3) with FNM_PATHNAME, for which a `**` + /
+ * component is tried as zero up to CHECK_MAX_DIRS `*` + / components, and
+ * the program fails on any difference.
+ *
+ * Usage: match_bench [pattern [count]]
+ */
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "match.h"
+
+/* length of the longest generated name */
+#define NAME_MAX_LEN 64
+
+/* number of distinct generated names */
+#define NAME_COUNT 4096
+
+/* most directories a `**` is tried as in the fnmatch reference */
+#define CHECK_MAX_DIRS 3
+
+/* check_patterns - patterns compared against fnmatch */
+static const char *check_patterns[] = {
+    "/data/**/in.csv",
+    "/data/**/*.csv",
+    "/data/**/in-?.csv",
+    "/data/**/a/**/in.csv",
+    "/data/x**/in.csv",
+    "/data/*/in.csv" };
+
+/* check_paths - paths matched against each pattern above */
+static const char *check_paths[] = {
+    "/data/in.csv", "/data/xin.csv", "/data/a/in.csv", "/data/a/xin.csv",
+    "/data/ain.csv", "/data/a/b/in.csv", "/data/a/b/xin.csv",
+    "/data/ab/in.csv", "/data/a/bin.csv", "/data//in.csv",
+    "/data/in-1.csv", "/data/a/in-1.csv", "/data/a/xin-1.csv",
+    "/data/a/a/in.csv", "/data/b/a/in.csv", "/data/xa/in.csv",
+    "/data/x/in.csv", "/data/xy/in.csv", "/data/in.csv/x",
+    "/datax/in.csv", "/data/a.csv" };
+
+
+/* elapsed_ns - nanoseconds between two times */
+static double
+elapsed_ns(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e9
+	    + (to->tv_nsec - from->tv_nsec);
+}
+
+
+/* report_line - print the cost of one matcher */
+static void
+report_line(const char *label, unsigned long count, unsigned long hits,
+    double ns) {
+	printf("%-8s %8.1f ns/name %12.0f names/s %10lu hits\n",
+	    label, ns / count, count * 1e9 / ns, hits);
+}
+
+
+/* reference - fnmatch trying each `**` + / as up to CHECK_MAX_DIRS `*` + / */
+static int
+reference(const char *pattern, const char *done, size_t done_len,
+    const char *path) {
+	char buf[256];
+	const char *p;
+	size_t len;
+	int j, k;
+
+	/* Only `**` + / at a component start stands for directories */
+	for (p = pattern; (p = strstr(p, "**/")) != 0; p++)
+		if (p == pattern || p[-1] == '/')
+			break;
+	if (!p) {
+		snprintf(buf, sizeof buf, "%.*s%s", (int)done_len, done,
+		    pattern);
+		return fnmatch(buf, path, FNM_PATHNAME) == 0;
+	}
+
+	for (k = 0; k <= CHECK_MAX_DIRS; k++) {
+		len = (size_t)snprintf(buf, sizeof buf, "%.*s%.*s",
+		    (int)done_len, done, (int)(p - pattern), pattern);
+		if (len + 2 * k >= sizeof buf)
+			return 0;
+		for (j = 0; j < k; j++) {
+			memcpy(buf + len, "*/", 2);
+			len += 2;
+		}
+		buf[len] = 0;
+		if (reference(p + 3, buf, len, path))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* check - compare the automaton against fnmatch on the fixed cases */
+/*   Return the number of differences. */
+static unsigned
+check(void) {
+	unsigned failures = 0, i, j;
+	struct matcher *m;
+	int dfa, ref;
+
+	for (i = 0; i < sizeof check_patterns / sizeof *check_patterns; i++) {
+		m = match_compile(check_patterns[i],
+		    strlen(check_patterns[i]));
+		if (!m) {
+			fprintf(stderr, "Invalid pattern \"%s\"\n",
+			    check_patterns[i]);
+			failures++;
+			continue;
+		}
+		for (j = 0; j < sizeof check_paths / sizeof *check_paths;
+		    j++) {
+			dfa = match_accepts(m,
+			    match_step(m, MATCH_START, check_paths[j]));
+			ref = reference(check_patterns[i], "", 0,
+			    check_paths[j]);
+			if (dfa == ref)
+				continue;
+			fprintf(stderr, "%s on %s: dfa %s, fnmatch %s\n",
+			    check_patterns[i], check_paths[j],
+			    dfa ? "matches" : "fails",
+			    ref ? "matches" : "fails");
+			failures++;
+		}
+		match_free(m);
+	}
+
+	return failures;
+}
+
+
+int
+main(int argc, char **argv) {
+	const char *pattern = "/data/in/report-[0-9]*.csv";
+	unsigned long count = 1000000, hits, i;
+	struct timespec start, end;
+	struct matcher *m;
+	size_t base_len, path_len;
+	char *names, *paths;
+
+	if (argc > 1) pattern = argv[1];
+	if (argc > 2) count = strtoul(argv[2], 0, 10);
+	if (count == 0) count = 1;
+
+	if (check() > 0)
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m = match_compile(pattern, strlen(pattern));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!m) {
+		fprintf(stderr, "Invalid pattern \"%s\"\n", pattern);
+		return EXIT_FAILURE;
+	}
+	printf("pattern %s: %u states, %u byte classes, "
+	    "compiled in %.1f us\n", pattern, m->nstates, m->nclasses,
+	    elapsed_ns(&start, &end) / 1e3);
+
+	/* Names alone, and full paths for fnmatch */
+	base_len = strlen(m->base);
+	path_len = base_len + 1 + NAME_MAX_LEN;
+	names = malloc(NAME_COUNT * NAME_MAX_LEN);
+	paths = malloc(NAME_COUNT * path_len);
+	if (!names || !paths) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < NAME_COUNT; i++) {
+		char *name = names + i * NAME_MAX_LEN;
+
+		snprintf(name, NAME_MAX_LEN, i % 2 ? "report-%lu.csv"
+		    : "report-%lu.csv.tmp", 100000 + i);
+		snprintf(paths + i * path_len, path_len, "%s/%s",
+		    m->base, name);
+	}
+
+	hits = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		hits += match_accepts(m, match_step(m, m->base_state,
+		    names + i % NAME_COUNT * NAME_MAX_LEN));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report_line("dfa", count, hits, elapsed_ns(&start, &end));
+
+	hits = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		hits += fnmatch(pattern, paths + i % NAME_COUNT * path_len,
+		    FNM_PATHNAME) == 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report_line("fnmatch", count, hits, elapsed_ns(&start, &end));
+
+	free(names);
+	free(paths);
+	match_free(m);
+	return EXIT_SUCCESS;
+}
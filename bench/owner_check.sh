@@ -0,0 +1,92 @@
+#!/bin/sh
+# owner_check.sh - check that owned watchtabs only see what their owner can
+
+# Copyright (c) 2013, Natacha Porté
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Runs the daemon as root with --owner on a spool holding a watchtab of
+# an unprivileged user, whose entries point into a 0700 directory of
+# root: a file in it, a missing path below it, and a tree holding it.
+# None of them may trigger, while a readable part of the tree still does.
+# The user is set through:
+#   CHECK_USER	owner of the watchtab, nobody by default
+#   FILEWATCHERD	daemon to run, the one of the source tree by default
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CHECK_USER=${CHECK_USER:-nobody}
+FILEWATCHERD=${FILEWATCHERD:-$PWD/filewatcherd}
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "owner_check: must run as root" >&2
+	exit 1
+fi
+
+dir=$(mktemp -d)
+pid=
+trap 'test -n "$pid" && kill "$pid" 2>/dev/null; rm -rf "$dir"' EXIT
+chmod 755 "$dir"
+mkdir -m 755 "$dir/spool" "$dir/tree"
+mkdir -m 700 "$dir/secret" "$dir/tree/secret"
+mkdir -m 1777 "$dir/out"
+touch "$dir/secret/file"
+
+tab="$dir/spool/$CHECK_USER"
+printf '%s\t%s\t0\troot\t%s\n' \
+    "$dir/secret/file" write "touch $dir/out/file" \
+    "$dir/secret/missing" write "touch $dir/out/missing" \
+    "$dir/tree" 'write;recursive=yes' "echo \$TRIGGER >> $dir/out/tree" \
+    > "$tab"
+chown "$CHECK_USER" "$tab"
+chmod 644 "$tab"
+
+"$FILEWATCHERD" -d -u "$dir/spool" > "$dir/log" 2>&1 &
+pid=$!
+sleep 1
+
+echo change >> "$dir/secret/file"
+echo change > "$dir/secret/missing"
+echo change > "$dir/tree/secret/new"
+sleep 0.5
+echo change >> "$dir/secret/missing"
+echo change > "$dir/tree/public"
+sleep 1
+
+fail=0
+for f in file missing; do
+	if [ -e "$dir/out/$f" ]; then
+		echo "owner_check: $dir/secret/$f has triggered" >&2
+		fail=1
+	fi
+done
+if grep -q secret "$dir/out/tree" 2>/dev/null; then
+	echo "owner_check: $dir/tree/secret has triggered" >&2
+	fail=1
+fi
+if ! grep -q "$dir/tree/public" "$dir/out/tree" 2>/dev/null; then
+	echo "owner_check: $dir/tree/public has not triggered" >&2
+	fail=1
+fi
+if [ "$(grep -c 'out of reach' "$dir/log")" -ne 3 ]; then
+	echo "owner_check: refusals have not been logged" >&2
+	fail=1
+fi
+
+if [ "$fail" -ne 0 ]; then
+	cat "$dir/log" >&2
+	exit 1
+fi
+echo "owner_check: passed"
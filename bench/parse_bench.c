@@ -0,0 +1,164 @@
+/* parse_bench.c - measure watchtab parsing throughput */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Writes a watchtab of the given number of entries, with a mix of event
+ * sets, options, delays, escaped tabulations and environment lines, then
+ * parses it the given number of times and reports the best and mean
+ * throughput in megabytes and lines per second, along with the mean time
+ * to release the parsed watchtab and the heap it used, as counted by the
+ * allocator when it can tell (glibc), and the user lookups of the last
+ * run. Every entry has the given user field, so that user lookups are
+ * part of the measure unless it is empty (the daemon's own login is then
+ * looked up instead).
+ *
+ * Usage: parse_bench [lines [runs [user]]]
+ */
+
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "watchtab.h"
+
+/* event fields of the generated entries */
+static const char *events[] = {
+	"write", "delete,rename", "WRITE|EXTEND", "*",
+	"write,concurrency=4,priority=high", "attrib link revoke",
+};
+
+
+/* elapsed_s - seconds between two times */
+static double
+elapsed_s(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec)
+	    + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+/* heap_used - bytes allocated from the heap, or 0 when unknown */
+static size_t
+heap_used(void) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+	return mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+
+/* generate - write the watchtab, returning its size in bytes */
+static long
+generate(FILE *f, unsigned long lines, const char *user) {
+	unsigned long i;
+
+	fprintf(f, "# generated by parse_bench\nSHELL = /bin/sh\n\n");
+	for (i = 0; i < lines; i++) {
+		if (i % 1000 == 999)
+			fprintf(f, "BATCH=%lu\n", i / 1000);
+		fprintf(f, "/srv/data/%lu/in\\\tcoming-%lu.dat\t%s\t%s\t"
+		    "%s\t\t/usr/local/bin/process --batch %lu \"$TRIGGER\"\n",
+		    i / 1000, i, events[i % 6],
+		    i % 3 ? "0.5" : "~0.25/2", user, i);
+	}
+	fflush(f);
+	return ftell(f);
+}
+
+
+int
+main(int argc, char **argv) {
+	unsigned long lines = 100000, runs = 5, i, n;
+	const char *user = "0";
+	char path[] = "/tmp/parse_bench.XXXXXX";
+	struct timespec start, end;
+	struct watchtab tab;
+	struct watch_entry *wentry;
+	struct wtab_lookups lookups;
+	double s, best = 0, total = 0, released = 0;
+	size_t heap = 0, before;
+	long size;
+	FILE *f;
+	int fd;
+
+	if (argc > 1) lines = strtoul(argv[1], 0, 10);
+	if (argc > 2) runs = strtoul(argv[2], 0, 10);
+	if (argc > 3) user = argv[3];
+	if (lines == 0 || runs == 0) {
+		fprintf(stderr, "Usage: %s [lines [runs [user]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = mkstemp(path);
+	f = fd < 0 ? 0 : fdopen(fd, "w+");
+	if (!f) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	size = generate(f, lines, user);
+	unlink(path);
+
+	for (i = 0; i < runs; i++) {
+		SLIST_INIT(&tab);
+		lseek(fd, 0, SEEK_SET);
+		before = heap_used();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (wtab_readfile(&tab, fd, path, 0, &lookups) < 0) {
+			fprintf(stderr, "Parse error\n");
+			return EXIT_FAILURE;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		heap = heap_used() - before;
+
+		n = 0;
+		SLIST_FOREACH(wentry, &tab, next)
+			n++;
+		if (n != lines) {
+			fprintf(stderr, "%lu entries parsed out of %lu\n",
+			    n, lines);
+			return EXIT_FAILURE;
+		}
+		s = elapsed_s(&start, &end);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wtab_release(&tab);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		released += elapsed_s(&start, &end);
+
+		total += s;
+		if (i == 0 || s < best)
+			best = s;
+	}
+
+	printf("%lu lines, %.1f MB: best %.1f MB/s %.0f lines/s, "
+	    "mean %.1f MB/s %.0f lines/s\n",
+	    lines, size / 1e6, size / 1e6 / best, lines / best,
+	    size / 1e6 * runs / total, lines * runs / total);
+	printf("release %.2f ms, heap %.1f MB, %zu user lookups, "
+	    "%zu cached, %.3f ms in system lookups\n",
+	    released * 1e3 / runs, heap / 1e6,
+	    lookups.hits + lookups.misses, lookups.hits,
+	    lookups.time_ns / 1e6);
+	fclose(f);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# run.sh - run the load benchmark over a matrix of sizes and shapes
+
+# Copyright (c) 2013, Natacha Porté
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Results are appended as one JSON object per line to $RESULTS, labelled
+# with the current revision, so that runs of two revisions can be compared
+# line by line. The matrix and the load can be changed through:
+#   SIZES	numbers of entries (add 1000000 with enough inotify watches)
+#   SHAPES	shapes of the change stream
+#   RATE	changes per second
+#   DURATION	seconds of changes per run
+#   SEED	seed of the change stream
+#   BENCH_USER	user field of the generated entries
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+SIZES=${SIZES:-"1000 10000 100000"}
+SHAPES=${SHAPES:-"uniform bursty hotkey"}
+RATE=${RATE:-1000}
+DURATION=${DURATION:-5}
+SEED=${SEED:-1}
+RESULTS=${RESULTS:-bench/results.jsonl}
+LABEL=${LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+
+for n in $SIZES; do
+	for shape in $SHAPES; do
+		echo "$LABEL: $n entries, $shape" >&2
+		bench/load_bench -l "$LABEL" -n "$n" -s "$shape" -r "$RATE" \
+		    -d "$DURATION" -S "$SEED" ${BENCH_USER:+-u "$BENCH_USER"} \
+		    "$PWD/filewatcherd" "$@" >> "$RESULTS"
+	done
+done
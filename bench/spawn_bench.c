@@ -0,0 +1,191 @@
+/* spawn_bench.c - compare command launchers */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Starts the same command many times through run_entry() with the
+ * posix_spawn launcher and through run_entry_forked() (vfork), one at a
+ * time, and reports for each launcher the time the caller is blocked in
+ * the launcher and the time until the command has exited, in microseconds.
+ *
+ * It then starts the spawn helper, with the default vfork launcher, and
+ * times the same runs through it: the caller is blocked for the round trip
+ * of the spawn request, and once more for the reap request that brings
+ * back the wait status, since the helper is the parent of the commands.
+ * The helper is polled for the exit, so the total is coarser there.
+ *
+ * Usage: spawn_bench [count [command]]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "run.h"
+#include "watchtab.h"
+
+/* launcher - function under test */
+typedef pid_t (*launcher)(struct watch_entry *, const int *, int);
+
+/* number of polls of the spawn helper for an exit, 20 us apart */
+#define HELPER_POLLS 100000
+
+/* cmp_double - qsort() comparison of doubles */
+static int
+cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* elapsed_us - microseconds between two times */
+static double
+elapsed_us(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e6
+	    + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+
+/* report_line - print percentiles of sorted samples */
+static void
+report_line(const char *name, const char *metric, double *samples,
+    size_t count) {
+	double sum = 0;
+	size_t i;
+
+	qsort(samples, count, sizeof *samples, &cmp_double);
+	for (i = 0; i < count; i++)
+		sum += samples[i];
+	printf("%-12s %-8s %10.1f %10.1f %10.1f %10.1f\n", name, metric,
+	    sum / count, samples[count / 2], samples[count * 99 / 100],
+	    samples[count - 1]);
+}
+
+
+/* helper_wait - poll the spawn helper until a command is reaped */
+/*   Return the time of the successful reap request in microseconds, or
+ *   a negative value when the command does not exit. */
+static double
+helper_wait(pid_t pid) {
+	struct timespec pause = { 0, 20000 }, t0, t1;
+	unsigned polls;
+
+	for (polls = 0; polls < HELPER_POLLS; polls++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (run_reap(pid, -1) != -1) {
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			return elapsed_us(&t0, &t1);
+		}
+		nanosleep(&pause, 0);
+	}
+
+	fprintf(stderr, "Command %ld not reaped by the helper\n", (long)pid);
+	return -1;
+}
+
+
+/* run_bench - time count runs of the entry through a launcher */
+/*   With helped, commands are started and reaped by the spawn helper. */
+static int
+run_bench(const char *name, launcher fn, struct watch_entry *wentry,
+    size_t count, int helped) {
+	double *blocked, *total, *reaped;
+	struct timespec t0, t1, t2;
+	size_t i;
+	pid_t pid;
+	int status;
+
+	blocked = malloc(count * sizeof *blocked);
+	total = malloc(count * sizeof *total);
+	reaped = malloc(count * sizeof *reaped);
+	if (!blocked || !total || !reaped) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pid = fn(wentry, 0, -1);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (!pid) return -1;
+		if (helped) {
+			if ((reaped[i] = helper_wait(pid)) < 0)
+				return -1;
+		}
+		else if (waitpid(pid, &status, 0) < 0) {
+			perror("waitpid");
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		blocked[i] = elapsed_us(&t0, &t1);
+		total[i] = elapsed_us(&t0, &t2);
+	}
+
+	report_line(name, "blocked", blocked, count);
+	if (helped)
+		report_line(name, "reap", reaped, count);
+	report_line(name, "total", total, count);
+	free(blocked);
+	free(total);
+	free(reaped);
+	return 0;
+}
+
+
+int
+main(int argc, char **argv) {
+	struct watch_entry wentry;
+	struct watch_env env;
+	size_t count = 1000;
+
+	if (argc > 1)
+		count = strtoul(argv[1], 0, 10);
+	if (count == 0) {
+		fprintf(stderr, "Usage: %s [count [command]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	wentry_init(&wentry);
+	wentry.path = "/dev/null";
+	wentry.command = argc > 2 ? argv[2] : "true";
+	wenv_init(&env);
+	wenv_set(&env, "PATH", "/bin:/usr/bin", 1);
+	wentry.env = wenv_share(&env);
+
+	/* Reap explicitly, as the daemon does through its event queue */
+	signal(SIGCHLD, SIG_DFL);
+	if (run_init(RUN_SPAWN) < 0)
+		return EXIT_FAILURE;
+
+	printf("%-12s %-8s %10s %10s %10s %10s\n", "launcher", "metric",
+	    "mean_us", "p50_us", "p99_us", "max_us");
+	if (run_bench("posix_spawn", &run_entry, &wentry, count, 0) < 0
+	    || run_bench("vfork", &run_entry_forked, &wentry, count, 0) < 0)
+		return EXIT_FAILURE;
+
+	/* From now on, run_entry() goes through the helper */
+	if (run_init(RUN_VFORK) < 0 || run_helper_start(0) < 0
+	    || run_bench("helper", &run_entry, &wentry, count, 1) < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+/* tree_bench.c - measure arming of a recursive entry */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Arms a recursive entry on the given directory, scanning with the given
+ * number of threads (0 for one per CPU), and reports the number of
+ * watched directories, the time until all of them are registered in the
+ * kernel, and the growth of the resident set per directory.
+ *
+ * When the directory does not exist, it is first populated with the given
+ * number of empty files, spread over directories of per_dir files, each
+ * directory having up to 10 subdirectories.
+ *
+ * Usage: tree_bench directory [files [per_dir [threads]]]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "evqueue.h"
+#include "log.h"
+#include "tree.h"
+#include "watchtab.h"
+
+/* number of subdirectories of each generated directory */
+#define FANOUT 10
+
+
+/* elapsed_ms - milliseconds between two times */
+static double
+elapsed_ms(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e3
+	    + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+
+/* resident - current resident set, or its high-water mark, in kilobytes */
+static long
+resident(void) {
+	struct rusage ru;
+	long pages;
+	FILE *f;
+
+	/* Linux updates the high-water mark lazily, use the current size */
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) != 1) pages = 0;
+		fclose(f);
+		if (pages > 0)
+			return pages * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return ru.ru_maxrss;
+}
+
+
+/* populate - create a tree of empty files */
+static int
+populate(const char *root, unsigned long files, unsigned long per_dir) {
+	unsigned long ndirs = (files + per_dir - 1) / per_dir, i, j;
+	char **paths, name[32];
+	size_t len;
+	int dirfd, fd;
+
+	if (ndirs == 0) ndirs = 1;
+	paths = calloc(ndirs, sizeof *paths);
+	if (!paths) return -1;
+
+	/* Directory i is a child of directory (i - 1) / FANOUT */
+	for (i = 0; i < ndirs; i++) {
+		const char *parent = i ? paths[(i - 1) / FANOUT] : root;
+
+		len = strlen(parent) + 32;
+		paths[i] = malloc(len);
+		if (!paths[i]) return -1;
+		if (i)
+			snprintf(paths[i], len, "%s/d%lu", parent, i);
+		else
+			snprintf(paths[i], len, "%s", root);
+		if (mkdir(paths[i], 0755) < 0 && errno != EEXIST) {
+			perror(paths[i]);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < ndirs; i++) {
+		dirfd = open(paths[i], O_RDONLY | O_DIRECTORY);
+		for (j = 0; dirfd >= 0 && j < per_dir
+		    && i * per_dir + j < files; j++) {
+			snprintf(name, sizeof name, "f%lu", j);
+			fd = openat(dirfd, name, O_WRONLY | O_CREAT, 0644);
+			if (fd >= 0) close(fd);
+		}
+		if (dirfd >= 0) close(dirfd);
+		free(paths[i]);
+	}
+
+	free(paths);
+	return 0;
+}
+
+
+int
+main(int argc, char **argv) {
+	unsigned long files = 1000000, per_dir = 100;
+	unsigned threads = 0;
+	struct watch_entry wentry;
+	struct evq_event event;
+	struct timespec start, end, zero = { 0, 0 };
+	struct evqueue *evq;
+	struct stat st;
+	long rss;
+
+	if (argc < 2) {
+		fprintf(stderr,
+		    "Usage: %s directory [files [per_dir [threads]]]\n",
+		    argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2) files = strtoul(argv[2], 0, 10);
+	if (argc > 3) per_dir = strtoul(argv[3], 0, 10);
+	if (argc > 4) threads = (unsigned)strtoul(argv[4], 0, 10);
+	if (per_dir == 0) per_dir = 1;
+
+	if (stat(argv[1], &st) < 0) {
+		printf("populating %s with %lu files, %lu per directory\n",
+		    argv[1], files, per_dir);
+		if (populate(argv[1], files, per_dir) < 0)
+			return EXIT_FAILURE;
+	}
+
+	evq = evq_new();
+	if (!evq)
+		return EXIT_FAILURE;
+	tree_init(threads);
+
+	wentry_init(&wentry);
+	wentry.path = argv[1];
+	wentry.events = WEV_WRITE;
+	wentry.recursive = 1;
+
+	/* Registrations may wait for the next evq_wait() */
+	rss = resident();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (tree_arm(evq, &wentry) < 0)
+		return EXIT_FAILURE;
+	if (evq_wait(evq, &event, 1, &zero) < 0)
+		return EXIT_FAILURE;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%zu directories armed in %.1f ms, %.1f us per directory\n",
+	    wentry.tree->ndirs, elapsed_ms(&start, &end),
+	    elapsed_ms(&start, &end) * 1e3 / wentry.tree->ndirs);
+	rss = resident() - rss;
+	printf("resident set growth: %ld kB, %.0f bytes per directory\n",
+	    rss, rss * 1024.0 / wentry.tree->ndirs);
+
+	tree_release(evq, &wentry);
+	tree_gc();
+	return EXIT_SUCCESS;
+}
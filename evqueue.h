@@ -0,0 +1,137 @@
+/* evqueue.h - kernel event queue abstraction */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The event loop only talks to the kernel through the functions below.
+ * Each backend implements all of them in its own module, and the Makefile
+ * links exactly one of them, so calls are resolved at build time:
+ *   - evqueue_kqueue.c uses kqueue(2) with vnode, proc, timer and read
+ *     filters
+ *   - evqueue_linux.c uses inotify(7), pidfd_open(2) and timerfd_create(2)
+ *     multiplexed in epoll(7) along with watched readable descriptors
+ *
+ * All registrations are one-shot, except timers which are periodic until
+ * explicitly removed, persistent file watches which report every change
+ * until the file is unwatched, and readable descriptors which are reported
+ * on every wait while data or end-of-file is pending, until removed.
+ * Watching a file again with the same pointer, while its registration is
+ * still active, replaces the event set of that registration.
+ *
+ * Watching a directory for WEV_WRITE reports entries being added, removed
+ * or renamed in it. Backends that know which entry has changed give its
+ * name along with the event, others leave it null.
+ *
+ * Backends whose kernel queue of file events is bounded report an
+ * EVQ_LOST event when it has overflowed: any watched file may then have
+ * changed without an event.
+ *
+ * Registrations may be queued by the backend and submitted all together
+ * on the next evq_wait() call. A registration that fails then is reported
+ * by evq_wait() as an event with a non-zero error, so callers must handle
+ * failures both from the arming function and from the returned events.
+ */
+
+#ifndef FILEWATCHER_EVQUEUE_H
+#define FILEWATCHER_EVQUEUE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* enum evq_kind - what an event is about */
+enum evq_kind {
+	EVQ_FILE,			/* watched file has changed */
+	EVQ_PROC,			/* watched process has exited */
+	EVQ_TIMER,			/* timer has expired */
+	EVQ_READ,			/* watched descriptor is readable */
+	EVQ_LOST			/* file events have been dropped */
+};
+
+/* struct evq_event - an event returned by the kernel queue */
+struct evq_event {
+	enum evq_kind	kind;		/* type of event */
+	uintptr_t	ident;		/* file descriptor, pid or timer id */
+	u_int		events;		/* WEV_* set that happened (EVQ_FILE) */
+	int		error;		/* errno of a failed registration */
+	int		status;		/* wait status, or -1 if unknown (EVQ_PROC) */
+	void		*udata;		/* pointer provided when arming */
+	const char	*name;		/* changed entry of a watched directory,
+					 * when known, valid until next wait */
+};
+
+/* struct evqueue - opaque backend state */
+struct evqueue;
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* evq_new - create a new kernel event queue */
+struct evqueue *
+evq_new(void);
+
+/* evq_watch - wait for any of the WEV_* events on an open file */
+int
+evq_watch(struct evqueue *evq, int fd, u_int events, void *udata);
+
+/* evq_watch_persist - report WEV_* events on an open file until unwatched */
+int
+evq_watch_persist(struct evqueue *evq, int fd, u_int events, void *udata);
+
+/* evq_unwatch - forget a pending or persistent watch, before closing fd */
+void
+evq_unwatch(struct evqueue *evq, int fd, void *udata);
+
+/* evq_proc - wait for the given process to exit */
+int
+evq_proc(struct evqueue *evq, pid_t pid, void *udata);
+
+/* evq_read - report a descriptor whenever it is readable */
+int
+evq_read(struct evqueue *evq, int fd, void *udata);
+
+/* evq_read_off - stop reporting a readable descriptor, before closing it */
+void
+evq_read_off(struct evqueue *evq, int fd, void *udata);
+
+/* evq_timer - start a periodic timer with the given period */
+int
+evq_timer(struct evqueue *evq, uintptr_t ident, intptr_t ms, void *udata);
+
+/* evq_timer_off - stop a periodic timer */
+int
+evq_timer_off(struct evqueue *evq, uintptr_t ident);
+
+/* evq_changes - number of registrations submitted by the last wait */
+size_t
+evq_changes(struct evqueue *evq);
+
+/* evq_wait - block until at least one event is available or timeout */
+/*   A null timeout waits forever. Return the number of events stored,
+ *   at most n, 0 when the timeout has expired, or -1 on error. */
+int
+evq_wait(struct evqueue *evq, struct evq_event *events, size_t n,
+    const struct timespec *timeout);
+
+#endif /* ndef FILEWATCHER_EVQUEUE_H */
@@ -0,0 +1,314 @@
+/* evqueue_kqueue.c - kernel event queue backend on kqueue(2) */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include "evqueue.h"
+#include "log.h"
+#include "watchtab.h"
+
+/* WEV_* values are vnode fflags, so that no translation is needed */
+#if NOTE_DELETE != WEV_DELETE || NOTE_WRITE != WEV_WRITE \
+    || NOTE_EXTEND != WEV_EXTEND || NOTE_ATTRIB != WEV_ATTRIB \
+    || NOTE_LINK != WEV_LINK || NOTE_RENAME != WEV_RENAME \
+    || NOTE_REVOKE != WEV_REVOKE
+#error "WEV_* values do not match kqueue vnode fflags"
+#endif
+
+/* struct evqueue - backend state */
+struct evqueue {
+	int		kq;		/* file descriptor for the kernel queue */
+	struct kevent	*changes;	/* changelist for the next kevent() */
+	size_t		nchanges;	/* number of items in changes */
+	size_t		changes_cap;	/* allocated number of changes */
+	size_t		submitted;	/* number of changes in last kevent() */
+	struct kevent	*out;		/* buffer for events out of kevent() */
+	size_t		out_first;	/* first event not yet returned */
+	size_t		out_last;	/* index after the last event in out */
+	size_t		out_cap;	/* allocated number of events */
+};
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* add_change - append a change to the changelist */
+static int
+add_change(struct evqueue *evq, uintptr_t ident, short filter,
+    u_short flags, u_int fflags, intptr_t data, void *udata) {
+	if (evq->nchanges >= evq->changes_cap) {
+		size_t new_cap = evq->changes_cap ? evq->changes_cap * 2 : 64;
+		struct kevent *new_changes;
+
+		new_changes = realloc(evq->changes,
+		    new_cap * sizeof *new_changes);
+		if (!new_changes) {
+			log_alloc("kernel event changelist");
+			return -1;
+		}
+		evq->changes = new_changes;
+		evq->changes_cap = new_cap;
+	}
+
+	EV_SET(evq->changes + evq->nchanges, ident,
+	    filter, flags, fflags, data, udata);
+	evq->nchanges++;
+	return 0;
+}
+
+
+/* drop_fd - forget changes and events of a descriptor about to close */
+/*   Closing the file descriptor removes its filters, but a change not
+ *   yet submitted would then refer to a closed or reused descriptor. */
+static void
+drop_fd(struct evqueue *evq, short filter, int fd, void *udata) {
+	size_t i, j;
+
+	for (i = j = 0; i < evq->nchanges; i++) {
+		struct kevent *kev = evq->changes + i;
+		if (kev->filter == filter && kev->udata == udata
+		    && kev->ident == (uintptr_t)fd)
+			continue;
+		if (i != j) evq->changes[j] = *kev;
+		j++;
+	}
+	evq->nchanges = j;
+
+	/* Drop events not yet returned */
+	for (i = evq->out_first; i < evq->out_last; i++)
+		if (evq->out[i].filter == filter
+		    && evq->out[i].udata == udata
+		    && evq->out[i].ident == (uintptr_t)fd)
+			evq->out[i].udata = evq;
+}
+
+
+/* set_event - convert a kevent into an evq_event */
+static void
+set_event(struct evq_event *event, const struct kevent *kev) {
+	switch (kev->filter) {
+	    case EVFILT_VNODE:
+		event->kind = EVQ_FILE;
+		break;
+	    case EVFILT_PROC:
+		event->kind = EVQ_PROC;
+		break;
+	    case EVFILT_READ:
+		event->kind = EVQ_READ;
+		break;
+	    default:
+		event->kind = EVQ_TIMER;
+		break;
+	}
+	event->ident = kev->ident;
+	event->events = kev->fflags & WEV_ALL;
+	event->error = (kev->flags & EV_ERROR) ? (int)kev->data : 0;
+	event->status = (kev->filter == EVFILT_PROC && !event->error
+	    && (kev->fflags & NOTE_EXIT)) ? (int)kev->data : -1;
+	event->udata = kev->udata;
+	event->name = 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* evq_new - create a new kernel event queue */
+struct evqueue *
+evq_new(void) {
+	struct evqueue *evq;
+
+	/* Processes are waited through the kernel queue, never reaped */
+	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
+		log_signal(SIGCHLD);
+		return 0;
+	}
+
+	evq = calloc(1, sizeof *evq);
+	if (!evq) {
+		log_alloc("event queue");
+		return 0;
+	}
+
+	evq->kq = kqueue();
+	if (evq->kq == -1) {
+		log_evqueue("kqueue");
+		free(evq);
+		return 0;
+	}
+
+	return evq;
+}
+
+
+/* evq_watch - wait for any of the WEV_* events on an open file */
+int
+evq_watch(struct evqueue *evq, int fd, u_int events, void *udata) {
+	return add_change(evq, fd,
+	    EVFILT_VNODE,
+	    EV_ADD | EV_ONESHOT,
+	    events,
+	    0,
+	    udata);
+}
+
+
+/* evq_watch_persist - report WEV_* events on an open file until unwatched */
+/*   Changes between two waits are merged into a single event. */
+int
+evq_watch_persist(struct evqueue *evq, int fd, u_int events, void *udata) {
+	return add_change(evq, fd,
+	    EVFILT_VNODE,
+	    EV_ADD | EV_CLEAR,
+	    events,
+	    0,
+	    udata);
+}
+
+
+/* evq_unwatch - forget a pending or persistent watch, before closing fd */
+void
+evq_unwatch(struct evqueue *evq, int fd, void *udata) {
+	drop_fd(evq, EVFILT_VNODE, fd, udata);
+}
+
+
+/* evq_proc - wait for the given process to exit */
+int
+evq_proc(struct evqueue *evq, pid_t pid, void *udata) {
+	return add_change(evq, pid,
+	    EVFILT_PROC,
+	    EV_ADD | EV_ONESHOT,
+	    NOTE_EXIT,
+	    0,
+	    udata);
+}
+
+
+/* evq_read - report a descriptor whenever it is readable */
+int
+evq_read(struct evqueue *evq, int fd, void *udata) {
+	return add_change(evq, fd,
+	    EVFILT_READ,
+	    EV_ADD,
+	    0,
+	    0,
+	    udata);
+}
+
+
+/* evq_read_off - stop reporting a readable descriptor, before closing it */
+void
+evq_read_off(struct evqueue *evq, int fd, void *udata) {
+	drop_fd(evq, EVFILT_READ, fd, udata);
+}
+
+
+/* evq_timer - start a periodic timer with the given period */
+int
+evq_timer(struct evqueue *evq, uintptr_t ident, intptr_t ms, void *udata) {
+	return add_change(evq, ident,
+	    EVFILT_TIMER,
+	    EV_ADD,
+	    0,
+	    ms,
+	    udata);
+}
+
+
+/* evq_timer_off - stop a periodic timer */
+int
+evq_timer_off(struct evqueue *evq, uintptr_t ident) {
+	size_t i;
+
+	/* Drop expirations not yet returned */
+	for (i = evq->out_first; i < evq->out_last; i++)
+		if (evq->out[i].filter == EVFILT_TIMER
+		    && evq->out[i].ident == ident)
+			evq->out[i].udata = evq;
+
+	return add_change(evq, ident, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
+}
+
+
+/* evq_changes - number of registrations submitted by the last wait */
+size_t
+evq_changes(struct evqueue *evq) {
+	return evq->submitted;
+}
+
+
+/* evq_wait - block until at least one event is available or timeout */
+int
+evq_wait(struct evqueue *evq, struct evq_event *events, size_t n,
+    const struct timespec *timeout) {
+	size_t count = 0, size;
+	int result;
+
+	evq->submitted = 0;
+
+	while (count == 0) {
+		/* Return events left over from the previous call */
+		while (count < n && evq->out_first < evq->out_last) {
+			struct kevent *kev = evq->out + evq->out_first++;
+			if (kev->udata != evq)
+				set_event(events + count++, kev);
+		}
+		if (count > 0) break;
+
+		/* Make room for errors from the changelist */
+		size = n + evq->nchanges;
+		if (size > evq->out_cap) {
+			struct kevent *new_out;
+
+			new_out = realloc(evq->out, size * sizeof *new_out);
+			if (!new_out) {
+				log_alloc("kernel event buffer");
+				return -1;
+			}
+			evq->out = new_out;
+			evq->out_cap = size;
+		}
+
+		/* Submit all changes and wait in a single call */
+		result = kevent(evq->kq, evq->changes, (int)evq->nchanges,
+		    evq->out, (int)size, timeout);
+		if (result < 0 && errno != EINTR) return -1;
+
+		/* Changes are processed even when the wait is interrupted */
+		evq->submitted += evq->nchanges;
+		evq->nchanges = 0;
+		evq->out_first = 0;
+		evq->out_last = result < 0 ? 0 : (size_t)result;
+
+		/* Let the caller handle its deadlines */
+		if (result <= 0 && timeout) break;
+	}
+
+	return (int)count;
+}
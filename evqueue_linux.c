@@ -0,0 +1,840 @@
+/* evqueue_linux.c - kernel event queue backend on inotify and epoll */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * inotify watches inodes rather than file descriptors, and a given inode
+ * has a single watch descriptor per inotify instance. So the open file
+ * descriptor is only used to reach the exact inode through /proc/self/fd,
+ * and every watch descriptor keeps a list of subscribers, each with its
+ * own event set, emulating one-shot kqueue filters in user space.
+ *
+ * Processes are tracked through pidfds, which requires them to stay
+ * zombies until the pidfd is readable, so SIGCHLD is not ignored here.
+ *
+ * Readable descriptors are added to epoll directly, level-triggered, as
+ * kqueue read filters are.
+ *
+ * Linux has no system call to submit several registrations at once, so
+ * they are applied immediately and only counted for evq_changes().
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "evqueue.h"
+#include "log.h"
+#include "watchtab.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* size of the buffer for reading inotify events */
+#define INOTIFY_BUFSIZE 16384
+
+/* maximum number of epoll events fetched at once */
+#define EPOLL_MAXEVENTS 64
+
+/* initial number of watch descriptor hash buckets, must be a power of 2 */
+#define WATCH_BUCKETS 64
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct lsub - subscriber to an inotify watch descriptor */
+struct lsub {
+	int		fd;		/* file descriptor of the watched file */
+	u_int		events;		/* WEV_* set to report */
+	int		persist;	/* whether kept after firing */
+	void		*udata;		/* user pointer */
+	struct lsub	*next;
+};
+
+/* struct lwatch - inotify watch descriptor and its subscribers */
+struct lwatch {
+	int		wd;		/* inotify watch descriptor */
+	struct lsub	*subs;		/* list of subscribers */
+	struct lwatch	*next;		/* hash bucket chain */
+};
+
+/* struct lpending - event read from the kernel but not yet returned */
+struct lpending {
+	struct evq_event ev;		/* the event itself, name left null */
+	size_t		name;		/* offset of the name plus one, or 0 */
+};
+
+/* struct lsource - pidfd, timerfd or readable fd registered in epoll */
+struct lsource {
+	enum evq_kind	kind;		/* EVQ_PROC, EVQ_TIMER or EVQ_READ */
+	int		fd;		/* pidfd, timerfd or watched fd */
+	uintptr_t	ident;		/* pid, timer identifier or fd */
+	void		*udata;		/* user pointer */
+	struct lsource	*next;		/* list of active timers or readers */
+};
+
+/* struct evqueue - backend state */
+struct evqueue {
+	int		epfd;		/* epoll instance */
+	int		ifd;		/* inotify instance */
+	struct lwatch	**watches;	/* hash table of watch descriptors */
+	size_t		nbuckets;	/* number of hash buckets */
+	size_t		nwatches;	/* number of watch descriptors */
+	int		*fd_wd;		/* watch descriptor of each fd */
+	size_t		fd_wd_size;	/* number of items in fd_wd */
+	struct lsource	*timers;	/* list of active timers */
+	struct lsource	*readers;	/* list of watched readable fds */
+	size_t		changes;	/* registrations since the last wait */
+	size_t		submitted;	/* registrations before the last wait */
+	struct lpending	*pending;	/* events not yet returned */
+	size_t		pending_first;	/* index of the first pending event */
+	size_t		pending_last;	/* index after the last pending event */
+	size_t		pending_cap;	/* number of items in pending */
+	char		*names;		/* names of pending events */
+	size_t		names_len;	/* number of bytes used in names */
+	size_t		names_cap;	/* number of bytes allocated in names */
+};
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* to_inotify - convert a WEV_* set into an inotify mask */
+static uint32_t
+to_inotify(u_int events) {
+	uint32_t mask = 0;
+
+	/* unlink only reports IN_ATTRIB while the file is still open */
+	if (events & WEV_DELETE) mask |= IN_DELETE_SELF | IN_ATTRIB;
+	if (events & (WEV_WRITE | WEV_EXTEND)) mask |= IN_MODIFY;
+	/* directory entry changes, never reported on other files */
+	if (events & WEV_WRITE)
+		mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+	if (events & (WEV_ATTRIB | WEV_LINK)) mask |= IN_ATTRIB;
+	if (events & WEV_RENAME) mask |= IN_MOVE_SELF;
+	/* IN_UNMOUNT, standing for WEV_REVOKE, is always reported */
+
+	return mask;
+}
+
+
+/* from_inotify - convert an inotify mask into a WEV_* set */
+/*   child is non-zero when the event is about an entry of a watched
+ *   directory rather than the watched inode itself. */
+static u_int
+from_inotify(uint32_t mask, int fd, int child) {
+	u_int events = 0;
+
+	if (mask & IN_DELETE_SELF) events |= WEV_DELETE;
+	if (mask & IN_MODIFY) events |= WEV_WRITE | WEV_EXTEND;
+	if (mask & IN_MOVE_SELF) events |= WEV_RENAME;
+	if (mask & (IN_UNMOUNT | IN_IGNORED)) events |= WEV_REVOKE;
+	if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+		/* like kqueue, subdirectories change the link count */
+		events |= WEV_WRITE;
+		if (mask & IN_ISDIR) events |= WEV_LINK;
+	}
+	if (mask & IN_ATTRIB) {
+		struct stat st;
+
+		events |= WEV_ATTRIB | WEV_LINK;
+		if (!child && fstat(fd, &st) == 0 && st.st_nlink == 0)
+			events |= WEV_DELETE;
+	}
+
+	return events;
+}
+
+
+/* push_event - append an event to the pending list */
+/*   name is the changed directory entry, or null. */
+static int
+push_event(struct evqueue *evq, enum evq_kind kind, uintptr_t ident,
+    u_int events, void *udata, const char *name) {
+	struct lpending *pending;
+	struct evq_event *ev;
+
+	/* Reuse the buffers from the start when they have been drained,
+	 * names returned by the previous wait are not used anymore */
+	if (evq->pending_first == evq->pending_last) {
+		evq->pending_first = evq->pending_last = 0;
+		evq->names_len = 0;
+	}
+
+	if (evq->pending_last >= evq->pending_cap) {
+		size_t new_cap = evq->pending_cap ? evq->pending_cap * 2 : 64;
+		struct lpending *new_pending;
+
+		new_pending = realloc(evq->pending,
+		    new_cap * sizeof *new_pending);
+		if (!new_pending) {
+			log_alloc("pending events");
+			return -1;
+		}
+		evq->pending = new_pending;
+		evq->pending_cap = new_cap;
+	}
+
+	pending = evq->pending + evq->pending_last;
+	pending->name = 0;
+	if (name) {
+		size_t len = strlen(name) + 1;
+
+		if (evq->names_len + len > evq->names_cap) {
+			size_t new_cap = evq->names_cap ? evq->names_cap : 4096;
+			char *new_names;
+
+			while (new_cap < evq->names_len + len) new_cap *= 2;
+			new_names = realloc(evq->names, new_cap);
+			if (!new_names) {
+				log_alloc("pending event names");
+				return -1;
+			}
+			evq->names = new_names;
+			evq->names_cap = new_cap;
+		}
+		memcpy(evq->names + evq->names_len, name, len);
+		pending->name = evq->names_len + 1;
+		evq->names_len += len;
+	}
+
+	evq->pending_last++;
+	ev = &pending->ev;
+	ev->kind = kind;
+	ev->ident = ident;
+	ev->events = events;
+	ev->error = 0;
+	ev->status = -1;
+	ev->udata = udata;
+	ev->name = 0;
+	return 0;
+}
+
+
+/* watch_bucket - return the hash bucket for a watch descriptor */
+static struct lwatch **
+watch_bucket(struct evqueue *evq, int wd) {
+	return evq->watches + ((size_t)wd & (evq->nbuckets - 1));
+}
+
+
+/* watch_find - lookup the structure for a given watch descriptor */
+static struct lwatch *
+watch_find(struct evqueue *evq, int wd) {
+	struct lwatch *watch = *watch_bucket(evq, wd);
+
+	while (watch && watch->wd != wd)
+		watch = watch->next;
+	return watch;
+}
+
+
+/* watch_grow - double the number of hash buckets */
+static int
+watch_grow(struct evqueue *evq) {
+	struct lwatch **old = evq->watches;
+	size_t old_size = evq->nbuckets, i;
+
+	evq->watches = calloc(old_size * 2, sizeof *evq->watches);
+	if (!evq->watches) {
+		evq->watches = old;
+		return -1;
+	}
+	evq->nbuckets = old_size * 2;
+
+	for (i = 0; i < old_size; i++) {
+		while (old[i]) {
+			struct lwatch *watch = old[i];
+			struct lwatch **bucket = watch_bucket(evq, watch->wd);
+			old[i] = watch->next;
+			watch->next = *bucket;
+			*bucket = watch;
+		}
+	}
+
+	free(old);
+	return 0;
+}
+
+
+/* watch_drop - remove a watch structure and its subscribers */
+static void
+watch_drop(struct evqueue *evq, struct lwatch *watch) {
+	struct lwatch **prev = watch_bucket(evq, watch->wd);
+
+	while (*prev != watch)
+		prev = &(*prev)->next;
+	*prev = watch->next;
+
+	while (watch->subs) {
+		struct lsub *sub = watch->subs;
+		watch->subs = sub->next;
+		free(sub);
+	}
+
+	free(watch);
+	evq->nwatches--;
+}
+
+
+/* read_inotify - turn all available inotify events into pending events */
+static int
+read_inotify(struct evqueue *evq) {
+	char buf[INOTIFY_BUFSIZE]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *iev;
+	ssize_t len;
+	char *ptr;
+
+	while (1) {
+		len = read(evq->ifd, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+		if (len <= 0)
+			return -1;
+
+		for (ptr = buf; ptr < buf + len;
+		    ptr += sizeof *iev + iev->len) {
+			struct lwatch *watch;
+			struct lsub **prev, *sub;
+			u_int events;
+
+			iev = (const struct inotify_event *)ptr;
+
+			/* Events are gone, the caller checks everything */
+			if (iev->mask & IN_Q_OVERFLOW) {
+				if (push_event(evq, EVQ_LOST, 0, 0, 0, 0) < 0)
+					return -1;
+				continue;
+			}
+
+			watch = watch_find(evq, iev->wd);
+			if (!watch || !watch->subs) continue;
+
+			/* Fire matching subscribers, removing one-shot ones */
+			events = from_inotify(iev->mask, watch->subs->fd,
+			    iev->len > 0);
+			prev = &watch->subs;
+			while ((sub = *prev) != 0) {
+				if (!(sub->events & events)) {
+					prev = &sub->next;
+					continue;
+				}
+				if (push_event(evq, EVQ_FILE, sub->fd,
+				    sub->events & events, sub->udata,
+				    iev->len > 0 ? iev->name : 0) < 0)
+					return -1;
+				if (sub->persist && !(iev->mask & IN_IGNORED)) {
+					prev = &sub->next;
+					continue;
+				}
+				*prev = sub->next;
+				free(sub);
+			}
+
+			/* The kernel has already dropped the watch */
+			if (iev->mask & IN_IGNORED) {
+				watch_drop(evq, watch);
+				continue;
+			}
+
+			/* Remove the watch when nobody listens anymore */
+			if (!watch->subs) {
+				inotify_rm_watch(evq->ifd, watch->wd);
+				watch_drop(evq, watch);
+			}
+		}
+	}
+}
+
+
+/* read_source - handle a readable pidfd, timerfd or watched fd */
+static int
+read_source(struct evqueue *evq, struct lsource *src) {
+	int status;
+
+	/* Reading is left to the caller, level-triggering reports it again */
+	if (src->kind == EVQ_READ)
+		return push_event(evq, EVQ_READ, src->ident, 0, src->udata,
+		    0);
+
+	if (src->kind == EVQ_TIMER) {
+		uint64_t expirations;
+
+		if (read(src->fd, &expirations, sizeof expirations) < 0
+		    && errno != EAGAIN)
+			return -1;
+		return push_event(evq, EVQ_TIMER, src->ident, 0, src->udata,
+		    0);
+	}
+
+	/* Process has exited, reap it and forget the pidfd */
+	if (waitpid((pid_t)src->ident, &status, WNOHANG) != (pid_t)src->ident)
+		status = -1;
+	epoll_ctl(evq->epfd, EPOLL_CTL_DEL, src->fd, 0);
+	close(src->fd);
+	if (push_event(evq, EVQ_PROC, src->ident, 0, src->udata, 0) < 0) {
+		free(src);
+		return -1;
+	}
+	evq->pending[evq->pending_last - 1].ev.status = status;
+	free(src);
+	return 0;
+}
+
+
+/* add_watch - subscribe to the inode behind an open file */
+static int
+add_watch(struct evqueue *evq, int fd, u_int events, int persist,
+    void *udata) {
+	char proc_path[64];
+	struct lwatch *watch;
+	struct lsub *sub;
+	int wd;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	/* Reach the inode behind fd, extending an existing mask if any */
+	snprintf(proc_path, sizeof proc_path, "/proc/self/fd/%d", fd);
+	wd = inotify_add_watch(evq->ifd, proc_path,
+	    to_inotify(events) | IN_MASK_ADD);
+	if (wd < 0) return -1;
+
+	/* Remember which watch descriptor the fd belongs to */
+	if ((size_t)fd >= evq->fd_wd_size) {
+		size_t new_size = evq->fd_wd_size ? evq->fd_wd_size : 64;
+		int *new_fd_wd;
+
+		while (new_size <= (size_t)fd) new_size *= 2;
+		new_fd_wd = realloc(evq->fd_wd, new_size * sizeof *new_fd_wd);
+		if (!new_fd_wd) {
+			log_alloc("inotify watch table");
+			return -1;
+		}
+		evq->fd_wd = new_fd_wd;
+		evq->fd_wd_size = new_size;
+	}
+	evq->fd_wd[fd] = wd;
+
+	/* Lookup or create the watch structure */
+	watch = watch_find(evq, wd);
+	if (!watch) {
+		if (evq->nwatches >= evq->nbuckets * 2)
+			watch_grow(evq);
+		watch = malloc(sizeof *watch);
+		if (!watch) {
+			log_alloc("inotify watch");
+			return -1;
+		}
+		watch->wd = wd;
+		watch->subs = 0;
+		watch->next = *watch_bucket(evq, wd);
+		*watch_bucket(evq, wd) = watch;
+		evq->nwatches++;
+	}
+
+	/* Arming again replaces the event set, as EV_ADD does on kqueue */
+	for (sub = watch->subs; sub; sub = sub->next) {
+		if (sub->fd == fd && sub->udata == udata) {
+			sub->events = events;
+			sub->persist = persist;
+			evq->changes++;
+			return 0;
+		}
+	}
+
+	/* Add the subscriber */
+	sub = malloc(sizeof *sub);
+	if (!sub) {
+		log_alloc("inotify subscriber");
+		return -1;
+	}
+	sub->fd = fd;
+	sub->events = events;
+	sub->persist = persist;
+	sub->udata = udata;
+	sub->next = watch->subs;
+	watch->subs = sub;
+	evq->changes++;
+	return 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* evq_new - create a new kernel event queue */
+struct evqueue *
+evq_new(void) {
+	struct epoll_event ev;
+	struct evqueue *evq;
+
+	/* Processes are reaped when their pidfd becomes readable */
+	if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+		log_signal(SIGCHLD);
+		return 0;
+	}
+
+	evq = calloc(1, sizeof *evq);
+	if (!evq) {
+		log_alloc("event queue");
+		return 0;
+	}
+
+	evq->nbuckets = WATCH_BUCKETS;
+	evq->watches = calloc(evq->nbuckets, sizeof *evq->watches);
+	if (!evq->watches) {
+		log_alloc("event queue");
+		free(evq);
+		return 0;
+	}
+
+	evq->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (evq->epfd < 0) {
+		log_evqueue("epoll_create1");
+		free(evq->watches);
+		free(evq);
+		return 0;
+	}
+
+	evq->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (evq->ifd < 0) {
+		log_evqueue("inotify_init1");
+		close(evq->epfd);
+		free(evq->watches);
+		free(evq);
+		return 0;
+	}
+
+	/* The inotify instance is the only source with a null pointer */
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if (epoll_ctl(evq->epfd, EPOLL_CTL_ADD, evq->ifd, &ev) < 0) {
+		log_evqueue("epoll_ctl");
+		close(evq->ifd);
+		close(evq->epfd);
+		free(evq->watches);
+		free(evq);
+		return 0;
+	}
+
+	return evq;
+}
+
+
+/* evq_watch - wait for any of the WEV_* events on an open file */
+int
+evq_watch(struct evqueue *evq, int fd, u_int events, void *udata) {
+	return add_watch(evq, fd, events, 0, udata);
+}
+
+
+/* evq_watch_persist - report WEV_* events on an open file until unwatched */
+/*   Unlike kqueue, every inotify event is reported on its own. */
+int
+evq_watch_persist(struct evqueue *evq, int fd, u_int events, void *udata) {
+	return add_watch(evq, fd, events, 1, udata);
+}
+
+
+/* evq_unwatch - forget a pending or persistent watch, before closing fd */
+void
+evq_unwatch(struct evqueue *evq, int fd, void *udata) {
+	struct lwatch *watch;
+	struct lsub **prev, *sub;
+	size_t i;
+
+	/* Drop events not yet returned */
+	for (i = evq->pending_first; i < evq->pending_last; i++)
+		if (evq->pending[i].ev.kind == EVQ_FILE
+		    && evq->pending[i].ev.udata == udata
+		    && evq->pending[i].ev.ident == (uintptr_t)fd)
+			evq->pending[i].ev.udata = evq;
+
+	if (fd < 0 || (size_t)fd >= evq->fd_wd_size) return;
+	watch = watch_find(evq, evq->fd_wd[fd]);
+	if (!watch) return;
+
+	for (prev = &watch->subs; (sub = *prev) != 0; prev = &sub->next) {
+		if (sub->fd == fd && sub->udata == udata) {
+			*prev = sub->next;
+			free(sub);
+			break;
+		}
+	}
+
+	if (!watch->subs) {
+		inotify_rm_watch(evq->ifd, watch->wd);
+		watch_drop(evq, watch);
+	}
+}
+
+
+/* evq_proc - wait for the given process to exit */
+int
+evq_proc(struct evqueue *evq, pid_t pid, void *udata) {
+	struct epoll_event ev;
+	struct lsource *src;
+	int fd;
+
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0) return -1;
+
+	src = malloc(sizeof *src);
+	if (!src) {
+		log_alloc("process watcher");
+		close(fd);
+		return -1;
+	}
+	src->kind = EVQ_PROC;
+	src->fd = fd;
+	src->ident = (uintptr_t)pid;
+	src->udata = udata;
+	src->next = 0;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(evq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(src);
+		return -1;
+	}
+
+	evq->changes++;
+	return 0;
+}
+
+
+/* evq_read - report a descriptor whenever it is readable */
+int
+evq_read(struct evqueue *evq, int fd, void *udata) {
+	struct epoll_event ev;
+	struct lsource *src;
+
+	src = malloc(sizeof *src);
+	if (!src) {
+		log_alloc("descriptor watcher");
+		return -1;
+	}
+	src->kind = EVQ_READ;
+	src->fd = fd;
+	src->ident = (uintptr_t)fd;
+	src->udata = udata;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(evq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(src);
+		return -1;
+	}
+
+	src->next = evq->readers;
+	evq->readers = src;
+	evq->changes++;
+	return 0;
+}
+
+
+/* evq_read_off - stop reporting a readable descriptor, before closing it */
+void
+evq_read_off(struct evqueue *evq, int fd, void *udata) {
+	struct lsource **prev, *src;
+	size_t i;
+
+	for (prev = &evq->readers; (src = *prev) != 0; prev = &src->next)
+		if (src->fd == fd && src->udata == udata) break;
+	if (!src) return;
+
+	*prev = src->next;
+	evq->changes++;
+	epoll_ctl(evq->epfd, EPOLL_CTL_DEL, fd, 0);
+	free(src);
+
+	/* Drop events not yet returned */
+	for (i = evq->pending_first; i < evq->pending_last; i++)
+		if (evq->pending[i].ev.kind == EVQ_READ
+		    && evq->pending[i].ev.ident == (uintptr_t)fd
+		    && evq->pending[i].ev.udata == udata)
+			evq->pending[i].ev.udata = evq;
+}
+
+
+/* evq_timer - start a periodic timer with the given period */
+int
+evq_timer(struct evqueue *evq, uintptr_t ident, intptr_t ms, void *udata) {
+	struct itimerspec its;
+	struct epoll_event ev;
+	struct lsource *src;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) return -1;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(fd, 0, &its, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	src = malloc(sizeof *src);
+	if (!src) {
+		log_alloc("timer");
+		close(fd);
+		return -1;
+	}
+	src->kind = EVQ_TIMER;
+	src->fd = fd;
+	src->ident = ident;
+	src->udata = udata;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(evq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(src);
+		return -1;
+	}
+
+	src->next = evq->timers;
+	evq->timers = src;
+	evq->changes++;
+	return 0;
+}
+
+
+/* evq_timer_off - stop a periodic timer */
+int
+evq_timer_off(struct evqueue *evq, uintptr_t ident) {
+	struct lsource **prev, *src;
+	size_t i;
+
+	for (prev = &evq->timers; (src = *prev) != 0; prev = &src->next)
+		if (src->ident == ident) break;
+	if (!src) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*prev = src->next;
+	evq->changes++;
+	epoll_ctl(evq->epfd, EPOLL_CTL_DEL, src->fd, 0);
+	close(src->fd);
+	free(src);
+
+	/* Drop expirations not yet returned */
+	for (i = evq->pending_first; i < evq->pending_last; i++)
+		if (evq->pending[i].ev.kind == EVQ_TIMER
+		    && evq->pending[i].ev.ident == ident)
+			evq->pending[i].ev.udata = evq;
+
+	return 0;
+}
+
+
+/* evq_changes - number of registrations submitted by the last wait */
+size_t
+evq_changes(struct evqueue *evq) {
+	return evq->submitted;
+}
+
+
+/* evq_wait - block until at least one event is available or timeout */
+int
+evq_wait(struct evqueue *evq, struct evq_event *events, size_t n,
+    const struct timespec *timeout) {
+	struct epoll_event evs[EPOLL_MAXEVENTS];
+	size_t count = 0;
+	int i, nev, ms = -1;
+
+	/* Round up, so that deadlines have expired when returning */
+	if (timeout) {
+		if (timeout->tv_sec >= INT_MAX / 1000 - 1)
+			ms = INT_MAX;
+		else
+			ms = (int)(timeout->tv_sec * 1000
+			    + (timeout->tv_nsec + 999999) / 1000000);
+	}
+
+	/* Registrations are applied immediately, only count them */
+	evq->submitted = evq->changes;
+	evq->changes = 0;
+
+	while (count == 0) {
+		/* Return pending events, skipping cancelled ones */
+		while (count < n && evq->pending_first < evq->pending_last) {
+			struct lpending *pending
+			    = evq->pending + evq->pending_first++;
+			if (pending->ev.udata == evq)
+				continue;
+			events[count] = pending->ev;
+			if (pending->name)
+				events[count].name
+				    = evq->names + pending->name - 1;
+			count++;
+		}
+		if (count > 0) break;
+
+		/* Wait for the kernel */
+		nev = epoll_wait(evq->epfd, evs,
+		    n < EPOLL_MAXEVENTS ? (int)n : EPOLL_MAXEVENTS, ms);
+		if (nev < 0 && errno != EINTR) return -1;
+
+		/* Let the caller handle its deadlines */
+		if (nev <= 0) {
+			if (timeout) break;
+			continue;
+		}
+
+		for (i = 0; i < nev; i++) {
+			if (!evs[i].data.ptr) {
+				if (read_inotify(evq) < 0) return -1;
+			}
+			else if (read_source(evq, evs[i].data.ptr) < 0)
+				return -1;
+		}
+	}
+
+	return (int)count;
+}
@@ -0,0 +1,771 @@
+/* fanout.c - shared watches of files armed by several entries */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "fanout.h"
+#include "log.h"
+
+/* initial number of hash buckets, must be a power of 2 */
+#define FANOUT_BUCKETS 64
+
+/* events making persistent subscribers resolve their path again */
+#define FANOUT_LEAVE (WEV_DELETE | WEV_RENAME | WEV_REVOKE)
+
+/* events of a directory making waiters look for their path again */
+#define FANOUT_WAIT (WEV_WRITE | WEV_DELETE | WEV_RENAME | WEV_REVOKE)
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* watched files, hashed on inode or path */
+static struct watch_file **buckets = 0;
+
+/* number of hash buckets, a power of 2 */
+static size_t nbuckets = 0;
+
+/* number of watched files */
+static size_t nfiles = 0;
+
+/* files dropped during the current batch */
+static struct watch_file *dropped = 0;
+
+/* entries armed on a file that has changed since they left it */
+static struct fanout_subs caught = LIST_HEAD_INITIALIZER(caught);
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* entry_events - events a subscriber needs from the registration */
+static u_int
+entry_events(const struct watch_entry *wentry) {
+	return wentry->persist == WPERSIST_NONE
+	    ? wentry->events : wentry->events | FANOUT_LEAVE;
+}
+
+
+/* entry_leaves - whether an event ends the subscription of an entry */
+static int
+entry_leaves(const struct watch_entry *wentry, u_int events) {
+	if (events & WEV_REVOKE)
+		return 1;
+
+	switch (wentry->persist) {
+	    case WPERSIST_PATH:
+		return (events & (WEV_DELETE | WEV_RENAME)) != 0;
+	    case WPERSIST_INODE:
+		return (events & WEV_DELETE) != 0;
+	    default:
+		return (events & wentry->events) != 0;
+	}
+}
+
+
+/* waiter_wakes - whether a directory event may concern a waiting entry */
+/*   Without the name of the changed entry, any change may. */
+static int
+waiter_wakes(const struct watch_entry *wentry, const struct evq_event *event) {
+	if (event->events & (WEV_DELETE | WEV_RENAME | WEV_REVOKE))
+		return 1;
+	if (!(event->events & WEV_WRITE))
+		return 0;
+
+	return !event->name
+	    || (strlen(event->name) == wentry->wait_len
+	     && memcmp(event->name, wentry->path + wentry->wait_name,
+	      wentry->wait_len) == 0);
+}
+
+
+/* snap_take - record the state of a file */
+static void
+snap_take(struct watch_snap *snap, const struct stat *st) {
+	snap->valid = 1;
+	snap->dev = st->st_dev;
+	snap->ino = st->st_ino;
+	snap->size = st->st_size;
+	snap->nlink = st->st_nlink;
+	snap->mtime = st->st_mtim;
+	snap->ctime = st->st_ctim;
+}
+
+
+/* snap_changes - WEV_* set of the differences with the current state */
+/*   A file replaced under the path counts as deleted and written. */
+static u_int
+snap_changes(const struct watch_snap *snap, const struct stat *st) {
+	u_int events = 0;
+
+	if (snap->dev != st->st_dev || snap->ino != st->st_ino)
+		return WEV_DELETE | WEV_WRITE;
+
+	if (snap->size < st->st_size)
+		events |= WEV_WRITE | WEV_EXTEND;
+	else if (snap->size != st->st_size
+	    || snap->mtime.tv_sec != st->st_mtim.tv_sec
+	    || snap->mtime.tv_nsec != st->st_mtim.tv_nsec)
+		events |= WEV_WRITE;
+	else if (snap->ctime.tv_sec != st->st_ctim.tv_sec
+	    || snap->ctime.tv_nsec != st->st_ctim.tv_nsec)
+		events |= WEV_ATTRIB;
+	if (snap->nlink != st->st_nlink)
+		events |= WEV_LINK;
+
+	return events;
+}
+
+
+/* hash_inode - hash a file on its device and inode */
+static size_t
+hash_inode(dev_t dev, ino_t ino) {
+	uint64_t hash = (uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)ino;
+
+	hash *= 0xff51afd7ed558ccdULL;
+	return (size_t)(hash ^ hash >> 32);
+}
+
+
+/* hash_path - hash a file on its path */
+static size_t
+hash_path(const char *path) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (size_t)hash;
+}
+
+
+/* file_bucket - return the hash bucket of a file */
+static struct watch_file **
+file_bucket(const struct watch_file *file) {
+	size_t hash = file->by_path
+	    ? hash_path(file->path) : hash_inode(file->dev, file->ino);
+
+	return buckets + (hash & (nbuckets - 1));
+}
+
+
+/* find_inode - lookup a watched file by device and inode */
+static struct watch_file *
+find_inode(dev_t dev, ino_t ino) {
+	struct watch_file *file;
+
+	if (!nbuckets) return 0;
+	file = buckets[hash_inode(dev, ino) & (nbuckets - 1)];
+	while (file && (file->by_path || file->dev != dev || file->ino != ino))
+		file = file->hnext;
+	return file;
+}
+
+
+/* find_path - lookup a watched file that could not be inspected */
+static struct watch_file *
+find_path(const char *path) {
+	struct watch_file *file;
+
+	if (!nbuckets) return 0;
+	file = buckets[hash_path(path) & (nbuckets - 1)];
+	while (file && (!file->by_path || strcmp(file->path, path) != 0))
+		file = file->hnext;
+	return file;
+}
+
+
+/* grow_files - double the number of hash buckets */
+static void
+grow_files(void) {
+	struct watch_file **old = buckets, *file;
+	size_t old_size = nbuckets, i;
+	struct watch_file **bucket;
+
+	buckets = calloc(old_size * 2, sizeof *buckets);
+	if (!buckets) {
+		/* Longer chains are still correct */
+		buckets = old;
+		return;
+	}
+	nbuckets = old_size * 2;
+
+	for (i = 0; i < old_size; i++) {
+		while ((file = old[i]) != 0) {
+			old[i] = file->hnext;
+			bucket = file_bucket(file);
+			file->hnext = *bucket;
+			*bucket = file;
+		}
+	}
+
+	free(old);
+}
+
+
+/* new_file - index a newly opened file */
+/*   st is null when the file could not be inspected. */
+static struct watch_file *
+new_file(int fd, const struct stat *st, const char *path) {
+	size_t len = strlen(path);
+	struct watch_file *file, **bucket;
+
+	if (!nbuckets) {
+		buckets = calloc(FANOUT_BUCKETS, sizeof *buckets);
+		if (!buckets) {
+			log_alloc("watched file table");
+			return 0;
+		}
+		nbuckets = FANOUT_BUCKETS;
+	}
+	else if (nfiles >= nbuckets)
+		grow_files();
+
+	file = malloc(sizeof *file + len + 1);
+	if (!file) {
+		log_alloc("watched file");
+		return 0;
+	}
+	file->node = WNODE_FILE;
+	file->fd = fd;
+	file->dev = st ? st->st_dev : 0;
+	file->ino = st ? st->st_ino : 0;
+	file->by_path = !st;
+	file->events = 0;
+	LIST_INIT(&file->subs);
+	LIST_INIT(&file->waiters);
+	memcpy(file->path, path, len + 1);
+
+	bucket = file_bucket(file);
+	file->hnext = *bucket;
+	*bucket = file;
+	nfiles++;
+	return file;
+}
+
+
+/* index_file - find or index the file opened at a path */
+/*   fd is closed unless it becomes the descriptor of a new file, st is
+ *   filled and known set when the file can be inspected. */
+static struct watch_file *
+index_file(int fd, const char *path, struct stat *st, int *known) {
+	struct watch_file *file;
+
+	/* The path may have been replaced since stat() */
+	*known = fstat(fd, st) == 0;
+	if (*known) {
+		file = find_inode(st->st_dev, st->st_ino);
+		if (!file)
+			file = new_file(fd, st, path);
+	}
+	else {
+		file = find_path(path);
+		if (!file)
+			file = new_file(fd, 0, path);
+	}
+
+	if (!file || file->fd != fd)
+		close(fd);
+	return file;
+}
+
+
+/* file_unused - whether no entry needs a file anymore */
+static int
+file_unused(const struct watch_file *file) {
+	return LIST_EMPTY(&file->subs) && LIST_EMPTY(&file->waiters);
+}
+
+
+/* leave_file - unsubscribe an entry from its file */
+/*   st is the current state of the file, kept for entries that are not
+ *   persistent to catch up on changes made until they are armed again,
+ *   or null when unknown. */
+static void
+leave_file(struct watch_entry *wentry, const struct stat *st) {
+	LIST_REMOVE(wentry, file_link);
+	wentry->file = 0;
+
+	if (wentry->caught) {
+		LIST_REMOVE(wentry, caught_link);
+		wentry->caught = 0;
+	}
+
+	wentry->snap.valid = 0;
+	if (st && wentry->persist == WPERSIST_NONE)
+		snap_take(&wentry->snap, st);
+}
+
+
+/* file_stat - state of a file, inspected at most once by the caller */
+/*   known is 0 before the first call, and updated by it. */
+static const struct stat *
+file_stat(const struct watch_file *file, struct stat *st, int *known) {
+	if (!*known)
+		*known = fstat(file->fd, st) == 0 ? 1 : -1;
+	return *known > 0 ? st : 0;
+}
+
+
+/* drop_file - stop watching a file, with no subscriber left */
+/*   Structures are only freed by fanout_gc(), since events of the current
+ *   batch may still point to them. */
+static void
+drop_file(struct evqueue *evq, struct watch_file *file) {
+	struct watch_file **prev = file_bucket(file);
+
+	while (*prev && *prev != file)
+		prev = &(*prev)->hnext;
+	if (*prev) {
+		*prev = file->hnext;
+		nfiles--;
+	}
+
+	evq_unwatch(evq, file->fd, file);
+	close(file->fd);
+	file->fd = -1;
+	file->hnext = dropped;
+	dropped = file;
+}
+
+
+/* fail_file - unsubscribe every entry of a file that cannot be watched */
+static void
+fail_file(struct evqueue *evq, struct watch_file *file,
+    struct fanout_list *failed) {
+	struct watch_entry *wentry;
+
+	while ((wentry = LIST_FIRST(&file->subs)) != 0) {
+		log_kevent_entry(wentry->path);
+		leave_file(wentry, 0);
+		SLIST_INSERT_HEAD(failed, wentry, fired_link);
+	}
+
+	while ((wentry = LIST_FIRST(&file->waiters)) != 0) {
+		log_kevent_entry(wentry->path);
+		LIST_REMOVE(wentry, file_link);
+		wentry->ancestor = 0;
+		SLIST_INSERT_HEAD(failed, wentry, fired_link);
+	}
+
+	drop_file(evq, file);
+}
+
+
+/* stop_waiting - forget the directory watched for a missing path */
+static void
+stop_waiting(struct evqueue *evq, struct watch_entry *wentry) {
+	struct watch_file *dir = wentry->ancestor;
+
+	if (!dir) return;
+	LIST_REMOVE(wentry, file_link);
+	wentry->ancestor = 0;
+
+	if (file_unused(dir))
+		drop_file(evq, dir);
+}
+
+
+/* owner_reaches - whether the owner of an entry may look into a path */
+/*   The entry stops waiting after logging when not. */
+static int
+owner_reaches(struct evqueue *evq, struct watch_entry *wentry,
+    const char *path, int mode) {
+	int reach = wentry_reaches(wentry, path, mode);
+
+	if (reach > 0)
+		return 1;
+	if (reach < 0)
+		log_open_entry(path);
+	else
+		log_entry_unreachable(wentry, path);
+	stop_waiting(evq, wentry);
+	return 0;
+}
+
+
+/* wait_path - watch the nearest existing directory above a missing path */
+/*   The entry waits for the first missing name of its path to change in
+ *   that directory, or for the directory itself to go away, and is then
+ *   handed back to be armed again, going down or up the path. */
+static int
+wait_path(struct evqueue *evq, struct watch_entry *wentry) {
+	const char *path = wentry->path;
+	size_t end = strlen(path), name, len;
+	struct watch_file *dir = 0, *old = wentry->ancestor;
+	struct stat st;
+	int error = errno, fd, known;
+	u_int events;
+	char *dpath;
+
+	dpath = malloc(end + 2);
+	if (!dpath) {
+		log_alloc("missing path");
+		stop_waiting(evq, wentry);
+		return -1;
+	}
+
+	/* Cut names off the path until an existing directory remains */
+	while (end > 1 && path[end - 1] == '/')
+		end--;
+	for (;;) {
+		name = end;
+		while (name > 0 && path[name - 1] != '/')
+			name--;
+		len = name;
+		while (len > 1 && path[len - 1] == '/')
+			len--;
+		if (len) {
+			memcpy(dpath, path, len);
+			dpath[len] = 0;
+		}
+		else
+			strcpy(dpath, ".");
+
+		if (stat(dpath, &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				break;
+		}
+		else if (errno != ENOENT && errno != ENOTDIR)
+			error = errno;
+
+		if ((error != ENOENT && error != ENOTDIR)
+		    || !len || (len == 1 && path[0] == '/')) {
+			errno = error;
+			log_open_entry(path);
+			free(dpath);
+			stop_waiting(evq, wentry);
+			return -1;
+		}
+		end = len;
+	}
+
+	/* The daemon may see more than the owner, who must not learn what
+	 * happens where it could not look */
+	if (!owner_reaches(evq, wentry, dpath, X_OK)) {
+		free(dpath);
+		return -1;
+	}
+
+	dir = find_inode(st.st_dev, st.st_ino);
+	if (!dir) {
+		fd = open(dpath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			log_open_entry(dpath);
+		else
+			dir = index_file(fd, dpath, &st, &known);
+	}
+	if (!dir) {
+		free(dpath);
+		stop_waiting(evq, wentry);
+		return -1;
+	}
+
+	/* Only the start of the wait is logged, not its moves */
+	if (!old)
+		log_entry_missing(wentry, dpath);
+	free(dpath);
+
+	if (dir != old) {
+		if (old)
+			LIST_REMOVE(wentry, file_link);
+		LIST_INSERT_HEAD(&dir->waiters, wentry, file_link);
+		wentry->ancestor = dir;
+		if (old && file_unused(old))
+			drop_file(evq, old);
+	}
+	wentry->wait_name = name;
+	wentry->wait_len = end - name;
+
+	events = dir->events;
+	if ((events | FANOUT_WAIT) == events)
+		return 0;
+
+	dir->events = events | FANOUT_WAIT;
+	if (evq_watch_persist(evq, dir->fd, dir->events, dir) < 0) {
+		log_kevent_entry(path);
+		dir->events = events;
+		stop_waiting(evq, wentry);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* fanout_arm - subscribe an entry to the file at its path */
+int
+fanout_arm(struct evqueue *evq, struct watch_entry *wentry) {
+	struct watch_file *file = 0;
+	struct stat st;
+	u_int events;
+	int fd, known;
+
+	/* A file already watched needs no descriptor of its own */
+	known = stat(wentry->path, &st) == 0;
+	if (known && !owner_reaches(evq, wentry, wentry->path, 0))
+		return -1;
+	if (known)
+		file = find_inode(st.st_dev, st.st_ino);
+
+	if (!file) {
+		fd = open(wentry->path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && (errno == ENOENT || errno == ENOTDIR))
+			return wait_path(evq, wentry);
+		if (fd < 0) {
+			log_open_entry(wentry->path);
+			stop_waiting(evq, wentry);
+			return -1;
+		}
+		if (!known && !owner_reaches(evq, wentry, wentry->path, 0)) {
+			close(fd);
+			return -1;
+		}
+
+		file = index_file(fd, wentry->path, &st, &known);
+		if (!file) {
+			stop_waiting(evq, wentry);
+			return -1;
+		}
+	}
+
+	/* The path has appeared, the directory is released only once
+	 * subscribed, in case the path leads back to it */
+	events = file->events;
+	if (wentry->ancestor)
+		LIST_REMOVE(wentry, file_link);
+	LIST_INSERT_HEAD(&file->subs, wentry, file_link);
+	wentry->file = file;
+	if (wentry->ancestor && file_unused(wentry->ancestor))
+		drop_file(evq, wentry->ancestor);
+	wentry->ancestor = 0;
+
+	/* Catch up on changes made while the entry was not watching */
+	if (wentry->snap.valid && known) {
+		wentry->caught = snap_changes(&wentry->snap, &st)
+		    & wentry->events;
+		if (wentry->caught)
+			LIST_INSERT_HEAD(&caught, wentry, caught_link);
+	}
+
+	/* Keep the state it starts watching from, in case events are lost */
+	wentry->snap.valid = 0;
+	if (known)
+		snap_take(&wentry->snap, &st);
+
+	/* Arm the file again only when the entry needs more events */
+	if ((events | entry_events(wentry)) == events)
+		return 0;
+
+	file->events = events | entry_events(wentry);
+	if (evq_watch_persist(evq, file->fd, file->events, file) < 0) {
+		log_kevent_entry(wentry->path);
+		file->events = events;
+		fanout_disarm(evq, wentry);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* fanout_disarm - unsubscribe an entry, closing its file when unused */
+/*   The registration keeps the events of the entry until it fires. */
+void
+fanout_disarm(struct evqueue *evq, struct watch_entry *wentry) {
+	struct watch_file *file = wentry->file;
+	struct stat st;
+	int known = 0;
+
+	if (!file) {
+		stop_waiting(evq, wentry);
+		return;
+	}
+	leave_file(wentry, file_stat(file, &st, &known));
+
+	if (file_unused(file))
+		drop_file(evq, file);
+}
+
+
+/* fanout_event - hand out an event to the subscribers of a file */
+void
+fanout_event(struct evqueue *evq, struct watch_file *file,
+    const struct evq_event *event, struct fanout_list *fired) {
+	struct watch_entry *wentry, *next;
+	u_int events = 0;
+	struct stat st;
+	int known = 0;
+
+	if (file->fd < 0)
+		return;
+
+	for (wentry = LIST_FIRST(&file->subs); wentry; wentry = next) {
+		next = LIST_NEXT(wentry, file_link);
+		wentry->fired = wentry->events & event->events;
+		if (entry_leaves(wentry, event->events)) {
+			leave_file(wentry, file_stat(file, &st, &known));
+			SLIST_INSERT_HEAD(fired, wentry, fired_link);
+			continue;
+		}
+		if (wentry->fired) {
+			/* A real event supersedes a catch-up */
+			if (wentry->caught) {
+				LIST_REMOVE(wentry, caught_link);
+				wentry->caught = 0;
+			}
+			SLIST_INSERT_HEAD(fired, wentry, fired_link);
+
+			/* Its next changes are counted from here */
+			wentry->snap.valid = 0;
+			if (file_stat(file, &st, &known))
+				snap_take(&wentry->snap, &st);
+		}
+		events |= entry_events(wentry);
+	}
+
+	/* Waiters look for their path again, still waiting here until they
+	 * find another place, unless the registration is gone */
+	for (wentry = LIST_FIRST(&file->waiters); wentry; wentry = next) {
+		next = LIST_NEXT(wentry, file_link);
+		if (!waiter_wakes(wentry, event)) {
+			events |= FANOUT_WAIT;
+			continue;
+		}
+		if (event->events & WEV_REVOKE) {
+			LIST_REMOVE(wentry, file_link);
+			wentry->ancestor = 0;
+		}
+		else
+			events |= FANOUT_WAIT;
+		wentry->fired = 0;
+		SLIST_INSERT_HEAD(fired, wentry, fired_link);
+	}
+
+	/* Narrow the registration to the remaining subscribers, a wider
+	 * one only costing spurious events if that fails */
+	if (file_unused(file))
+		drop_file(evq, file);
+	else if (events != file->events
+	    && evq_watch_persist(evq, file->fd, events, file) == 0)
+		file->events = events;
+}
+
+
+/* fanout_error - drop a file whose registration has failed */
+void
+fanout_error(struct evqueue *evq, struct watch_file *file,
+    struct fanout_list *failed) {
+	if (file->fd < 0)
+		return;
+
+	fail_file(evq, file, failed);
+}
+
+
+/* fanout_pending - whether entries are waiting for a catch-up */
+int
+fanout_pending(void) {
+	return !LIST_EMPTY(&caught);
+}
+
+
+/* fanout_catchup - hand out entries armed on a file changed meanwhile */
+void
+fanout_catchup(struct evqueue *evq, struct fanout_list *fired) {
+	struct watch_entry *wentry;
+	struct watch_file *file;
+	struct stat st;
+	int known;
+
+	while ((wentry = LIST_FIRST(&caught)) != 0) {
+		file = wentry->file;
+		wentry->fired = wentry->caught;
+		known = 0;
+		leave_file(wentry, file_stat(file, &st, &known));
+		SLIST_INSERT_HEAD(fired, wentry, fired_link);
+		if (file_unused(file))
+			drop_file(evq, file);
+	}
+}
+
+
+/* fanout_lost - look for changes of every file after events were lost */
+void
+fanout_lost(struct fanout_list *fired) {
+	struct watch_entry *wentry;
+	struct watch_file *file;
+	struct stat st;
+	u_int changes;
+	size_t i;
+
+	for (i = 0; i < nbuckets; i++)
+		for (file = buckets[i]; file; file = file->hnext) {
+			if (fstat(file->fd, &st) < 0)
+				continue;
+
+			/* Subscribers catch up from the state they have
+			 * last seen, the last link gone meaning deleted */
+			LIST_FOREACH(wentry, &file->subs, file_link) {
+				if (!wentry->snap.valid || wentry->caught)
+					continue;
+				changes = snap_changes(&wentry->snap, &st);
+				if (st.st_nlink == 0)
+					changes |= WEV_DELETE;
+				wentry->caught = changes & wentry->events;
+				if (wentry->caught)
+					LIST_INSERT_HEAD(&caught, wentry,
+					    caught_link);
+			}
+
+			/* Waiters look for their path again */
+			LIST_FOREACH(wentry, &file->waiters, file_link) {
+				wentry->fired = 0;
+				SLIST_INSERT_HEAD(fired, wentry, fired_link);
+			}
+		}
+}
+
+
+/* fanout_gc - free files dropped while handling the last batch */
+void
+fanout_gc(void) {
+	struct watch_file *file;
+
+	while ((file = dropped) != 0) {
+		dropped = file->hnext;
+		free(file);
+	}
+}
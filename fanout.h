@@ -0,0 +1,139 @@
+/* fanout.h - shared watches of files armed by several entries */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Entries watching a plain file subscribe to a struct watch_file, which
+ * holds the only descriptor and kernel registration of that file, however
+ * many entries watch it, through the same path or through hard links.
+ * Files are found by device and inode, or by path when the opened file
+ * cannot be inspected.
+ *
+ * The registration is persistent, for the union of the event sets of the
+ * subscribers, and lasts as long as the file has subscribers. When it
+ * fires, subscribers watching any of the reported events are handed back
+ * to the caller. Those without the persist option are unsubscribed, as if
+ * each had its own one-shot registration, while persistent ones stay until
+ * the file is deleted, or renamed when they follow the path. A revoked
+ * file loses all its subscribers.
+ *
+ * Arming an entry looks its path up again, so that a file replaced under
+ * the path is watched anew, while entries still subscribed to the
+ * previous one keep watching it until they leave it.
+ *
+ * Entries that are not persistent keep a snapshot of the file when they
+ * leave it, compared with its state when they are armed again: changes
+ * made in between are handed out as a catch-up trigger, so that no
+ * change goes unnoticed while the command runs. Armed entries keep one
+ * of the state they have last seen, compared with the file when the
+ * kernel has dropped events, so that they catch up the same way.
+ *
+ * An entry whose path does not exist waits in the nearest existing
+ * directory above it, watched as any other file and shared by every
+ * entry waiting there. Changes to the first missing name, or to the
+ * directory itself, hand the entry back to be armed again, so that it
+ * moves down the path as directories are created, up when they go away,
+ * and subscribes to the file as soon as it appears.
+ */
+
+#ifndef FILEWATCHER_FANOUT_H
+#define FILEWATCHER_FANOUT_H
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "evqueue.h"
+#include "watchtab.h"
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct fanout_subs - entries subscribed to a file */
+LIST_HEAD(fanout_subs, watch_entry);
+
+/* struct fanout_list - entries handed back together to the caller */
+SLIST_HEAD(fanout_list, watch_entry);
+
+/* struct watch_file - a watched file and its subscribed entries */
+struct watch_file {
+	int		node;		/* WNODE_FILE */
+	int		fd;		/* open file, or -1 once dropped */
+	dev_t		dev;		/* device of the file */
+	ino_t		ino;		/* inode of the file */
+	int		by_path;	/* whether found by path, not inode */
+	u_int		events;		/* WEV_* set of the registration */
+	struct fanout_subs subs;	/* entries waiting for an event */
+	struct fanout_subs waiters;	/* entries whose path is missing below */
+	struct watch_file *hnext;	/* hash chain, or list of dropped ones */
+	char		path[];		/* path it has been opened through */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* fanout_arm - subscribe an entry to the file at its path */
+/*   When the path is missing, the entry is left without a file, its
+ *   ancestor being the directory it waits in. */
+int
+fanout_arm(struct evqueue *evq, struct watch_entry *wentry);
+
+/* fanout_disarm - unsubscribe an entry, closing its file when unused */
+/*   An entry waiting for its path stops waiting. */
+void
+fanout_disarm(struct evqueue *evq, struct watch_entry *wentry);
+
+/* fanout_event - hand out an event to the subscribers of a file */
+/*   Subscribers watching any of the events, or leaving the file because
+ *   of them, are linked into fired with the events they watch, the latter
+ *   being unsubscribed. Waiters concerned by the event are linked with no
+ *   event, to be armed again. */
+void
+fanout_event(struct evqueue *evq, struct watch_file *file,
+    const struct evq_event *event, struct fanout_list *fired);
+
+/* fanout_error - drop a file whose registration has failed */
+/*   Its subscribers and waiters are released and linked into failed. */
+void
+fanout_error(struct evqueue *evq, struct watch_file *file,
+    struct fanout_list *failed);
+
+/* fanout_pending - whether entries are waiting for a catch-up */
+int
+fanout_pending(void);
+
+/* fanout_catchup - hand out entries armed on a file changed meanwhile */
+/*   They are linked into fired with the changes they watch, and are
+ *   unsubscribed as if the file had reported them. */
+void
+fanout_catchup(struct evqueue *evq, struct fanout_list *fired);
+
+/* fanout_lost - look for changes of every file after events were lost */
+/*   Subscribers whose file differs from the state they started watching
+ *   from are left for fanout_catchup(), and waiters are linked into fired
+ *   to look for their path again. */
+void
+fanout_lost(struct fanout_list *fired);
+
+/* fanout_gc - free files dropped while handling the last batch */
+void
+fanout_gc(void);
+
+#endif /* ndef FILEWATCHER_FANOUT_H */
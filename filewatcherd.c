@@ -16,75 +16,562 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
-#include <signal.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/event.h>
-#include <sys/time.h>
 
+#include "evqueue.h"
+#include "fanout.h"
 #include "log.h"
+#include "output.h"
 #include "run.h"
+#include "sched.h"
+#include "stats.h"
+#include "tabset.h"
+#include "timer.h"
+#include "trace.h"
+#include "tree.h"
 #include "watchtab.h"
 
 /* insert_entry - wait for an event described by the given watchtab entry */
 static int
-insert_entry(int kq, struct watch_entry *wentry) {
-	struct kevent event;
-	wentry->fd = open(wentry->path, O_RDONLY | O_CLOEXEC);
-	if (wentry->fd < 0) {
-		log_open_entry(wentry->path);
-		wentry->fd = -1;
+insert_entry(struct evqueue *evq, struct watch_entry *wentry) {
+	/* Trees stay watched once armed */
+	if (wentry->recursive || wentry->glob) {
+		if (wentry->tree)
+			return 0;
+		if (tree_arm(evq, wentry) < 0) {
+			stats_state(wentry, STATS_INACTIVE);
+			return -1;
+		}
+		stats_state(wentry, STATS_WATCHING);
+		return 0;
+	}
+
+	/* Persistent watches stay armed across triggers */
+	if (wentry->file)
+		return 0;
+	if (fanout_arm(evq, wentry) < 0) {
+		stats_state(wentry, STATS_INACTIVE);
 		return -1;
 	}
-	EV_SET(&event, wentry->fd,
-	    EVFILT_VNODE,
-	    EV_ADD | EV_ONESHOT,
-	    wentry->events,
-	    0,
-	    wentry);
-	if (kevent(kq, &event, 1, 0, 0, 0) < 0) {
-		log_kevent_entry(wentry->path);
-		close(wentry->fd);
-		wentry->fd = -1;
+	/* A missing path is awaited from its nearest directory */
+	if (!wentry->file) {
+		stats_state(wentry, STATS_MISSING);
+		return 0;
+	}
+
+	/* Within a quiet window, the entry has been waiting all along */
+	if (!wentry->debounce || !theap_pending(&wentry->timer))
+		log_entry_wait(wentry);
+	stats_state(wentry, STATS_WATCHING);
+	trace_armed(wentry);
+	return 0;
+}
+
+
+/* start_entry - run the command of an entry and wait for its exit */
+static void
+start_entry(struct evqueue *evq, struct sched *sched,
+    struct watch_entry *wentry) {
+	struct output *out[2];
+	int stdio[2], exec_fd;
+	pid_t pid;
+
+	/* Without pipes, the command still runs with the daemon output */
+	exec_fd = trace_starting(wentry);
+	if (output_open(wentry, out, stdio) < 0)
+		pid = run_entry(wentry, 0, exec_fd);
+	else
+		pid = run_entry(wentry, stdio, exec_fd);
+	trace_spawned(wentry, pid);
+	output_start(evq, out, stdio, pid);
+	sched_started(sched, wentry, pid);
+	stats_spawn(wentry, pid, run_launched());
+	if (!pid) return;
+
+	/* Wait for the command to finish */
+	wentry->running++;
+	if (evq_proc(evq, pid, wentry) < 0) {
+		log_kevent_proc(wentry, pid);
+		stats_exit(wentry, pid, -1);
+		trace_exited(wentry, pid);
+		run_reap(pid, -1);
+		sched_exited(sched, wentry);
+		wentry->running--;
+	}
+}
+
+
+/* entry_has_room - whether another trigger would be run or queued */
+static int
+entry_has_room(struct watch_entry *wentry) {
+	return wentry->running + wentry->ready + wentry->queued
+	    + (theap_pending(&wentry->timer) ? 1 : 0)
+	    < wentry->max_concurrency + wentry->max_queue;
+}
+
+
+/* dispatch_entry - submit a run to the scheduler, or queue it at limit */
+static void
+dispatch_entry(struct sched *sched, struct watch_entry *wentry) {
+	if (wentry->running + wentry->ready < wentry->max_concurrency) {
+		trace_ready(wentry);
+		sched_submit(sched, wentry);
+	}
+	else if (wentry->queued < wentry->max_queue) {
+		wentry->queued++;
+		log_entry_queued(wentry);
+	}
+}
+
+
+/* debounce_entry - postpone the command until the entry has been quiet */
+static void
+debounce_entry(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct watch_entry *wentry) {
+	int pending = theap_pending(&wentry->timer);
+	struct timespec now, cap;
+
+	/* Push the deadline back, but not beyond the cap of the burst */
+	timer_now(&now);
+	if (!pending)
+		wentry->burst = now;
+	timer_add(&wentry->timer.deadline, &now, &wentry->delay);
+	if (wentry->max_wait.tv_sec || wentry->max_wait.tv_nsec) {
+		timer_add(&cap, &wentry->burst, &wentry->max_wait);
+		if (timer_cmp(&cap, &wentry->timer.deadline) < 0)
+			wentry->timer.deadline = cap;
+	}
+
+	if (pending)
+		theap_update(timers, &wentry->timer);
+	else if (theap_insert(timers, &wentry->timer) < 0) {
+		dispatch_entry(sched, wentry);
+		return;
+	}
+	else
+		log_entry_delayed(wentry);
+
+	/* Keep watching during the quiet window */
+	insert_entry(evq, wentry);
+}
+
+
+/* trigger_entry - run the command of a triggered entry, maybe after delay */
+static void
+trigger_entry(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct watch_entry *wentry) {
+	struct timespec now;
+
+	stats_trigger(wentry);
+	if (wentry->debounce) {
+		debounce_entry(evq, timers, sched, wentry);
+		return;
+	}
+
+	if (wentry->delay.tv_sec == 0 && wentry->delay.tv_nsec == 0) {
+		dispatch_entry(sched, wentry);
+		return;
+	}
+
+	/* A run already waiting for its delay will see the change */
+	if (theap_pending(&wentry->timer))
+		return;
+
+	/* Keep the deadline in the daemon rather than a sleeping child */
+	timer_now(&now);
+	timer_add(&wentry->timer.deadline, &now, &wentry->delay);
+	if (theap_insert(timers, &wentry->timer) < 0) {
+		dispatch_entry(sched, wentry);
+		return;
+	}
+
+	log_entry_delayed(wentry);
+}
+
+
+/* file_fired - handle an entry handed out by its watched file */
+/*   The entry is triggered by the events it watches when it has room,
+ *   or merges them in its pending delay, and watches again when it has
+ *   left the file and there is room. */
+static void
+file_fired(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct watch_entry *wentry) {
+	u_int hits = wentry->fired;
+
+	wentry->fired = 0;
+	if (!wentry->file)
+		stats_state(wentry, STATS_IDLE);
+	if (hits)
+		stats_event(wentry, hits);
+	if (hits && (entry_has_room(wentry) || theap_pending(&wentry->timer))) {
+		trace_trigger(wentry, !wentry->file);
+		trigger_entry(evq, timers, sched, wentry);
+	}
+
+	if (!wentry->file && entry_has_room(wentry))
+		insert_entry(evq, wentry);
+}
+
+
+/* command_exited - account for the end of a command of the given entry */
+/*   Return whether the entry is still part of the watchtab. */
+static int
+command_exited(struct watch_entry *wentry) {
+	if (!wentry->running) {
+		LOG_ASSERT("wentry->running");
+		exit(EXIT_FAILURE);
+	}
+	wentry->running--;
+
+	if (!wentry->removed)
+		return 1;
+	if (!wentry->running)
+		wentry_free(wentry);
+	return 0;
+}
+
+
+/* release_entries - forget entries removed from a watchtab */
+/*   Entries are freed once their command has exited. */
+static void
+release_entries(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct watchtab *removed) {
+	struct watch_entry *wentry;
+
+	while ((wentry = SLIST_FIRST(removed)) != 0) {
+		SLIST_REMOVE_HEAD(removed, next);
+		stats_release(wentry);
+		trace_release(wentry);
+		tree_release(evq, wentry);
+		fanout_disarm(evq, wentry);
+		if (theap_pending(&wentry->timer)) {
+			theap_remove(timers, &wentry->timer);
+			log_entry_cancelled(wentry);
+		}
+		sched_cancel(sched, wentry);
+		wentry->queued = 0;
+		if (wentry->running)
+			wentry->removed = 1;
+		else
+			wentry_free(wentry);
+	}
+}
+
+
+/* read_tab - parse a watchtab and merge it into its current entries */
+/*
+ * The watchtab of an owned set must be safe to run as the owner of the
+ * file, and must keep that owner within its quota of entries, counting
+ * those of the other watchtabs it owns. On failure the current entries
+ * are kept. Entries that are gone are moved into removed.
+ */
+static int
+read_tab(struct tab_set *set, struct watch_tab *tab, int tab_fd,
+    struct watchtab *removed, struct wtab_diff *diff,
+    struct wtab_lookups *lookups) {
+	struct watchtab new_wtab = SLIST_HEAD_INITIALIZER(new_wtab);
+	struct watch_entry *wentry;
+	struct watch_tab *other;
+	const uid_t *owner = 0;
+	size_t count = 0, others = 0;
+	struct stat st;
+
+	if (set->owned) {
+		if (fstat(tab_fd, &st) < 0) {
+			log_open_watchtab(tab->path);
+			return -1;
+		}
+		if (!S_ISREG(st.st_mode) || st.st_nlink != 1
+		    || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+			log_watchtab_unsafe(tab->path);
+			return -1;
+		}
+		owner = &st.st_uid;
+	}
+
+	if (wtab_readfile(&new_wtab, tab_fd, tab->path, owner, lookups) < 0) {
+		wtab_release(&new_wtab);
 		return -1;
 	}
+	SLIST_FOREACH(wentry, &new_wtab, next)
+		count++;
+
+	/* Check the quota of the owner, the file having possibly changed
+	 * hands since its last load */
+	if (owner && set->max_entries) {
+		for (other = set->tabs; other; other = other->next)
+			if (other != tab && other->owner == *owner)
+				others += other->count;
+		if (others + count > set->max_entries) {
+			log_watchtab_quota(tab->path, *owner, count,
+			    others < set->max_entries
+			    ? set->max_entries - others : 0);
+			wtab_release(&new_wtab);
+			return -1;
+		}
+	}
 
-	log_entry_wait(wentry);
+	if (wtab_merge(&new_wtab, &tab->entries, removed, diff) < 0) {
+		wtab_release(&new_wtab);
+		return -1;
+	}
+	tab->entries = new_wtab;
+	tab->owner = owner ? *owner : 0;
+	tab->count = count;
 	return 0;
 }
 
 
+/* reload_tab - try to reopen and reload a watchtab after its timer */
+/*
+ * When open fails, keep the timer around to try again after delay
+ * (suppressing errors), starting it for a watchtab new in the directory.
+ * When loading fails, keep the old watchtab but add the event filter
+ * anyway to try again on next update.
+ */
+static void
+reload_tab(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct tab_set *set, struct watch_tab *tab,
+    intptr_t delay) {
+	struct watchtab removed = SLIST_HEAD_INITIALIZER(removed);
+	struct wtab_diff diff;
+	struct wtab_lookups lookups;
+	struct watch_entry *wentry;
+	int tab_fd;
+
+	/* The timer has survived an earlier removal attempt */
+	if (tab->f) {
+		if (evq_timer_off(evq, (uintptr_t)tab) < 0)
+			log_kevent_timer_off();
+		else
+			tab->timer = 0;
+		return;
+	}
+
+	/* Try opening the watchtab file, a file gone from the directory
+	 * being dropped by the next scan */
+	tab_fd = open(tab->path, O_RDONLY | O_CLOEXEC);
+	if (tab_fd >= 0) {
+		tab->f = fdopen(tab_fd, "r");
+		if (!tab->f)
+			close(tab_fd);
+	}
+	if (!tab->f) {
+		if (!tab->error && !(set->is_dir && errno == ENOENT))
+			log_open_watchtab(tab->path);
+		tab->error = 1;
+		if (!tab->timer) {
+			if (evq_timer(evq, (uintptr_t)tab, delay, tab) < 0)
+				log_kevent_timer();
+			else
+				tab->timer = 1;
+		}
+		return;
+	}
+
+	/* Delete the timer */
+	if (tab->timer) {
+		if (evq_timer_off(evq, (uintptr_t)tab) < 0) {
+			log_kevent_timer_off();
+			/* timer is still around, close files */
+			fclose(tab->f);
+			tab->f = 0;
+			return;
+		}
+		tab->timer = 0;
+	}
+
+	/* Watch the file for changes */
+	if (evq_watch(evq, tab_fd, TABSET_EVENTS, tab) < 0)
+		log_kevent_watchtab(tab->path);
+
+	/* Load watchtab contents, keeping the old ones on failure */
+	if (read_tab(set, tab, tab_fd, &removed, &diff, &lookups) < 0)
+		return;
+
+	/* Release entries that are gone, once their command has exited */
+	release_entries(evq, timers, sched, &removed);
+
+	/* Slots of removed entries can go to new ones */
+	stats_assign(&tab->entries);
+
+	/* Arm new entries, and kept ones that can take another trigger */
+	SLIST_FOREACH(wentry, &tab->entries, next) {
+		if (!wentry->file && entry_has_room(wentry))
+			insert_entry(evq, wentry);
+	}
+
+	if (tab->loaded)
+		log_watchtab_reloaded(tab->path, &diff, &lookups);
+	else
+		log_watchtab_loaded(tab->path, &lookups);
+	tab->loaded = 1;
+}
+
+
+/* rescan_tabs - read the directory of watchtabs again after its timer */
+/*   Watchtabs removed from it are released with all their entries, new
+ *   ones are queued to be loaded. Failures are handled like those of
+ *   reload_tab(). */
+static void
+rescan_tabs(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct tab_set *set) {
+	struct watch_tab *removed = 0, *tab;
+	struct watch_entry *wentry;
+	size_t count;
+
+	/* The timer has survived an earlier removal attempt */
+	if (set->dir) {
+		if (evq_timer_off(evq, (uintptr_t)set) < 0)
+			log_kevent_timer_off();
+		else
+			set->timer = 0;
+		return;
+	}
+
+	/* Try opening the directory */
+	set->dir = opendir(set->path);
+	if (!set->dir) {
+		if (!set->error)
+			log_open_watchtab(set->path);
+		set->error = 1;
+		return;
+	}
+
+	/* Delete the timer */
+	if (evq_timer_off(evq, (uintptr_t)set) < 0) {
+		log_kevent_timer_off();
+		closedir(set->dir);
+		set->dir = 0;
+		return;
+	}
+	set->timer = 0;
+
+	/* Watch the directory for changes */
+	if (evq_watch(evq, dirfd(set->dir), TABSET_EVENTS, set) < 0)
+		log_kevent_watchtab(set->path);
+
+	if (tabset_scan(set, &removed) < 0)
+		return;
+
+	while ((tab = removed) != 0) {
+		removed = tab->next;
+		count = 0;
+		SLIST_FOREACH(wentry, &tab->entries, next)
+			count++;
+		release_entries(evq, timers, sched, &tab->entries);
+		log_watchtab_removed(tab->path, count);
+
+		/* A timer that cannot be stopped still points to the
+		 * watchtab, which is then kept with a path never found */
+		if (tab->timer && evq_timer_off(evq, (uintptr_t)tab) < 0) {
+			log_kevent_timer_off();
+			tab->path[0] = 0;
+			continue;
+		}
+		tabset_free(tab);
+	}
+}
+
+
+/* recover_lost - catch up on all entries after events have been lost */
+/*   Trees are read again and their entries triggered, while entries of
+ *   plain files are compared with the state they have last seen, and
+ *   left for the catch-up of the current batch. */
+static void
+recover_lost(struct evqueue *evq, struct timer_heap *timers,
+    struct sched *sched, struct tab_set *set) {
+	struct watch_entry *wentry;
+	struct watch_tab *tab;
+	struct fanout_list fired;
+
+	log_events_lost();
+
+	for (tab = set->tabs; tab; tab = tab->next)
+		SLIST_FOREACH(wentry, &tab->entries, next) {
+			if (!tree_lost(evq, wentry))
+				continue;
+			stats_catchup(wentry);
+			if (entry_has_room(wentry)
+			    || theap_pending(&wentry->timer)) {
+				trace_trigger(wentry, 0);
+				trigger_entry(evq, timers, sched, wentry);
+			}
+			if (!wentry->tree && entry_has_room(wentry))
+				insert_entry(evq, wentry);
+		}
+
+	SLIST_INIT(&fired);
+	fanout_lost(&fired);
+	while ((wentry = SLIST_FIRST(&fired)) != 0) {
+		SLIST_REMOVE_HEAD(&fired, fired_link);
+		file_fired(evq, timers, sched, wentry);
+	}
+}
+
 
 int
 main(int argc, char **argv) {
-	int kq;			/* file descriptor for the kernel queue */
+	struct evqueue *evq;	/* kernel event queue */
 	int argerr = 0;		/* whether arguments are invalid */
 	int help = 0;		/* whether help text should be displayed */
 	int daemonize = 1;	/* whether fork to background and use syslog */
-	const char *tabpath = 0;/* path to the watchtab file */
-	int tab_fd;		/* file descriptor of watchtab */
-	FILE *tab_f;		/* file stream of watchtab */
-	struct watchtab wtab;	/* current watchtab data */
+	int verbose = 0;	/* whether to log every wakeup */
+	int use_helper = 0;	/* whether commands are started by a helper */
+	int launcher = RUN_VFORK;/* RUN_* launcher of commands */
+	const char *tabpath = 0;/* path to the watchtab file or directory */
+	const char *statspath = 0;/* path to the statistics file */
+	const char *tracepath = 0;/* path to the trace file */
+	struct tab_set tabs;	/* current watchtabs */
+	struct wtab_lookups lookups;/* user lookups of the initial load */
 	intptr_t delay = 100;	/* delay in ms before reloading watchtab */
-	int wtab_error = 0;	/* whether watchtab can't be opened */
+	long batch = 64;	/* maximum number of events per wakeup */
+	struct evq_event *events;/* buffer for a batch of events */
+	struct timer_heap timers;/* deadlines of delayed commands */
+	struct sched sched;	/* global scheduler of commands */
+	long jobs = 0;		/* maximum number of running commands */
+	int owned = 0;		/* whether entries run as the watchtab owner */
+	long user_entries = 0;	/* maximum number of entries of an owner */
+	long user_jobs = 0;	/* maximum number of running commands of a user */
 
 	struct option longopts[] = {
+	    { "batch",      required_argument, 0, 'b' },
 	    { "foreground", no_argument,       0, 'd' },
 	    { "help",       no_argument,       0, 'h' },
+	    { "jobs",       required_argument, 0, 'j' },
+	    { "launcher",   required_argument, 0, 'l' },
+	    { "owner",      no_argument,       0, 'u' },
+	    { "spawn-helper", no_argument,     0, 's' },
+	    { "stats",      required_argument, 0, 'S' },
+	    { "trace",      required_argument, 0, 'T' },
+	    { "user-entries", required_argument, 0, 'E' },
+	    { "user-jobs",  required_argument, 0, 'J' },
+	    { "verbose",    no_argument,       0, 'v' },
 	    { "wait",       required_argument, 0, 'w' },
 	    { 0,            0,                 0,  0 }
 	};
 
 	/* Temporary variables */
-	struct kevent event;
+	struct evq_event *event;
 	struct watch_entry *wentry;
-	pid_t pid;
-	int c;
+	struct watch_dir *dir;
+	struct watch_file *file;
+	struct watch_tab *tab;
+	struct watchtab removed = SLIST_HEAD_INITIALIZER(removed);
+	struct wtab_diff diff;
+	struct fanout_list fired, failed;
+	struct timer_node *node;
+	struct timespec now, timeout;
+	int c, i, count, tab_fd, status, lost;
 	char *s;
 
 
@@ -93,18 +580,71 @@ main(int argc, char **argv) {
 	 ***************************/
 
 	/* Process options */
-	while (!argerr
-	    && (c = getopt_long(argc, argv, "dhw:", longopts, 0)) != -1) {
+	while (!argerr && (c = getopt_long(argc, argv,
+	    "b:dE:hJ:j:l:S:sT:uvw:", longopts, 0)) != -1) {
 		switch (c) {
+		    case 'b':
+			batch = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || batch <= 0) {
+				log_bad_batch(optarg);
+				argerr = 1;
+			}
+			break;
 		    case 'd':
 			daemonize = 0;
 			break;
+		    case 'E':
+			user_entries = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || user_entries < 0) {
+				log_bad_quota(optarg);
+				argerr = 1;
+			}
+			break;
 		    case 'h':
 			help = 1;
 			break;
+		    case 'J':
+			user_jobs = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || user_jobs < 0) {
+				log_bad_quota(optarg);
+				argerr = 1;
+			}
+			break;
+		    case 'j':
+			jobs = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || jobs < 0) {
+				log_bad_jobs(optarg);
+				argerr = 1;
+			}
+			break;
+		    case 'l':
+			if (strcmp(optarg, "vfork") == 0)
+				launcher = RUN_VFORK;
+			else if (strcmp(optarg, "posix_spawn") == 0)
+				launcher = RUN_SPAWN;
+			else {
+				log_bad_launcher(optarg);
+				argerr = 1;
+			}
+			break;
+		    case 'S':
+			statspath = optarg;
+			break;
+		    case 's':
+			use_helper = 1;
+			break;
+		    case 'T':
+			tracepath = optarg;
+			break;
+		    case 'u':
+			owned = 1;
+			break;
+		    case 'v':
+			verbose = 1;
+			break;
 		    case 'w':
 			delay = strtol(optarg, &s, 10);
-			if (!s[0]) {
+			if (s == optarg || s[0]) {
 				log_bad_delay(optarg);
 				argerr = 1;
 			}
@@ -131,26 +671,42 @@ main(int argc, char **argv) {
 	 * INITIALIZATION *
 	 ******************/
 
-	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-		log_signal(SIGCHLD);
+	/* Start the spawn helper while the address space is small */
+	if (run_init(launcher) < 0)
 		return EXIT_FAILURE;
-	}
-
-	/* Try to open and read the watchtab */
-	tab_fd = open(tabpath, O_RDONLY | O_CLOEXEC);
-	if (tab_fd < 0) {
-		log_open_watchtab(tabpath);
+	if (use_helper && run_helper_start(daemonize) < 0)
 		return EXIT_FAILURE;
-	}
-	tab_f = fdopen(tab_fd, "r");
-	if (!tab_f) {
-		log_open_watchtab(tabpath);
+	tree_init(0);
+
+	/* Try to open and read the watchtabs, those of a directory being
+	 * retried on their next change when they fail */
+	if (tabset_open(&tabs, tabpath) < 0)
 		return EXIT_FAILURE;
+	tabs.owned = owned;
+	tabs.max_entries = (size_t)user_entries;
+	while ((tab = tabset_next(&tabs)) != 0) {
+		tab_fd = open(tab->path, O_RDONLY | O_CLOEXEC);
+		if (tab_fd >= 0) {
+			tab->f = fdopen(tab_fd, "r");
+			if (!tab->f)
+				close(tab_fd);
+		}
+		if (!tab->f) {
+			log_open_watchtab(tab->path);
+			if (!tabs.is_dir)
+				return EXIT_FAILURE;
+			tab->error = 1;
+			continue;
+		}
+		if (read_tab(&tabs, tab, tab_fd, &removed, &diff, &lookups)
+		    < 0) {
+			if (!tabs.is_dir)
+				return EXIT_FAILURE;
+			continue;
+		}
+		tab->loaded = 1;
+		log_watchtab_loaded(tab->path, &lookups);
 	}
-	SLIST_INIT(&wtab);
-	if (wtab_readfile(&wtab, tab_f, tabpath) < 0)
-		return EXIT_FAILURE;
-	log_watchtab_loaded(tabpath);
 
 	/* Fork to background */
 	if (daemonize) {
@@ -158,27 +714,61 @@ main(int argc, char **argv) {
 		set_report(&syslog);
 	}
 
+	/* Map the statistics file, with a slot for each entry */
+	if (statspath) {
+		count = 0;
+		for (tab = tabs.tabs; tab; tab = tab->next)
+			SLIST_FOREACH(wentry, &tab->entries, next)
+				count++;
+		if (stats_open(statspath, (size_t)count) < 0)
+			return EXIT_FAILURE;
+		for (tab = tabs.tabs; tab; tab = tab->next)
+			stats_assign(&tab->entries);
+	}
+
+	/* Time the stages of runs, for the statistics or a trace file */
+	if ((statspath || tracepath) && trace_init(tracepath) < 0)
+		return EXIT_FAILURE;
+
 	/* Create a kernel queue */
-	kq = kqueue();
-	if (kq == -1) {
-		log_kqueue();
+	evq = evq_new();
+	if (!evq)
+		return EXIT_FAILURE;
+	events = malloc(batch * sizeof *events);
+	if (!events) {
+		log_alloc("event batch");
 		return EXIT_FAILURE;
 	}
+	theap_init(&timers);
+	sched_init(&sched, (unsigned)jobs, (unsigned)user_jobs);
 
-	/* Insert config file watcher */
-	EV_SET(&event, tab_fd,
-	    EVFILT_VNODE,
-	    EV_ADD | EV_ONESHOT,
-	    NOTE_DELETE | NOTE_WRITE | NOTE_RENAME | NOTE_REVOKE,
-	    0, 0);
-	if (kevent(kq, &event, 1, 0, 0, 0) < 0) {
+	/* Insert config file watchers, and retry timers of the watchtabs
+	 * that could not be opened */
+	if (tabs.is_dir
+	    && evq_watch(evq, dirfd(tabs.dir), TABSET_EVENTS, &tabs) < 0) {
 		log_kevent_watchtab(tabpath);
 		return EXIT_FAILURE;
 	}
+	for (tab = tabs.tabs; tab; tab = tab->next) {
+		if (!tab->f) {
+			if (evq_timer(evq, (uintptr_t)tab, delay, tab) < 0) {
+				log_kevent_timer();
+				return EXIT_FAILURE;
+			}
+			tab->timer = 1;
+		}
+		else if (evq_watch(evq, fileno(tab->f), TABSET_EVENTS, tab)
+		    < 0) {
+			log_kevent_watchtab(tab->path);
+			return EXIT_FAILURE;
+		}
+	}
 
-	/* Insert initial watchers */
-	SLIST_FOREACH(wentry, &wtab, next) {
-		insert_entry(kq, wentry);
+	/* Insert initial watchers, submitted along with the first wait */
+	for (tab = tabs.tabs; tab; tab = tab->next) {
+		SLIST_FOREACH(wentry, &tab->entries, next) {
+			insert_entry(evq, wentry);
+		}
 	}
 
 
@@ -187,132 +777,259 @@ main(int argc, char **argv) {
 	 *************/
 
 	while (1) {
-		/* Wait for a single event */
-		if (kevent(kq, 0, 0, &event, 1, 0) < 0) {
+		/* Wait for a batch of events, until the next deadline, or
+		 * only poll while catch-up triggers are pending */
+		node = theap_first(&timers);
+		if (fanout_pending()) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = 0;
+		}
+		else if (node) {
+			timer_now(&now);
+			timer_until(&timeout, &node->deadline, &now);
+		}
+		count = evq_wait(evq, events, batch,
+		    node || fanout_pending() ? &timeout : 0);
+		if (count < 0) {
 			log_kevent_wait();
 			break;
 		}
+		trace_wakeup();
+		if (verbose)
+			log_wakeup(count, evq_changes(evq));
 
-		switch (event.filter) {
-		    case EVFILT_VNODE:
-			if (!event.udata) {
-				/*
-				 * Something happened on the watchtab:
-				 * close everything and start the timer before
-				 * reloading it.
-				 */
-				fclose(tab_f);  /* also closes tab_fd */
-				EV_SET(&event, 42,
-				    EVFILT_TIMER,
-				    EV_ADD,
-				    0,
-				    delay, /* ms */
-				    0);
-				if (kevent(kq, &event, 1, 0, 0, 0) < 0) {
+		lost = 0;
+		for (i = 0; i < count; i++) {
+			event = events + i;
+
+			/* A registration has been refused by the kernel */
+			if (event->error) {
+				errno = event->error;
+				if (event->kind == EVQ_TIMER) {
+					/* removals are not given a pointer */
+					if (!event->udata) {
+						log_kevent_timer_off();
+						continue;
+					}
 					log_kevent_timer();
 					exit(EXIT_FAILURE);
 				}
-				break;
+				else if (event->kind == EVQ_PROC) {
+					log_kevent_proc(event->udata,
+					    (pid_t)event->ident);
+					stats_exit(event->udata,
+					    (pid_t)event->ident, -1);
+					trace_exited(event->udata,
+					    (pid_t)event->ident);
+					run_reap((pid_t)event->ident, -1);
+					sched_exited(&sched, event->udata);
+					command_exited(event->udata);
+				}
+				else if (event->kind == EVQ_READ)
+					output_error(evq, event->udata);
+				else if (WNODE_KIND(event->udata) == WNODE_TAB) {
+					tab = event->udata;
+					log_kevent_watchtab(tab->path);
+				}
+				else if (WNODE_KIND(event->udata)
+				    == WNODE_TABSET)
+					log_kevent_watchtab(tabpath);
+				else if (WNODE_KIND(event->udata) == WNODE_DIR)
+					tree_error(evq, event->udata);
+				else {
+					SLIST_INIT(&failed);
+					fanout_error(evq, event->udata, &failed);
+					while ((wentry = SLIST_FIRST(&failed))
+					    != 0) {
+						SLIST_REMOVE_HEAD(&failed,
+						    fired_link);
+						stats_state(wentry,
+						    STATS_INACTIVE);
+					}
+				}
+				continue;
 			}
 
-			/* A watchtab entry has been triggered */
-			wentry = event.udata;
-			if (wentry->fd < 0
-			    || (uintptr_t)wentry->fd != event.ident) {
-				LOG_ASSERT("wentry->fd");
-				exit(EXIT_FAILURE);
-			}
-			close(wentry->fd);
-			wentry->fd = -1;
-			pid = run_entry(wentry);
-			if (!pid) break;
-
-			/* Wait for the command to finish */
-			EV_SET(&event, pid,
-			    EVFILT_PROC,
-			    EV_ADD | EV_ONESHOT,
-			    NOTE_EXIT,
-			    0,
-			    wentry);
-			if (kevent(kq, &event, 1, 0, 0, 0) < 0)
-				log_kevent_proc(wentry, pid);
-			break;
+			switch (event->kind) {
+			    case EVQ_FILE:
+				if (WNODE_KIND(event->udata) == WNODE_TAB) {
+					/*
+					 * Something happened on a watchtab:
+					 * close it and start its timer
+					 * before reloading it.
+					 */
+					tab = event->udata;
+					fclose(tab->f);
+					tab->f = 0;
+					if (evq_timer(evq, (uintptr_t)tab,
+					    delay, tab) < 0) {
+						log_kevent_timer();
+						exit(EXIT_FAILURE);
+					}
+					tab->timer = 1;
+					break;
+				}
 
-		    case EVFILT_PROC:
-			/*
-			 * The command has finished, re-insert the path to
-			 * watch it.
-			 */
-			insert_entry(kq, event.udata);
-			break;
+				/* Likewise for the directory of watchtabs */
+				if (WNODE_KIND(event->udata) == WNODE_TABSET) {
+					closedir(tabs.dir);
+					tabs.dir = 0;
+					if (evq_timer(evq, (uintptr_t)&tabs,
+					    delay, &tabs) < 0) {
+						log_kevent_timer();
+						exit(EXIT_FAILURE);
+					}
+					tabs.timer = 1;
+					break;
+				}
 
-		    case EVFILT_TIMER:
-			/*
-			 * Timer for watchtab reload has expired, try to
-			 * reopen and reload it.
-			 * When open fails, keep the timer around to try
-			 * again after delay (suppressing errors).
-			 * When loading fails, keep the old watchtab but add
-			 * the event filter anyway to try again on next update.
-			 */
-
-			/* Try opening the watchtab file */
-			tab_fd = open(tabpath, O_RDONLY | O_CLOEXEC);
-			if (tab_fd < 0) {
-				if (!wtab_error)
-					log_open_watchtab(tabpath);
-				wtab_error = 1;
-				break;
-			}
-			tab_f = fdopen(tab_fd, "r");
-			if (!tab_f) {
-				if (!wtab_error)
-					log_open_watchtab(tabpath);
-				wtab_error = 1;
-				close(tab_fd);
-				break;
-			}
+				/*
+				 * A directory of a recursive or glob entry:
+				 * the tree is kept watched, and the entry
+				 * triggered when it has room, or merges the
+				 * event in its pending delay.
+				 */
+				if (WNODE_KIND(event->udata) == WNODE_DIR) {
+					dir = event->udata;
+					stats_event(dir->entry, event->events);
+					wentry = tree_event(evq, dir, event);
+					if (wentry && (entry_has_room(wentry)
+					    || theap_pending(&wentry->timer))) {
+						trace_trigger(wentry, 0);
+						trigger_entry(evq, &timers,
+						    &sched, wentry);
+					}
+					wentry = dir->entry;
+					if (!wentry->tree
+					    && entry_has_room(wentry))
+						insert_entry(evq, wentry);
+					break;
+				}
 
-			/* Delete the timer */
-			event.flags = EV_DELETE;
-			if (kevent(kq, &event, 1, 0, 0, 0) < 0) {
-				log_kevent_timer_off();
-				/* timer is still around, close files */
-				fclose(tab_f);
+				/* A watched file, shared by its entries */
+				file = event->udata;
+				if (file->fd >= 0
+				    && (uintptr_t)file->fd != event->ident) {
+					LOG_ASSERT("file->fd");
+					exit(EXIT_FAILURE);
+				}
+				SLIST_INIT(&fired);
+				fanout_event(evq, file, event, &fired);
+				while ((wentry = SLIST_FIRST(&fired)) != 0) {
+					SLIST_REMOVE_HEAD(&fired, fired_link);
+					file_fired(evq, &timers, &sched,
+					    wentry);
+				}
 				break;
-			}
 
-			/* Watch the file for changes */
-			EV_SET(&event, tab_fd,
-			    EVFILT_VNODE,
-			    EV_ADD | EV_ONESHOT,
-			    NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE
-			      | NOTE_WRITE,
-			    0, 0);
-			if (kevent(kq, &event, 1, 0, 0, 0) < 0)
-				log_kevent_watchtab(tabpath);
-
-			/* Load watchtab contents on a temporary variable */
-			/* local */{
-				struct watchtab new_wtab
-				    = SLIST_HEAD_INITIALIZER(new_wtab);
-
-				if (wtab_readfile(&new_wtab,
-				    tab_f, tabpath) < 0) {
-					wtab_release(&new_wtab);
+			    case EVQ_PROC:
+				/*
+				 * The command has finished: start a queued
+				 * run if any, and re-insert the path to
+				 * watch it, unless the entry has been removed
+				 * from the watchtab meanwhile.
+				 */
+				wentry = event->udata;
+				status = run_reap((pid_t)event->ident,
+				    event->status);
+				stats_exit(wentry, (pid_t)event->ident, status);
+				trace_exited(wentry, (pid_t)event->ident);
+				sched_exited(&sched, wentry);
+				if (!command_exited(wentry))
 					break;
+				if (wentry->queued) {
+					wentry->queued--;
+					trace_ready(wentry);
+					sched_submit(&sched, wentry);
 				}
+				if (!wentry->file && entry_has_room(wentry))
+					insert_entry(evq, wentry);
+				break;
 
-				wtab_release(&wtab);
-				wtab = new_wtab;
-				SLIST_FOREACH(wentry, &wtab, next) {
-					insert_entry(kq, wentry);
-				}
+			    case EVQ_READ:
+				/*
+				 * A command has written something, or
+				 * closed its output: read a bounded amount,
+				 * more is reported on the next wakeup.
+				 */
+				output_event(evq, event->udata);
+				break;
+
+			    case EVQ_TIMER:
+				/*
+				 * Reloading releases entries that later
+				 * events of the batch may refer to, so
+				 * it is done after the whole batch.
+				 */
+				if (WNODE_KIND(event->udata) == WNODE_TABSET)
+					tabs.rescan = 1;
+				else
+					tabset_queue(&tabs, event->udata);
+				break;
+
+			    case EVQ_LOST:
+				/*
+				 * The kernel has dropped file events:
+				 * every entry is checked after the batch.
+				 */
+				lost = 1;
+				break;
 			}
+		}
 
-			log_watchtab_loaded(tabpath);
-			break;
+		if (lost)
+			recover_lost(evq, &timers, &sched, &tabs);
+
+		/* Reload changed watchtabs, then read the directory again
+		 * and load the watchtabs added to it */
+		while ((tab = tabset_next(&tabs)) != 0)
+			reload_tab(evq, &timers, &sched, &tabs, tab, delay);
+		if (tabs.rescan) {
+			rescan_tabs(evq, &timers, &sched, &tabs);
+			tabs.rescan = 0;
+			while ((tab = tabset_next(&tabs)) != 0)
+				reload_tab(evq, &timers, &sched, &tabs, tab,
+				    delay);
+		}
+
+		/* Trigger entries whose file has changed without an event */
+		SLIST_INIT(&fired);
+		fanout_catchup(evq, &fired);
+		while ((wentry = SLIST_FIRST(&fired)) != 0) {
+			SLIST_REMOVE_HEAD(&fired, fired_link);
+			log_entry_catchup(wentry);
+			stats_catchup(wentry);
+			file_fired(evq, &timers, &sched, wentry);
 		}
+
+		/* Start commands whose delay has expired */
+		timer_now(&now);
+		while ((node = theap_first(&timers)) != 0
+		    && timer_cmp(&node->deadline, &now) <= 0) {
+			theap_remove(&timers, node);
+			wentry = WENTRY_OF_TIMER(node);
+
+			/* Stop watching a debounced entry while it runs */
+			if (wentry->file && !wentry->persist) {
+				fanout_disarm(evq, wentry);
+				stats_state(wentry, STATS_IDLE);
+			}
+			dispatch_entry(&sched, wentry);
+			if (!wentry->file && entry_has_room(wentry))
+				insert_entry(evq, wentry);
+		}
+
+		/* Start ready runs, within the global limit */
+		while ((wentry = sched_next(&sched)) != 0)
+			start_entry(evq, &sched, wentry);
+		stats_sched(&sched.stats);
+		if (verbose)
+			log_sched_stats(&sched.stats);
+
+		/* No event refers to dropped directories or files anymore */
+		tree_gc();
+		fanout_gc();
+		trace_loop(count);
 	}
 
 	return EXIT_SUCCESS;
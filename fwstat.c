@@ -0,0 +1,451 @@
+/* fwstat.c - display the statistics file of a file watcher daemon */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Maps the file read-only and prints a snapshot of the global and entry
+ * counters, once or at a given interval. Taking a snapshot only reads
+ * memory: the file is opened again only when the daemon has replaced it.
+ *
+ * Usage: fwstat [-k] [-c count] [-i interval_ms] file
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+/* attempts at a consistent copy, the first ones without pausing */
+#define READ_TRIES	200
+#define READ_SPINS	100
+
+/* pause between later attempts, 100 ms in all */
+#define READ_PAUSE_NS	1000000
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct view - mapping of a statistics file */
+struct view {
+	const struct stats_header *header;
+	const struct stats_slot	*slots;
+	size_t		size;		/* length of the mapping */
+};
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* event_names - names of the WEV_* bits, as in the watchtab */
+static const char *event_names[STATS_EVENTS] = {
+    "delete", "write", "extend", "attrib", "link", "rename", "revoke" };
+
+/* launcher_names - names of the RUN_* launchers, as given to --launcher */
+static const char *launcher_names[STATS_LAUNCHERS] = {
+    "vfork", "posix_spawn" };
+
+/* stage_names - names of the time spent up to each TRACE_* stage */
+static const char *stage_names[TRACE_STAGES] = TRACE_NAMES;
+
+/* state_names - names of STATS_* entry states */
+static const char *state_names[] = {
+    "idle", "watching", "inactive", "missing" };
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* view_open - map the file at the given path */
+static int
+view_open(struct view *view, const char *path) {
+	const struct stats_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof *header) {
+		fprintf(stderr, "%s: file too short\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	/* The layout must be exactly the one compiled in */
+	header = map;
+	if (header->magic != STATS_MAGIC
+	    || header->version != STATS_VERSION
+	    || header->header_size != sizeof *header
+	    || header->slot_size != sizeof *view->slots
+	    || sizeof *header + header->nslots * sizeof *view->slots
+	      > (size_t)st.st_size) {
+		fprintf(stderr, "%s: not a statistics file of this version\n",
+		    path);
+		munmap(map, (size_t)st.st_size);
+		return -1;
+	}
+
+	view->header = header;
+	view->slots = (const struct stats_slot *)(header + 1);
+	view->size = (size_t)st.st_size;
+	return 0;
+}
+
+
+/* read_copy - consistent copy of a structure guarded by a sequence number */
+/*   seq points into src. Return -1, leaving the last copy, when seq stays
+ *   odd or keeps changing, e.g. when the daemon died while writing. */
+static int
+read_copy(void *dest, const void *src, size_t size, const uint64_t *seq) {
+	struct timespec pause = { 0, READ_PAUSE_NS };
+	uint64_t before, after;
+	unsigned tries;
+
+	for (tries = 0; tries < READ_TRIES; tries++) {
+		if (tries >= READ_SPINS)
+			nanosleep(&pause, 0);
+		before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		memcpy(dest, src, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		if (before == after && !(before & 1))
+			return 0;
+	}
+
+	return -1;
+}
+
+
+/* print_inconsistent - flag counters that could not be read consistently */
+static void
+print_inconsistent(const char *prefix, int keyed) {
+	if (keyed)
+		printf("%s.inconsistent=1\n", prefix);
+	else
+		printf("  (inconsistent, the daemon may have died while "
+		    "writing)\n");
+}
+
+
+/* percentile - lower bound in microseconds of the given percentile */
+static uint64_t
+percentile(const uint64_t *hist, unsigned pct) {
+	uint64_t total = 0, seen = 0, rank;
+	unsigned i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+	rank = (total * pct + 99) / 100;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			break;
+	}
+	return STATS_BUCKET_LOW(i < STATS_BUCKETS ? i : STATS_BUCKETS - 1);
+}
+
+
+/* print_counters - output a set of counters under the given prefix */
+static void
+print_counters(const char *prefix, const struct stats_counters *c,
+    int keyed) {
+	uint64_t exited = c->exits_unknown, failed = 0, killed = 0;
+	unsigned i;
+
+	for (i = 0; i < STATS_EXIT_CODES; i++) {
+		exited += c->exits[i];
+		if (i > 0)
+			failed += c->exits[i];
+	}
+	for (i = 0; i < STATS_SIGNALS; i++)
+		killed += c->signals[i];
+	exited += killed;
+
+	if (!keyed) {
+		printf("  triggers %llu (%llu catch-up), spawns %llu "
+		    "(%llu failed), running %llu\n",
+		    (unsigned long long)c->triggers,
+		    (unsigned long long)c->catchups,
+		    (unsigned long long)c->spawns,
+		    (unsigned long long)c->spawn_failures,
+		    (unsigned long long)c->running);
+		printf("  launched:");
+		for (i = 0; i < STATS_LAUNCHERS; i++)
+			printf(" %s %llu", launcher_names[i],
+			    (unsigned long long)c->launches[i]);
+		printf(", through the helper %llu\n",
+		    (unsigned long long)c->helped);
+		printf("  exits %llu: %llu ok, %llu failed, %llu killed, "
+		    "%llu unknown\n", (unsigned long long)exited,
+		    (unsigned long long)c->exits[0],
+		    (unsigned long long)failed, (unsigned long long)killed,
+		    (unsigned long long)c->exits_unknown);
+		printf("  events:");
+		for (i = 0; i < STATS_EVENTS; i++)
+			printf(" %s %llu", event_names[i],
+			    (unsigned long long)c->events[i]);
+		printf("\n  pending us: p50 %llu, p90 %llu, p99 %llu\n",
+		    (unsigned long long)percentile(c->pending, 50),
+		    (unsigned long long)percentile(c->pending, 90),
+		    (unsigned long long)percentile(c->pending, 99));
+		printf("  duration us: p50 %llu, p90 %llu, p99 %llu\n",
+		    (unsigned long long)percentile(c->duration, 50),
+		    (unsigned long long)percentile(c->duration, 90),
+		    (unsigned long long)percentile(c->duration, 99));
+		for (i = 0; i < TRACE_STAGES; i++) {
+			if (!c->stage_count[i])
+				continue;
+			printf("  %s us: mean %llu, max %llu", stage_names[i],
+			    (unsigned long long)(c->stage_total_ns[i]
+			    / c->stage_count[i] / 1000),
+			    (unsigned long long)(c->stage_max_ns[i] / 1000));
+
+			/* The helper round trip is part of the launcher */
+			if (i == TRACE_SPAWNED && c->helped)
+				printf(", including the helper round trip "
+				    "for %llu starts",
+				    (unsigned long long)c->helped);
+			printf("\n");
+		}
+		return;
+	}
+
+	printf("%s.triggers=%llu\n", prefix, (unsigned long long)c->triggers);
+	printf("%s.catchups=%llu\n", prefix, (unsigned long long)c->catchups);
+	printf("%s.spawns=%llu\n", prefix, (unsigned long long)c->spawns);
+	printf("%s.spawn_failures=%llu\n", prefix,
+	    (unsigned long long)c->spawn_failures);
+	printf("%s.running=%llu\n", prefix, (unsigned long long)c->running);
+	for (i = 0; i < STATS_LAUNCHERS; i++)
+		printf("%s.launches.%s=%llu\n", prefix, launcher_names[i],
+		    (unsigned long long)c->launches[i]);
+	printf("%s.helped=%llu\n", prefix, (unsigned long long)c->helped);
+	for (i = 0; i < STATS_EVENTS; i++)
+		printf("%s.events.%s=%llu\n", prefix, event_names[i],
+		    (unsigned long long)c->events[i]);
+	for (i = 0; i < STATS_EXIT_CODES; i++)
+		if (c->exits[i])
+			printf("%s.exits.%u=%llu\n", prefix, i,
+			    (unsigned long long)c->exits[i]);
+	for (i = 0; i < STATS_SIGNALS; i++)
+		if (c->signals[i])
+			printf("%s.signals.%u=%llu\n", prefix, i,
+			    (unsigned long long)c->signals[i]);
+	printf("%s.exits_unknown=%llu\n", prefix,
+	    (unsigned long long)c->exits_unknown);
+	printf("%s.last_trigger_ns=%llu\n", prefix,
+	    (unsigned long long)c->last_trigger_ns);
+	printf("%s.last_exit_ns=%llu\n", prefix,
+	    (unsigned long long)c->last_exit_ns);
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (c->pending[i])
+			printf("%s.pending_us.%llu=%llu\n", prefix,
+			    (unsigned long long)STATS_BUCKET_LOW(i),
+			    (unsigned long long)c->pending[i]);
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (c->duration[i])
+			printf("%s.duration_us.%llu=%llu\n", prefix,
+			    (unsigned long long)STATS_BUCKET_LOW(i),
+			    (unsigned long long)c->duration[i]);
+	for (i = 0; i < TRACE_STAGES; i++) {
+		if (!c->stage_count[i])
+			continue;
+		printf("%s.stages.%s.count=%llu\n", prefix, stage_names[i],
+		    (unsigned long long)c->stage_count[i]);
+		printf("%s.stages.%s.total_ns=%llu\n", prefix,
+		    stage_names[i], (unsigned long long)c->stage_total_ns[i]);
+		printf("%s.stages.%s.max_ns=%llu\n", prefix, stage_names[i],
+		    (unsigned long long)c->stage_max_ns[i]);
+	}
+}
+
+
+/* print_sched - output the scheduler counters */
+static void
+print_sched(const struct stats_sched *s, int keyed) {
+	if (!keyed) {
+		printf("  scheduler: running %llu, ready %llu (max %llu), "
+		    "started %llu\n", (unsigned long long)s->running,
+		    (unsigned long long)s->depth,
+		    (unsigned long long)s->max_depth,
+		    (unsigned long long)s->started);
+		printf("  ready us: mean %llu, max %llu\n",
+		    (unsigned long long)(s->started
+		    ? s->wait_total_ns / s->started / 1000 : 0),
+		    (unsigned long long)(s->wait_max_ns / 1000));
+		return;
+	}
+
+	printf("sched.running=%llu\n", (unsigned long long)s->running);
+	printf("sched.depth=%llu\n", (unsigned long long)s->depth);
+	printf("sched.max_depth=%llu\n", (unsigned long long)s->max_depth);
+	printf("sched.started=%llu\n", (unsigned long long)s->started);
+	printf("sched.wait_total_ns=%llu\n",
+	    (unsigned long long)s->wait_total_ns);
+	printf("sched.wait_max_ns=%llu\n",
+	    (unsigned long long)s->wait_max_ns);
+}
+
+
+/* print_view - output a snapshot of the whole file */
+static void
+print_view(const struct view *view, int keyed) {
+	struct stats_counters global;
+	struct stats_sched sched;
+	struct stats_slot slot;
+	char prefix[32];
+	uint32_t i;
+	int stale_global, stale_sched, stale;
+
+	stale_global = read_copy(&global, &view->header->global, sizeof global,
+	    &view->header->global.seq) < 0;
+	stale_sched = read_copy(&sched, &view->header->sched, sizeof sched,
+	    &view->header->sched.seq) < 0;
+	if (keyed)
+		printf("pid=%llu\n", (unsigned long long)view->header->pid);
+	else
+		printf("filewatcherd %llu\n",
+		    (unsigned long long)view->header->pid);
+	if (stale_global)
+		print_inconsistent("global", keyed);
+	print_counters("global", &global, keyed);
+	if (stale_sched)
+		print_inconsistent("sched", keyed);
+	print_sched(&sched, keyed);
+
+	for (i = 0; i < view->header->nslots; i++) {
+		stale = read_copy(&slot, view->slots + i, sizeof slot,
+		    &view->slots[i].c.seq) < 0;
+		slot.path[STATS_PATH_MAX - 1] = 0;
+		if (!slot.path[0])
+			continue;
+		snprintf(prefix, sizeof prefix, "entry.%u", i);
+		if (keyed) {
+			printf("%s.path=%s\n", prefix, slot.path);
+			printf("%s.state=%s\n", prefix,
+			    slot.state <= STATS_MISSING
+			    ? state_names[slot.state] : "unknown");
+		}
+		else
+			printf("%s (%s)\n", slot.path,
+			    slot.state <= STATS_MISSING
+			    ? state_names[slot.state] : "unknown");
+		if (stale)
+			print_inconsistent(prefix, keyed);
+		print_counters(prefix, &slot.c, keyed);
+	}
+	fflush(stdout);
+}
+
+
+
+/*****************
+ * MAIN FUNCTION *
+ *****************/
+
+int
+main(int argc, char **argv) {
+	struct view view;
+	struct timespec interval = { 0, 0 };
+	long count = -1, ms = 0;
+	int argerr = 0, keyed = 0, c;
+	char *s;
+
+	while ((c = getopt(argc, argv, "c:i:k")) != -1) {
+		switch (c) {
+		    case 'c':
+			count = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || count < 0) {
+				fprintf(stderr, "Invalid count \"%s\"\n",
+				    optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		    case 'i':
+			ms = strtol(optarg, &s, 10);
+			if (s == optarg || s[0] || ms <= 0) {
+				fprintf(stderr, "Invalid interval \"%s\"\n",
+				    optarg);
+				return EXIT_FAILURE;
+			}
+			interval.tv_sec = ms / 1000;
+			interval.tv_nsec = ms % 1000 * 1000000;
+			break;
+		    case 'k':
+			keyed = 1;
+			break;
+		    default:
+			argerr = 1;
+		}
+	}
+	if (argerr || optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-k] [-c count] [-i interval_ms] "
+		    "file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* An interval without count repeats forever */
+	if (count < 0)
+		count = ms ? 0 : 1;
+
+	if (view_open(&view, argv[optind]) < 0)
+		return EXIT_FAILURE;
+
+	while (1) {
+		if (__atomic_load_n(&view.header->replaced, __ATOMIC_ACQUIRE)) {
+			munmap((void *)view.header, view.size);
+			if (view_open(&view, argv[optind]) < 0)
+				return EXIT_FAILURE;
+		}
+		print_view(&view, keyed);
+		if ((count && --count == 0) || !ms)
+			break;
+		nanosleep(&interval, 0);
+	}
+
+	munmap((void *)view.header, view.size);
+	return EXIT_SUCCESS;
+}
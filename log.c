@@ -79,6 +79,13 @@ log_assert(const char *reason, const char *source, unsigned line) {
 }
 
 
+/* log_bad_batch - invalid string provided for batch size */
+void
+log_bad_batch(const char *opt) {
+	report(LOG_ERR, "Bad value \"%s\" for batch size", opt);
+}
+
+
 /* log_bad_delay - invalid string provided for delay value */
 void
 log_bad_delay(const char *opt) {
@@ -86,6 +93,27 @@ log_bad_delay(const char *opt) {
 }
 
 
+/* log_bad_jobs - invalid string provided for the running commands limit */
+void
+log_bad_jobs(const char *opt) {
+	report(LOG_ERR, "Bad value \"%s\" for jobs", opt);
+}
+
+
+/* log_bad_launcher - unknown command launcher */
+void
+log_bad_launcher(const char *opt) {
+	report(LOG_ERR, "Bad value \"%s\" for launcher", opt);
+}
+
+
+/* log_bad_quota - invalid string provided for a user quota */
+void
+log_bad_quota(const char *opt) {
+	report(LOG_ERR, "Bad value \"%s\" for user quota", opt);
+}
+
+
 /* log_chdir - chdir("/") failed after successful chroot() */
 void
 log_chdir(const char *newroot) {
@@ -102,12 +130,79 @@ log_chroot(const char *newroot) {
 }
 
 
+/* log_entry_cancelled - delayed run dropped with its watchtab entry */
+void
+log_entry_cancelled(struct watch_entry *wentry) {
+	report(LOG_INFO, "Cancelled delayed run of \"%s\" for \"%s\"",
+	    wentry->command, wentry->path);
+}
+
+
+/* log_entry_catchup - entry found on a file changed without an event */
+void
+log_entry_catchup(struct watch_entry *wentry) {
+	report(LOG_INFO, "\"%s\" has changed without an event, "
+	    "triggering \"%s\"", wentry->path, wentry->command);
+}
+
+
+/* log_entry_delayed - command of a triggered entry scheduled for later */
+void
+log_entry_delayed(struct watch_entry *wentry) {
+	report(LOG_INFO, wentry->debounce
+	    ? "Running \"%s\" for \"%s\" after %ld.%03ld s without events"
+	    : "Running \"%s\" for \"%s\" in %ld.%03ld s",
+	    wentry->command, wentry->path, (long)wentry->delay.tv_sec,
+	    wentry->delay.tv_nsec / 1000000);
+}
+
+
+/* log_entry_missing - entry path absent, its nearest directory watched */
+void
+log_entry_missing(struct watch_entry *wentry, const char *dir) {
+	report(LOG_INFO, "\"%s\" does not exist, waiting for it in \"%s\"",
+	    wentry->path, dir);
+}
+
+
+/* log_entry_queued - triggered entry waits for one of its commands */
+void
+log_entry_queued(struct watch_entry *wentry) {
+	report(LOG_INFO, "Queued run of \"%s\" for \"%s\" (%u waiting)",
+	    wentry->command, wentry->path, wentry->queued);
+}
+
+
+/* log_entry_unreachable - path of an entry out of reach of its owner */
+void
+log_entry_unreachable(struct watch_entry *wentry, const char *path) {
+	report(LOG_ERR, "\"%s\" is out of reach of user %d, not watched",
+	    path, (int)wentry->uid);
+}
+
+
 /* log_entry_wait - watchtab entry successfully inserted in the queue */
 void
 log_entry_wait(struct watch_entry *wentry) {
 	report(LOG_INFO, "Waiting for events on \"%s\"", wentry->path);
 }
 
+
+/* log_events_lost - the kernel has dropped file events */
+void
+log_events_lost(void) {
+	report(LOG_WARNING, "Kernel event queue overflowed, "
+	    "checking all watched paths again");
+}
+
+
+/* log_evqueue - creation of the kernel event queue failed */
+void
+log_evqueue(const char *call) {
+	report(LOG_ERR, "Error in %s(): %s", call, strerror(errno));
+}
+
+
 /* log_exec - execve() failed */
 void
 log_exec(struct watch_entry *wentry) {
@@ -123,6 +218,14 @@ log_fork(void) {
 }
 
 
+/* log_helper - communication with the spawn helper failed */
+void
+log_helper(const char *call) {
+	report(LOG_ERR, "Error in spawn helper %s(): %s",
+	    call, strerror(errno));
+}
+
+
 /* log_kevent_entry - kevent() failed when adding an event for a file entry */
 void
 log_kevent_entry(const char *path) {
@@ -171,13 +274,6 @@ log_kevent_watchtab(const char *path) {
 }
 
 
-/* log_kqueue - report failure in kqueue() call */
-void
-log_kqueue(void) {
-	report(LOG_ERR, "Error in kqueue(): %s", strerror(errno));
-}
-
-
 /* log_lookup_group - getgrnam() failed */
 void
 log_lookup_group(const char *group) {
@@ -213,6 +309,14 @@ log_open_entry(const char *path) {
 }
 
 
+/* log_open_trace - trace file cannot be opened */
+void
+log_open_trace(const char *path) {
+	report(LOG_ERR, "Unable to open trace file \"%s\": %s",
+	    path, strerror(errno));
+}
+
+
 /* log_open_watchtab - watchtab file open() failed */
 void
 log_open_watchtab(const char *path) {
@@ -221,6 +325,34 @@ log_open_watchtab(const char *path) {
 }
 
 
+/* log_output - a line of command output, maybe split in two parts */
+void
+log_output(const char *path, pid_t pid, int is_stderr,
+    const char *first, size_t first_len,
+    const char *second, size_t second_len) {
+	report(is_stderr ? LOG_NOTICE : LOG_INFO, "\"%s\" [%d]: %.*s%.*s",
+	    path, (int)pid, (int)first_len, first, (int)second_len, second);
+}
+
+
+/* log_output_dropped - command output over the limit has been discarded */
+void
+log_output_dropped(const char *path, pid_t pid, int is_stderr,
+    size_t bytes) {
+	report(LOG_WARNING, "\"%s\" [%d]: %zu bytes of %s discarded "
+	    "over the output limit", path, (int)pid, bytes,
+	    is_stderr ? "stderr" : "stdout");
+}
+
+
+/* log_output_error - command output cannot be captured */
+void
+log_output_error(const char *path, const char *call) {
+	report(LOG_ERR, "Unable to capture output of \"%s\", error in %s(): %s",
+	    path, call, strerror(errno));
+}
+
+
 /* log_running - a watchtab entry has been triggered */
 void
 log_running(struct watch_entry *wentry) {
@@ -229,6 +361,19 @@ log_running(struct watch_entry *wentry) {
 }
 
 
+/* log_sched_stats - scheduler counters after a wakeup */
+void
+log_sched_stats(const struct sched_stats *stats) {
+	report(LOG_DEBUG, "Scheduler: %u running, %zu ready (%zu max), "
+	    "%llu started, wait %.3f ms average, %.3f ms max",
+	    stats->running, stats->depth, stats->max_depth,
+	    (unsigned long long)stats->started,
+	    stats->started
+	    ? stats->wait_total_ns / 1e6 / stats->started : 0.0,
+	    stats->wait_max_ns / 1e6);
+}
+
+
 /* log_setgid - setgid() failed */
 void
 log_setgid(gid_t gid) {
@@ -237,6 +382,22 @@ log_setgid(gid_t gid) {
 }
 
 
+/* log_setgroups - setgroups() failed */
+void
+log_setgroups(gid_t gid) {
+	report(LOG_INFO, "Unable to set groups to gID %d: %s",
+	    (int)gid, strerror(errno));
+}
+
+
+/* log_setsid - setsid() failed */
+void
+log_setsid(void) {
+	report(LOG_INFO, "Unable to start a new session: %s",
+	    strerror(errno));
+}
+
+
 /* log_setuid - setuid() failed */
 void
 log_setuid(uid_t uid) {
@@ -253,6 +414,63 @@ log_signal(int sig) {
 }
 
 
+/* log_spawn_session - posix_spawn() cannot start a new session */
+void
+log_spawn_session(void) {
+	report(LOG_ERR, "posix_spawn cannot start commands in a new session "
+	    "on this system, use the vfork launcher");
+}
+
+
+/* log_spawnattr - posix_spawnattr_*() failed */
+void
+log_spawnattr(void) {
+	report(LOG_ERR, "Unable to set up spawn attributes: %s",
+	    strerror(errno));
+}
+
+
+/* log_stats - statistics file cannot be written */
+void
+log_stats(const char *path, const char *call) {
+	report(LOG_ERR, "Unable to write statistics to \"%s\", "
+	    "error in %s(): %s", path, call, strerror(errno));
+}
+
+
+/* log_thread - thread creation failed */
+void
+log_thread(const char *call) {
+	report(LOG_WARNING, "Error in %s(), scanning with fewer threads: %s",
+	    call, strerror(errno));
+}
+
+
+/* log_trace - tracing failed, the trace file being dropped on write */
+void
+log_trace(const char *call) {
+	report(LOG_ERR, "Error in %s() while tracing: %s",
+	    call, strerror(errno));
+}
+
+
+/* log_tree_armed - directories of a recursive entry are watched */
+void
+log_tree_armed(struct watch_entry *wentry, size_t ndirs) {
+	report(LOG_INFO, "Waiting for events on \"%s\" and below, "
+	    "%zu directories", wentry->path, ndirs);
+}
+
+
+/* log_wakeup - a batch of events has been received */
+void
+log_wakeup(int nevents, size_t nchanges) {
+	report(LOG_DEBUG, "Received %d event%s after submitting %zu change%s",
+	    nevents, nevents == 1 ? "" : "s",
+	    nchanges, nchanges == 1 ? "" : "s");
+}
+
+
 /* log_watchtab_invalid_action - invalid action line in watchtab */
 void
 log_watchtab_invalid_action(const char *filename, unsigned line_no) {
@@ -279,10 +497,51 @@ log_watchtab_invalid_events(const char *filename, unsigned line_no,
 }
 
 
+/* log_watchtab_invalid_option - unknown or invalid entry option */
+void
+log_watchtab_invalid_option(const char *filename, unsigned line_no,
+    const char *option, size_t len) {
+	report(LOG_ERR, "Invalid entry option \"%.*s\" at %s:%u",
+	    (int)len, option, filename, line_no);
+}
+
+
+/* log_watchtab_invalid_pattern - invalid or too complex path glob */
+void
+log_watchtab_invalid_pattern(const char *filename, unsigned line_no,
+    const char *pattern, size_t len) {
+	report(LOG_ERR, "Invalid or too complex pattern \"%.*s\" at %s:%u",
+	    (int)len, pattern, filename, line_no);
+}
+
+
 /* log_watchtab_loaded - watchtab has been successfully loaded */
 void
-log_watchtab_loaded(const char *path) {
-	report(LOG_NOTICE, "Watchtab \"%s\" loaded successfully", path);
+log_watchtab_loaded(const char *path, const struct wtab_lookups *lookups) {
+	size_t total = lookups->hits + lookups->misses;
+
+	report(LOG_NOTICE, "Watchtab \"%s\" loaded successfully "
+	    "(%zu user/group lookups, %.1f%% cached, "
+	    "%.3f ms in system lookups)",
+	    path, total, total ? 100.0 * lookups->hits / total : 0.0,
+	    lookups->time_ns / 1e6);
+}
+
+
+/* log_watchtab_owner_chroot - chroot field in a watchtab not owned by root */
+void
+log_watchtab_owner_chroot(const char *filename, unsigned line_no) {
+	report(LOG_ERR, "Chroot field in a watchtab not owned by root "
+	    "at %s:%u", filename, line_no);
+}
+
+
+/* log_watchtab_quota - watchtab with more entries than its owner may have */
+void
+log_watchtab_quota(const char *path, uid_t owner, size_t entries,
+    size_t allowed) {
+	report(LOG_ERR, "Watchtab \"%s\" exceeds the quota of uID %d "
+	    "(%zu entries, %zu allowed)", path, (int)owner, entries, allowed);
 }
 
 
@@ -293,19 +552,74 @@ log_watchtab_read(void) {
 }
 
 
+/* log_watchtab_reloaded - watchtab has been successfully reloaded */
+void
+log_watchtab_reloaded(const char *path, const struct wtab_diff *diff,
+    const struct wtab_lookups *lookups) {
+	size_t total = lookups->hits + lookups->misses;
+
+	report(LOG_NOTICE, "Watchtab \"%s\" reloaded successfully "
+	    "(%zu entries kept, %zu added, %zu removed, "
+	    "%zu user/group lookups, %.1f%% cached, "
+	    "%.3f ms in system lookups)",
+	    path, diff->kept, diff->added, diff->removed, total,
+	    total ? 100.0 * lookups->hits / total : 0.0,
+	    lookups->time_ns / 1e6);
+}
+
+
+/* log_watchtab_removed - watchtab removed from the directory */
+void
+log_watchtab_removed(const char *path, size_t entries) {
+	report(LOG_NOTICE, "Watchtab \"%s\" removed (%zu entries released)",
+	    path, entries);
+}
+
+
+/* log_watchtab_unsafe - watchtab that could have been written by others */
+void
+log_watchtab_unsafe(const char *path) {
+	report(LOG_ERR, "Watchtab \"%s\" is not a regular file with a single "
+	    "link, writable only by its owner", path);
+}
+
+
 /* print_usage - output usage text upon request or after argument error */
 void
 print_usage(int after_error, int argc, char **argv) {
 	(void)argc;
 
 	fprintf(after_error ? stderr : stdout,
-	    "Usage: %s [-dh] [-f delay_ms] watchtab\n\n"
+	    "Usage: %s [-dhsuv] [-b count] [-E count] [-J jobs] [-j jobs]\n"
+	    "       [-l launcher] [-S file] [-T file] [-w delay_ms] watchtab\n\n"
+	    "\t-b, --batch count\n"
+	    "\t\tHandle at most that number of events per wakeup\n"
 	    "\t-d, --foreground\n"
 	    "\t\tDon't fork to background and log to stderr\n"
+	    "\t-E, --user-entries count\n"
+	    "\t\tWith -u, allow that number of entries to each user\n"
 	    "\t-h, --help\n"
 	    "\t\tDisplay this help text\n"
+	    "\t-J, --user-jobs count\n"
+	    "\t\tRun at most that number of commands of a user at once\n"
+	    "\t-j, --jobs count\n"
+	    "\t\tRun at most that number of commands at once\n"
+	    "\t-l, --launcher vfork|posix_spawn\n"
+	    "\t\tStart commands with vfork (default) or posix_spawn\n"
+	    "\t-S, --stats file\n"
+	    "\t\tKeep counters in a shared file, read with fwstat\n"
+	    "\t-s, --spawn-helper\n"
+	    "\t\tStart commands from a small helper process\n"
+	    "\t-T, --trace file\n"
+	    "\t\tWrite the time of each stage of runs in Chrome trace format\n"
+	    "\t-u, --owner\n"
+	    "\t\tRun the entries of each watchtab as its owner\n"
+	    "\t-v, --verbose\n"
+	    "\t\tLog the number of events and changes of each wakeup\n"
 	    "\t-w, --wait delay_ms\n"
 	    "\t\tWait that number of milliseconds after watchtab\n"
-	    "\t\tchanges before reloading it\n",
+	    "\t\tchanges before reloading it\n\n"
+	    "watchtab can also be a directory, each file of which is\n"
+	    "loaded and reloaded as a separate watchtab\n",
 	    argv[0]);
 }
@@ -24,6 +24,7 @@
 #ifndef FILEWATCHER_LOG_H
 #define FILEWATCHER_LOG_H
 
+#include "sched.h"
 #include "watchtab.h"
 
 
@@ -56,10 +57,26 @@ void
 log_assert(const char *reason, const char *source, unsigned line);
 #define LOG_ASSERT(m) log_assert((m), __FILE__, __LINE__)
 
+/* log_bad_batch - invalid string provided for batch size */
+void
+log_bad_batch(const char *opt);
+
 /* log_bad_delay - invalid string provided for delay value */
 void
 log_bad_delay(const char *opt);
 
+/* log_bad_jobs - invalid string provided for the running commands limit */
+void
+log_bad_jobs(const char *opt);
+
+/* log_bad_launcher - unknown command launcher */
+void
+log_bad_launcher(const char *opt);
+
+/* log_bad_quota - invalid string provided for a user quota */
+void
+log_bad_quota(const char *opt);
+
 /* log_chdir - chdir("/") failed after successful chroot() */
 void
 log_chdir(const char *newroot);
@@ -68,10 +85,42 @@ log_chdir(const char *newroot);
 void
 log_chroot(const char *newroot);
 
+/* log_entry_cancelled - delayed run dropped with its watchtab entry */
+void
+log_entry_cancelled(struct watch_entry *wentry);
+
+/* log_entry_catchup - entry found on a file changed without an event */
+void
+log_entry_catchup(struct watch_entry *wentry);
+
+/* log_entry_delayed - command of a triggered entry scheduled for later */
+void
+log_entry_delayed(struct watch_entry *wentry);
+
+/* log_entry_missing - entry path absent, its nearest directory watched */
+void
+log_entry_missing(struct watch_entry *wentry, const char *dir);
+
+/* log_entry_queued - triggered entry waits for one of its commands */
+void
+log_entry_queued(struct watch_entry *wentry);
+
+/* log_entry_unreachable - path of an entry out of reach of its owner */
+void
+log_entry_unreachable(struct watch_entry *wentry, const char *path);
+
 /* log_entry_wait - watchtab entry successfully inserted in the queue */
 void
 log_entry_wait(struct watch_entry *wentry);
 
+/* log_events_lost - the kernel has dropped file events */
+void
+log_events_lost(void);
+
+/* log_evqueue - creation of the kernel event queue failed */
+void
+log_evqueue(const char *call);
+
 /* log_exec - execve() failed */
 void
 log_exec(struct watch_entry *wentry);
@@ -80,6 +129,10 @@ log_exec(struct watch_entry *wentry);
 void
 log_fork(void);
 
+/* log_helper - communication with the spawn helper failed */
+void
+log_helper(const char *call);
+
 /* log_kevent_entry - kevent() failed when adding an event for a file entry */
 void
 log_kevent_entry(const char *path);
@@ -104,9 +157,6 @@ log_kevent_wait(void);
 void
 log_kevent_watchtab(const char *path);
 
-/* log_kqueue - kqueue() failed */
-void
-log_kqueue(void);
 
 /* log_lookup_group - getgrnam() failed */
 /* WARNING: errno must explicitly be zeroed before calling getgrnam() */
@@ -127,18 +177,49 @@ log_lookup_self(void);
 void
 log_open_entry(const char *path);
 
+/* log_open_trace - trace file cannot be opened */
+void
+log_open_trace(const char *path);
+
 /* log_open_watchtab - watchtab file open() failed */
 void
 log_open_watchtab(const char *path);
 
+/* log_output - a line of command output, maybe split in two parts */
+void
+log_output(const char *path, pid_t pid, int is_stderr,
+    const char *first, size_t first_len,
+    const char *second, size_t second_len);
+
+/* log_output_dropped - command output over the limit has been discarded */
+void
+log_output_dropped(const char *path, pid_t pid, int is_stderr,
+    size_t bytes);
+
+/* log_output_error - command output cannot be captured */
+void
+log_output_error(const char *path, const char *call);
+
 /* log_running - a watchtab entry has been triggered */
 void
 log_running(struct watch_entry *wentry);
 
+/* log_sched_stats - scheduler counters after a wakeup */
+void
+log_sched_stats(const struct sched_stats *stats);
+
 /* log_setgid - setgid() failed */
 void
 log_setgid(gid_t gid);
 
+/* log_setgroups - setgroups() failed */
+void
+log_setgroups(gid_t gid);
+
+/* log_setsid - setsid() failed */
+void
+log_setsid(void);
+
 /* log_setuid - setuid() failed */
 void
 log_setuid(uid_t uid);
@@ -147,6 +228,34 @@ log_setuid(uid_t uid);
 void
 log_signal(int sig);
 
+/* log_spawn_session - posix_spawn() cannot start a new session */
+void
+log_spawn_session(void);
+
+/* log_spawnattr - posix_spawnattr_*() failed */
+void
+log_spawnattr(void);
+
+/* log_stats - statistics file cannot be written */
+void
+log_stats(const char *path, const char *call);
+
+/* log_thread - thread creation failed */
+void
+log_thread(const char *call);
+
+/* log_trace - tracing failed, the trace file being dropped on write */
+void
+log_trace(const char *call);
+
+/* log_tree_armed - directories of a recursive entry are watched */
+void
+log_tree_armed(struct watch_entry *wentry, size_t ndirs);
+
+/* log_wakeup - a batch of events has been received */
+void
+log_wakeup(int nevents, size_t nchanges);
+
 /* log_watchtab_invalid_action - invalid action line in watchtab */
 void
 log_watchtab_invalid_action(const char *filename, unsigned line_no);
@@ -161,14 +270,46 @@ void
 log_watchtab_invalid_events(const char *filename, unsigned line_no,
     const char *field, size_t len);
 
+/* log_watchtab_invalid_option - unknown or invalid entry option */
+void
+log_watchtab_invalid_option(const char *filename, unsigned line_no,
+    const char *option, size_t len);
+
+/* log_watchtab_invalid_pattern - invalid or too complex path glob */
+void
+log_watchtab_invalid_pattern(const char *filename, unsigned line_no,
+    const char *pattern, size_t len);
+
 /* log_watchtab_loaded - watchtab has been successfully loaded */
 void
-log_watchtab_loaded(const char *path);
+log_watchtab_loaded(const char *path, const struct wtab_lookups *lookups);
+
+/* log_watchtab_owner_chroot - chroot field in a watchtab not owned by root */
+void
+log_watchtab_owner_chroot(const char *filename, unsigned line_no);
+
+/* log_watchtab_quota - watchtab with more entries than its owner may have */
+void
+log_watchtab_quota(const char *path, uid_t owner, size_t entries,
+    size_t allowed);
 
 /* log_watchtab_read - read error on watchtab */
 void
 log_watchtab_read(void);
 
+/* log_watchtab_reloaded - watchtab has been successfully reloaded */
+void
+log_watchtab_reloaded(const char *path, const struct wtab_diff *diff,
+    const struct wtab_lookups *lookups);
+
+/* log_watchtab_removed - watchtab removed from the directory */
+void
+log_watchtab_removed(const char *path, size_t entries);
+
+/* log_watchtab_unsafe - watchtab that could have been written by others */
+void
+log_watchtab_unsafe(const char *path);
+
 /* print_usage - output usage text upon request or after argument error */
 void
 print_usage(int after_error, int argc, char **argv);
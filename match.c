@@ -0,0 +1,504 @@
+/* match.c - glob patterns compiled into deterministic automata */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The pattern is first cut into tokens, each being a position of an NFA:
+ * token i consumes one byte of its set and moves to i + 1, or loops on
+ * itself for `*` and a trailing `**`, which can also be skipped. The
+ * position after the last token is final. Subsets of positions reachable
+ * together then become the DFA states, built breadth-first from the start.
+ *
+ * A `**` + / takes two positions, so that it is only skipped at the start of
+ * a component: the first one, at a component start, can be skipped past
+ * both, and moves to the second one on any byte but a slash. The second
+ * one is inside a component, and only leaves it back to the first one on
+ * a slash.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "match.h"
+
+/* maximum number of DFA states of a pattern */
+#define MATCH_MAX_STATES 4096
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* enum token_kind - what a pattern token consumes */
+enum token_kind {
+	TOK_ONE,			/* a single byte of the set */
+	TOK_STAR,			/* any number of bytes, but no slash */
+	TOK_ANYDIRS,			/* any number of directories, `**` + / */
+	TOK_INDIRS,			/* inside a directory of TOK_ANYDIRS */
+	TOK_ANYALL			/* anything, trailing `**` */
+};
+
+/* struct token - a position in the pattern */
+struct token {
+	enum token_kind	kind;
+	unsigned char	set[32];	/* bitmap of accepted bytes */
+};
+
+/* struct builder - state of the subset construction */
+struct builder {
+	struct token	*tokens;	/* pattern positions */
+	size_t		ntokens;	/* number of tokens */
+	size_t		words;		/* number of words in a position set */
+	uint64_t	*sets;		/* position set of each DFA state */
+	unsigned	*slots;		/* hash table of DFA states, plus one */
+	size_t		nslots;		/* number of slots, a power of 2 */
+};
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* set_has - whether a byte bitmap contains a byte */
+static int
+set_has(const unsigned char *set, unsigned char c) {
+	return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+
+/* set_add - add a byte to a bitmap */
+static void
+set_add(unsigned char *set, unsigned char c) {
+	set[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+
+/* parse_class - decode a bracket expression starting after `[` */
+/*   Return the length consumed including the closing `]`, or 0 when it
+ *   is not closed. */
+static size_t
+parse_class(const char *src, size_t len, unsigned char *set) {
+	size_t i = 0;
+	int negate = 0;
+	unsigned char c, last;
+	unsigned k;
+
+	memset(set, 0, 32);
+	if (i < len && (src[i] == '!' || src[i] == '^')) {
+		negate = 1;
+		i++;
+	}
+
+	/* A leading `]` is a literal */
+	if (i < len && src[i] == ']') {
+		set_add(set, ']');
+		i++;
+	}
+
+	while (i < len && src[i] != ']') {
+		if (src[i] == '\\' && i + 1 < len) i++;
+		c = (unsigned char)src[i++];
+		if (i + 1 < len && src[i] == '-' && src[i + 1] != ']') {
+			i++;
+			if (src[i] == '\\' && i + 1 < len) i++;
+			last = (unsigned char)src[i++];
+			for (k = c; k <= last; k++)
+				set_add(set, (unsigned char)k);
+		}
+		else
+			set_add(set, c);
+	}
+	if (i >= len)
+		return 0;
+
+	if (negate)
+		for (k = 0; k < 32; k++)
+			set[k] = (unsigned char)~set[k];
+	set[(unsigned char)'/' >> 3] &= (unsigned char)~(1 << ('/' & 7));
+	return i + 1;
+}
+
+
+/* tokenize - cut an escaped pattern into tokens */
+/*   Return the number of tokens, tokens having room for len of them. */
+static size_t
+tokenize(const char *src, size_t len, struct token *tokens) {
+	size_t i = 0, n = 0, used;
+	struct token *tok;
+	int component_start;
+
+	while (i < len) {
+		tok = tokens + n;
+		tok->kind = TOK_ONE;
+		memset(tok->set, 0, sizeof tok->set);
+		component_start = (i == 0 || src[i - 1] == '/');
+
+		if (src[i] == '\\' && i + 1 < len) {
+			set_add(tok->set, (unsigned char)src[i + 1]);
+			i += 2;
+		}
+		else if (src[i] == '?') {
+			memset(tok->set, 0xff, sizeof tok->set);
+			tok->set['/' >> 3] &= (unsigned char)~(1 << ('/' & 7));
+			i++;
+		}
+		else if (src[i] == '*') {
+			memset(tok->set, 0xff, sizeof tok->set);
+			if (component_start && i + 2 < len && src[i + 1] == '*'
+			    && src[i + 2] == '/') {
+				tok->kind = TOK_ANYDIRS;
+				tok[1] = tok[0];
+				tok[1].kind = TOK_INDIRS;
+				n++;
+				i += 3;
+			}
+			else if (component_start && i + 2 == len
+			    && src[i + 1] == '*') {
+				tok->kind = TOK_ANYALL;
+				i += 2;
+			}
+			else {
+				tok->kind = TOK_STAR;
+				tok->set['/' >> 3]
+				    &= (unsigned char)~(1 << ('/' & 7));
+				while (i < len && src[i] == '*') i++;
+			}
+		}
+		else if (src[i] == '['
+		    && (used = parse_class(src + i + 1, len - i - 1,
+		        tok->set)) > 0)
+			i += used + 1;
+		else
+			set_add(tok->set, (unsigned char)src[i++]);
+
+		n++;
+	}
+
+	return n;
+}
+
+
+/* closure - add positions reachable without consuming anything */
+static void
+closure(const struct builder *b, uint64_t *set) {
+	size_t i, to;
+
+	for (i = 0; i < b->ntokens; i++) {
+		if (!((set[i / 64] >> (i % 64)) & 1))
+			continue;
+		switch (b->tokens[i].kind) {
+		    case TOK_ONE:
+		    case TOK_INDIRS:
+			continue;
+		    case TOK_ANYDIRS:
+			to = i + 2;
+			break;
+		    default:
+			to = i + 1;
+		}
+		set[to / 64] |= (uint64_t)1 << (to % 64);
+	}
+}
+
+
+/* next_position - position reached by a token consuming a byte of its set */
+static size_t
+next_position(const struct token *tok, size_t i, unsigned char c) {
+	switch (tok->kind) {
+	    case TOK_ONE:
+		return i + 1;
+	    case TOK_ANYDIRS:
+		return c == '/' ? i : i + 1;
+	    case TOK_INDIRS:
+		return c == '/' ? i - 1 : i;
+	    default:
+		return i;
+	}
+}
+
+
+/* hash_set - hash a position set */
+static size_t
+hash_set(const struct builder *b, const uint64_t *set) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < b->words; i++) {
+		hash ^= set[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (size_t)(hash ^ hash >> 29);
+}
+
+
+/* find_state - lookup a DFA state by position set, adding it if new */
+/*   Return the state, or MATCH_MAX_STATES when there are too many. */
+static unsigned
+find_state(struct builder *b, struct matcher *m, const uint64_t *set) {
+	size_t slot = hash_set(b, set) & (b->nslots - 1);
+	unsigned state;
+
+	while ((state = b->slots[slot]) != 0) {
+		state--;
+		if (memcmp(b->sets + state * b->words, set,
+		    b->words * sizeof *set) == 0)
+			return state;
+		slot = (slot + 1) & (b->nslots - 1);
+	}
+
+	if (m->nstates >= MATCH_MAX_STATES)
+		return MATCH_MAX_STATES;
+	state = m->nstates++;
+	memcpy(b->sets + state * b->words, set, b->words * sizeof *set);
+	b->slots[slot] = state + 1;
+	return state;
+}
+
+
+/* build_classes - group bytes that no token can tell apart */
+/*   Fill rep with one byte of each class. */
+static void
+build_classes(const struct builder *b, struct matcher *m,
+    unsigned char *rep) {
+	unsigned c, k;
+	size_t i;
+
+	m->nclasses = 0;
+	for (c = 0; c < 256; c++) {
+		for (k = 0; k < m->nclasses; k++) {
+			unsigned char r = rep[k];
+
+			if ((c == '/') != (r == '/'))
+				continue;
+			for (i = 0; i < b->ntokens; i++)
+				if (set_has(b->tokens[i].set, (unsigned char)c)
+				    != set_has(b->tokens[i].set, r))
+					break;
+			if (i == b->ntokens)
+				break;
+		}
+		if (k == m->nclasses)
+			rep[m->nclasses++] = (unsigned char)c;
+		m->classes[c] = (unsigned char)k;
+	}
+}
+
+
+/* build_dfa - run the subset construction */
+/*   Return 0 on success, -1 when out of memory or states. */
+static int
+build_dfa(struct builder *b, struct matcher *m) {
+	unsigned char rep[256], *accept;
+	unsigned state, k, target, *next;
+	uint64_t *set;
+	size_t i;
+
+	build_classes(b, m, rep);
+
+	b->sets = calloc((size_t)MATCH_MAX_STATES * b->words, sizeof *b->sets);
+	b->nslots = MATCH_MAX_STATES * 2;
+	b->slots = calloc(b->nslots, sizeof *b->slots);
+	m->next = malloc((size_t)MATCH_MAX_STATES * m->nclasses
+	    * sizeof *m->next);
+	m->accept = malloc(MATCH_MAX_STATES);
+	set = malloc(b->words * sizeof *set);
+	if (!b->sets || !b->slots || !m->next || !m->accept || !set) {
+		log_alloc("pattern automaton");
+		free(set);
+		return -1;
+	}
+
+	/* State 0 is the empty set, from which nothing matches, and state 1
+	 * the start */
+	memset(set, 0, b->words * sizeof *set);
+	find_state(b, m, set);
+	set[0] = 1;
+	closure(b, set);
+	find_state(b, m, set);
+
+	for (state = 0; state < m->nstates; state++) {
+		const uint64_t *from = b->sets + state * b->words;
+
+		m->accept[state] = (from[b->ntokens / 64]
+		    >> (b->ntokens % 64)) & 1;
+		for (k = 0; k < m->nclasses; k++) {
+			memset(set, 0, b->words * sizeof *set);
+			for (i = 0; i < b->ntokens; i++) {
+				const struct token *tok = b->tokens + i;
+				size_t to;
+
+				if (!((from[i / 64] >> (i % 64)) & 1)
+				    || !set_has(tok->set, rep[k]))
+					continue;
+				to = next_position(tok, i, rep[k]);
+				set[to / 64] |= (uint64_t)1 << (to % 64);
+			}
+			closure(b, set);
+			target = find_state(b, m, set);
+			if (target >= MATCH_MAX_STATES) {
+				free(set);
+				return -1;
+			}
+			m->next[state * m->nclasses + k] = target;
+		}
+	}
+
+	free(set);
+
+	/* Give back what the construction did not use */
+	next = realloc(m->next, m->nstates * m->nclasses * sizeof *m->next);
+	if (next) m->next = next;
+	accept = realloc(m->accept, m->nstates);
+	if (accept) m->accept = accept;
+	return 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* match_is_glob - whether an escaped path contains wildcards */
+int
+match_is_glob(const char *src, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] == '\\')
+			i++;
+		else if (src[i] == '*' || src[i] == '?' || src[i] == '[')
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* match_compile - build the automaton of an escaped glob pattern */
+struct matcher *
+match_compile(const char *src, size_t len) {
+	struct builder b;
+	struct matcher *m;
+	size_t i, base_len = 0;
+	char *prefix;
+
+	memset(&b, 0, sizeof b);
+	m = calloc(1, sizeof *m);
+	b.tokens = malloc((len + 1) * sizeof *b.tokens);
+	if (!m || !b.tokens) {
+		log_alloc("pattern");
+		free(m);
+		free(b.tokens);
+		return 0;
+	}
+	b.ntokens = tokenize(src, len, b.tokens);
+	b.words = (b.ntokens + 1 + 63) / 64;
+
+	if (build_dfa(&b, m) < 0) {
+		free(b.tokens);
+		free(b.sets);
+		free(b.slots);
+		match_free(m);
+		return 0;
+	}
+	free(b.sets);
+	free(b.slots);
+
+	/* The base is made of the literal components before any wildcard */
+	for (i = 0; i < b.ntokens && b.tokens[i].kind == TOK_ONE; i++) {
+		unsigned c, found = 0, k;
+
+		for (c = k = 0; c < 256; c++)
+			if (set_has(b.tokens[i].set, (unsigned char)c)) {
+				found = c;
+				k++;
+			}
+		if (k != 1)
+			break;
+		if (found == '/')
+			base_len = i + 1;
+	}
+
+	m->pattern = malloc(len + 1);
+	prefix = malloc(base_len + 2);
+	if (!m->pattern || !prefix) {
+		log_alloc("pattern");
+		free(prefix);
+		free(b.tokens);
+		match_free(m);
+		return 0;
+	}
+	memcpy(m->pattern, src, len);
+	m->pattern[len] = 0;
+
+	for (i = 0; i < base_len; i++) {
+		unsigned c;
+
+		for (c = 0; !set_has(b.tokens[i].set, (unsigned char)c); c++);
+		prefix[i] = (char)c;
+	}
+	prefix[base_len] = 0;
+	m->base_state = match_step(m, MATCH_START, prefix);
+	free(b.tokens);
+
+	/* Strip the trailing slash, unless it is the root directory */
+	if (base_len == 0)
+		strcpy(prefix, ".");
+	else if (base_len > 1)
+		prefix[base_len - 1] = 0;
+	m->base = prefix;
+	return m;
+}
+
+
+/* match_free - release a compiled pattern */
+void
+match_free(struct matcher *m) {
+	if (!m) return;
+
+	free(m->pattern);
+	free(m->base);
+	free(m->next);
+	free(m->accept);
+	free(m);
+}
+
+
+/* match_step - feed a string to the automaton from the given state */
+unsigned
+match_step(const struct matcher *m, unsigned state, const char *s) {
+	const unsigned char *p = (const unsigned char *)s;
+
+	while (*p && state != MATCH_DEAD)
+		state = m->next[state * m->nclasses + m->classes[*p++]];
+
+	return state;
+}
+
+
+/* match_dir - state after a directory name and a slash */
+unsigned
+match_dir(const struct matcher *m, unsigned state, const char *name) {
+	state = match_step(m, state, name);
+	if (state == MATCH_DEAD)
+		return state;
+	return m->next[state * m->nclasses + m->classes['/']];
+}
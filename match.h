@@ -0,0 +1,85 @@
+/* match.h - glob patterns compiled into deterministic automata */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Patterns support `?`, `*` and `[...]` within a path component, `**` as
+ * a whole component matching any number of directories, and backslash
+ * escapes. They are turned into a DFA once, with bytes grouped into
+ * classes the pattern cannot tell apart, so that matching is a table
+ * lookup per byte and can be resumed from any state: a directory keeps the
+ * state reached after its path, and only names inside it are fed later.
+ */
+
+#ifndef FILEWATCHER_MATCH_H
+#define FILEWATCHER_MATCH_H
+
+#include <stddef.h>
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* state from which nothing can match anymore */
+#define MATCH_DEAD	0
+
+/* state before the first byte of a path */
+#define MATCH_START	1
+
+/* struct matcher - a compiled glob pattern */
+struct matcher {
+	char		*pattern;	/* source text, escapes included */
+	char		*base;		/* directory before the first wildcard */
+	unsigned	base_state;	/* state after base and a slash */
+	unsigned	nstates;	/* number of DFA states */
+	unsigned	nclasses;	/* number of byte classes */
+	unsigned char	classes[256];	/* class of each byte */
+	unsigned	*next;		/* nstates * nclasses transitions */
+	unsigned char	*accept;	/* whether each state is final */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* match_is_glob - whether an escaped path contains wildcards */
+int
+match_is_glob(const char *src, size_t len);
+
+/* match_compile - build the automaton of an escaped glob pattern */
+/*   Return null when the pattern is invalid or too complex. */
+struct matcher *
+match_compile(const char *src, size_t len);
+
+/* match_free - release a compiled pattern */
+void
+match_free(struct matcher *m);
+
+/* match_step - feed a string to the automaton from the given state */
+unsigned
+match_step(const struct matcher *m, unsigned state, const char *s);
+
+/* match_dir - state after a directory name and a slash */
+unsigned
+match_dir(const struct matcher *m, unsigned state, const char *name);
+
+/* match_accepts - whether a state is final */
+#define match_accepts(m, state) ((m)->accept[(state)])
+
+#endif /* ndef FILEWATCHER_MATCH_H */
@@ -0,0 +1,296 @@
+/* output.c - capture of command output */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "output.h"
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* discard - sink for output read once the budget is exhausted */
+static char discard[OUTPUT_BATCH];
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* new_output - allocate a capture and its pipe */
+/*   Return null after logging, or the capture and its writing end. */
+static struct output *
+new_output(struct watch_entry *wentry, int is_stderr, int *wfd) {
+	struct output *out;
+	size_t len = strlen(wentry->path) + 1;
+	int fds[2];
+
+	out = malloc(sizeof *out + len);
+	if (!out) {
+		log_alloc("command output");
+		return 0;
+	}
+
+	/* Only the reading end is non-blocking, a full pipe stalls the
+	 * command rather than the daemon */
+	if (pipe(fds) < 0) {
+		log_output_error(wentry->path, "pipe");
+		free(out);
+		return 0;
+	}
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0
+	    || fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0
+	    || fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+		log_output_error(wentry->path, "fcntl");
+		close(fds[0]);
+		close(fds[1]);
+		free(out);
+		return 0;
+	}
+
+	out->fd = fds[0];
+	out->is_stderr = is_stderr;
+	out->pid = 0;
+	out->budget = wentry->max_output;
+	out->dropped = 0;
+	out->start = 0;
+	out->len = 0;
+	out->scanned = 0;
+	memcpy(out->path, wentry->path, len);
+	*wfd = fds[1];
+	return out;
+}
+
+
+/* free_output - release a capture */
+static void
+free_output(struct evqueue *evq, struct output *out) {
+	if (evq)
+		evq_read_off(evq, out->fd, out);
+	close(out->fd);
+	free(out);
+}
+
+
+/* fill_ring - read as much as fits in the free part of the ring */
+static ssize_t
+fill_ring(struct output *out) {
+	struct iovec iov[2];
+	size_t end = (out->start + out->len) % OUTPUT_RING;
+	size_t room = OUTPUT_RING - out->len;
+	ssize_t n;
+	int iovcnt = 1;
+
+	iov[0].iov_base = out->ring + end;
+	iov[0].iov_len = room;
+	if (end + room > OUTPUT_RING) {
+		iov[0].iov_len = OUTPUT_RING - end;
+		iov[1].iov_base = out->ring;
+		iov[1].iov_len = room - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	n = readv(out->fd, iov, iovcnt);
+	if (n > 0)
+		out->len += (size_t)n;
+	return n;
+}
+
+
+/* find_newline - offset in the ring data of the first newline, or len */
+static size_t
+find_newline(struct output *out) {
+	size_t first_len = OUTPUT_RING - out->start;
+	const char *p;
+
+	if (first_len > out->len)
+		first_len = out->len;
+
+	/* Bytes up to scanned are already known not to be newlines */
+	if (out->scanned < first_len) {
+		p = memchr(out->ring + out->start + out->scanned, '\n',
+		    first_len - out->scanned);
+		if (p)
+			return (size_t)(p - out->ring) - out->start;
+		out->scanned = first_len;
+	}
+	if (out->scanned < out->len) {
+		p = memchr(out->ring + (out->scanned - first_len), '\n',
+		    out->len - out->scanned);
+		if (p)
+			return first_len + (size_t)(p - out->ring);
+	}
+
+	out->scanned = out->len;
+	return out->len;
+}
+
+
+/* emit_line - log the first len bytes of the ring, then consume used */
+/*   Bytes over the budget are counted as dropped. */
+static void
+emit_line(struct output *out, size_t len, size_t used) {
+	size_t logged = len < out->budget ? len : out->budget;
+	size_t first_len = OUTPUT_RING - out->start;
+
+	if (first_len > logged)
+		first_len = logged;
+	log_output(out->path, out->pid, out->is_stderr,
+	    out->ring + out->start, first_len,
+	    out->ring, logged - first_len);
+
+	out->budget -= logged;
+	out->dropped += len - logged;
+	out->start = (out->start + used) % OUTPUT_RING;
+	out->len -= used;
+	out->scanned = 0;
+}
+
+
+/* flush_lines - log complete lines, and everything at end of file */
+/*   A full ring without newline is logged as a line on its own. */
+static void
+flush_lines(struct output *out, int eof) {
+	size_t line;
+
+	while (out->len > 0 && out->budget > 0) {
+		line = find_newline(out);
+		if (line < out->len)
+			emit_line(out, line, line + 1);
+		else if (eof || out->len == OUTPUT_RING)
+			emit_line(out, out->len, out->len);
+		else
+			break;
+	}
+
+	/* Nothing more is logged once the budget is exhausted */
+	if (out->budget == 0 && out->len > 0) {
+		out->dropped += out->len;
+		out->start = out->len = out->scanned = 0;
+	}
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* output_open - create the pipes of a command about to be started */
+int
+output_open(struct watch_entry *wentry, struct output *out[2], int stdio[2]) {
+	out[0] = out[1] = 0;
+	stdio[0] = stdio[1] = -1;
+
+	/* A zero limit leaves the command with the daemon output */
+	if (wentry->max_output == 0)
+		return -1;
+
+	out[0] = new_output(wentry, 0, stdio + 0);
+	if (!out[0])
+		return -1;
+	out[1] = new_output(wentry, 1, stdio + 1);
+	if (!out[1]) {
+		free_output(0, out[0]);
+		close(stdio[0]);
+		out[0] = 0;
+		stdio[0] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* output_start - watch the pipes of a command once started */
+void
+output_start(struct evqueue *evq, struct output *out[2], int stdio[2],
+    pid_t pid) {
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!out[i])
+			continue;
+		close(stdio[i]);
+		stdio[i] = -1;
+		out[i]->pid = pid;
+		if (!pid)
+			free_output(0, out[i]);
+		else if (evq_read(evq, out[i]->fd, out[i]) < 0) {
+			log_output_error(out[i]->path, "evq_read");
+			free_output(0, out[i]);
+		}
+		out[i] = 0;
+	}
+}
+
+
+/* output_event - read and log what a stream has available */
+void
+output_event(struct evqueue *evq, struct output *out) {
+	size_t total = 0;
+	ssize_t n;
+
+	/* Bounded, the descriptor is reported again while data is left */
+	while (total < OUTPUT_BATCH) {
+		n = out->budget > 0
+		    ? fill_ring(out)
+		    : read(out->fd, discard, sizeof discard);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n < 0)
+			log_output_error(out->path, "read");
+		if (n <= 0)
+			break;
+
+		total += (size_t)n;
+		if (out->budget > 0)
+			flush_lines(out, 0);
+		else
+			out->dropped += (size_t)n;
+	}
+	if (n > 0)
+		return;
+
+	/* End of file, or error */
+	flush_lines(out, 1);
+	if (out->dropped > 0)
+		log_output_dropped(out->path, out->pid, out->is_stderr,
+		    out->dropped);
+	free_output(evq, out);
+}
+
+
+/* output_error - drop a stream whose registration has failed */
+void
+output_error(struct evqueue *evq, struct output *out) {
+	log_output_error(out->path, "evq_read");
+	free_output(evq, out);
+}
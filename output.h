@@ -0,0 +1,89 @@
+/* output.h - capture of command output */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Commands write their standard output and error into pipes, read without
+ * blocking from the event loop. Each stream goes through a ring buffer as
+ * large as the longest line logged in one piece, and complete lines are
+ * reported through the logging callback.
+ *
+ * A capture only holds its own copy of the entry path, since a command may
+ * leave processes writing into the pipe after the entry is gone.
+ */
+
+#ifndef FILEWATCHER_OUTPUT_H
+#define FILEWATCHER_OUTPUT_H
+
+#include <sys/types.h>
+
+#include "evqueue.h"
+#include "watchtab.h"
+
+/* size of the ring buffer of a stream, longer lines are split */
+#define OUTPUT_RING 4096
+
+/* maximum number of bytes read from a stream per event */
+#define OUTPUT_BATCH 65536
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct output - captured output stream of a command */
+struct output {
+	int		fd;		/* reading end of the pipe */
+	int		is_stderr;	/* whether this is the error stream */
+	pid_t		pid;		/* command writing into the pipe */
+	size_t		budget;		/* bytes that can still be logged */
+	size_t		dropped;	/* bytes discarded over the budget */
+	size_t		start;		/* offset of the first byte in ring */
+	size_t		len;		/* number of bytes in ring */
+	size_t		scanned;	/* leading bytes known to be no newline */
+	char		ring[OUTPUT_RING];
+	char		path[];		/* path of the entry */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* output_open - create the pipes of a command about to be started */
+/*   stdio receives the writing ends, to become the standard output and
+ *   error of the command. Return -1 when the output is not captured. */
+int
+output_open(struct watch_entry *wentry, struct output *out[2], int stdio[2]);
+
+/* output_start - watch the pipes of a command once started */
+/*   The writing ends are closed, and with a null pid the captures are
+ *   released. */
+void
+output_start(struct evqueue *evq, struct output *out[2], int stdio[2],
+    pid_t pid);
+
+/* output_event - read and log what a stream has available */
+/*   The capture is released at end of file. */
+void
+output_event(struct evqueue *evq, struct output *out);
+
+/* output_error - drop a stream whose registration has failed */
+void
+output_error(struct evqueue *evq, struct output *out);
+
+#endif /* ndef FILEWATCHER_OUTPUT_H */
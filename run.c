@@ -16,77 +16,662 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* POSIX_SPAWN_SETSID is a GNU extension for glibc */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
 #include "log.h"
 #include "run.h"
 
-/* run_entry - start the command associated with the given entry */
-pid_t
-run_entry(struct watch_entry *wentry) {
+/* largest spawn request sent to the helper, larger ones are run locally */
+#define HELPER_MSG_MAX 65536
+
+/* received descriptors are made close-on-exec by recvmsg() when possible */
+#ifdef MSG_CMSG_CLOEXEC
+#define HELPER_RECV_FLAGS MSG_CMSG_CLOEXEC
+#else
+#define HELPER_RECV_FLAGS 0
+#endif
+
+/* spawn_attr - attributes shared by all commands started by posix_spawn */
+static posix_spawnattr_t spawn_attr;
+
+/* launcher - RUN_* launcher of commands without chroot nor credentials */
+static int launcher = RUN_VFORK;
+
+/* launched - launcher of the last command, as run_launched() returns */
+static int launched = RUN_VFORK;
+
+/* enum child_step - what failed in the child of the fallback path */
+enum child_step {
+	STEP_NONE,
+	STEP_SETSID,
+	STEP_CHROOT,
+	STEP_CHDIR,
+	STEP_STDIO,
+	STEP_SETGROUPS,
+	STEP_SETGID,
+	STEP_SETUID,
+	STEP_TRACE,
+	STEP_EXEC
+};
+
+/* child_error - failure report from a vforked child to its parent */
+/*   The parent is suspended until the child execs or exits, so this is
+ *   written by the child before the parent reads it. */
+static volatile struct {
+	enum child_step	step;
+	int		error;
+} child_error;
+
+/* enum helper_type - kind of request sent to the spawn helper */
+enum helper_type {
+	HELPER_SPAWN,			/* start a command, reply with a struct
+					 * helper_reply */
+	HELPER_REAP			/* wait for an exited command, reply with
+					 * its wait status */
+};
+
+/* struct helper_request - fixed part of a request to the spawn helper */
+/*   A spawn request is followed by the chroot path if any, the command,
+ *   and nenv environment strings, all NUL-terminated. The descriptors of
+ *   standard output and error, then the exec pipe, are passed along as
+ *   SCM_RIGHTS. */
+struct helper_request {
+	enum helper_type type;		/* what is requested */
+	pid_t		pid;		/* process to reap */
+	uid_t		uid;		/* uid to set before command */
+	gid_t		gid;		/* gid to set before command */
+	int		owned;		/* whether gid is the only group */
+	int		has_chroot;	/* whether a chroot path follows */
+	int		has_stdio;	/* whether output descriptors are attached */
+	int		has_exec_fd;	/* whether an exec pipe is attached */
+	size_t		nenv;		/* number of environment strings */
+};
+
+/* struct helper_reply - answer of the spawn helper to a spawn request */
+struct helper_reply {
+	pid_t		pid;		/* command started, 0 on failure */
+	int		launched;	/* RUN_* launcher that started it */
+};
+
+/* helper_cmsg - control message buffer holding up to three descriptors */
+union helper_cmsg {
+	struct cmsghdr	hdr;
+	char		buf[CMSG_SPACE(3 * sizeof(int))];
+};
+
+/* helper_fd - socket to the spawn helper, or -1 when spawning locally */
+static int helper_fd = -1;
+
+/* helper_buf - message buffer, on both ends of the helper socket */
+static char helper_buf[HELPER_MSG_MAX];
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* build_argv - fill the argument list of a command */
+static void
+build_argv(char *argv[4], struct watch_entry *wentry, char **envp) {
+	size_t i;
+
+	/* Lookup SHELL environment variable */
+	argv[0] = 0;
+	for (i = 0; envp[i]; i++) {
+		if (strncmp(envp[i], "SHELL=", 6) == 0) {
+			argv[0] = envp[i] + 6;
+			break;
+		}
+	}
+
+	if (!argv[0]) argv[0] = "/bin/sh";
+	argv[1] = "-c";
+	argv[2] = (char *)wentry->command;
+	argv[3] = 0;
+}
+
+
+/* child_fail - record a failure in the vforked child and terminate it */
+static void
+child_fail(enum child_step step) {
+	child_error.error = errno;
+	child_error.step = step;
+	_exit(EXIT_FAILURE);
+}
+
+
+/* spawn_forked - start a command through vfork() */
+static pid_t
+spawn_forked(struct watch_entry *wentry, char **envp, const int *stdio,
+    int exec_fd) {
+	struct timespec exec_time;
 	char *argv[4];
-	size_t i = 0;
+	sigset_t set;
 	pid_t result;
-	int has_delay = (wentry->delay.tv_sec || wentry->delay.tv_nsec);
+
+	/* Prepare everything that may allocate or log in the parent */
+	build_argv(argv, wentry, envp);
+	sigemptyset(&set);
+	child_error.step = STEP_NONE;
+	launched = RUN_VFORK;
 
 	/* Create a child process and hand control back to parent */
-	result = has_delay ? fork() : vfork();
+	result = vfork();
 	if (result == -1) {
 		log_fork();
 		return 0;
-	} else if (result != 0) {
-	 	return result;
 	}
 
-	/* chroot if requested */
-	if (wentry->chroot) {
-		if (chroot(wentry->chroot) < 0) {
-			log_chroot(wentry->chroot);
-			_exit(EXIT_FAILURE);
+	if (result == 0) {
+		/* Only system calls below this point */
+		sigprocmask(SIG_SETMASK, &set, 0);
+		signal(SIGCHLD, SIG_DFL);
+		if (setsid() < 0)
+			child_fail(STEP_SETSID);
+
+		/* Redirect output before losing the rights to the pipes */
+		if (stdio && (dup2(stdio[0], STDOUT_FILENO) < 0
+		    || dup2(stdio[1], STDERR_FILENO) < 0))
+			child_fail(STEP_STDIO);
+
+		/* chroot if requested */
+		if (wentry->chroot) {
+			if (chroot(wentry->chroot) < 0)
+				child_fail(STEP_CHROOT);
+			if (chdir("/") < 0)
+				child_fail(STEP_CHDIR);
 		}
-		if (chdir("/") < 0) {
-			log_chdir(wentry->chroot);
-			_exit(EXIT_FAILURE);
+
+		/* Entries run as the watchtab owner keep none of the
+		 * daemon groups */
+		if (wentry->owned && wentry->uid != geteuid()
+		    && setgroups(1, &wentry->gid) < 0)
+			child_fail(STEP_SETGROUPS);
+
+		/* Set gid and uid if requested */
+		if (wentry->gid && setgid(wentry->gid) < 0)
+			child_fail(STEP_SETGID);
+		if (wentry->uid && setuid(wentry->uid) < 0)
+			child_fail(STEP_SETUID);
+
+		/* Report the time of exec, the pipe being closed by it */
+		if (exec_fd >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &exec_time);
+			if (write(exec_fd, &exec_time, sizeof exec_time) < 0)
+				child_fail(STEP_TRACE);
 		}
+
+		/* Handover control to the command */
+		execve(argv[0], argv, envp);
+		child_fail(STEP_EXEC);
 	}
 
-	/* Set gid and uid if requested */
-	if (wentry->gid && setgid(wentry->gid) < 0) {
+	/* Report failures of the child, now that it is gone or replaced */
+	if (child_error.step == STEP_NONE)
+		return result;
+
+	errno = child_error.error;
+	switch (child_error.step) {
+	    case STEP_SETSID:
+		log_setsid();
+		break;
+	    case STEP_CHROOT:
+		log_chroot(wentry->chroot);
+		break;
+	    case STEP_CHDIR:
+		log_chdir(wentry->chroot);
+		break;
+	    case STEP_STDIO:
+		log_output_error(wentry->path, "dup2");
+		break;
+	    case STEP_SETGROUPS:
+		log_setgroups(wentry->gid);
+		break;
+	    case STEP_SETGID:
 		log_setgid(wentry->gid);
-		_exit(EXIT_FAILURE);
-	}
-	if (wentry->uid && setuid(wentry->uid) < 0) {
+		break;
+	    case STEP_SETUID:
 		log_setuid(wentry->uid);
-		_exit(EXIT_FAILURE);
+		break;
+	    case STEP_TRACE:
+		log_trace("write");
+		break;
+	    default:
+		log_exec(wentry);
+		break;
 	}
+	return result;
+}
 
-	/* Wait for some time if requested */
-	if (has_delay)
-		nanosleep(&wentry->delay, 0);
 
-	/* Lookup SHELL environment variable */
-	argv[0] = 0;
-	for (i = 0; wentry->envp[i]; i++) {
-		if (strncmp(wentry->envp[i], "SHELL=", 6) == 0) {
-			argv[0] = wentry->envp[i] + 6;
-			break;
+/* spawn_local - start a command from the current process */
+static pid_t
+spawn_local(struct watch_entry *wentry, char **envp, const int *stdio,
+    int exec_fd) {
+	posix_spawn_file_actions_t actions;
+	char *argv[4];
+	pid_t result;
+	int error = 0;
+
+	/* chroot and credentials are out of posix_spawn reach, while the
+	 * exec pipe is left unwritten, closed by the exec */
+	if (launcher == RUN_VFORK || wentry->chroot || wentry->uid
+	    || wentry->gid)
+		return spawn_forked(wentry, envp, stdio, exec_fd);
+	launched = RUN_SPAWN;
+
+	if (stdio) {
+		error = posix_spawn_file_actions_init(&actions);
+		if (!error)
+			error = posix_spawn_file_actions_adddup2(&actions,
+			    stdio[0], STDOUT_FILENO);
+		if (!error)
+			error = posix_spawn_file_actions_adddup2(&actions,
+			    stdio[1], STDERR_FILENO);
+		if (error) {
+			errno = error;
+			log_output_error(wentry->path,
+			    "posix_spawn_file_actions");
+			posix_spawn_file_actions_destroy(&actions);
+			stdio = 0;
 		}
 	}
 
-	/* Build argument list */
-	if (!argv[0]) argv[0] = "/bin/sh";
-	argv[1] = "-c";
-	argv[2] = (char *)wentry->command;
-	argv[3] = 0;
+	build_argv(argv, wentry, envp);
+	error = posix_spawn(&result, argv[0], stdio ? &actions : 0,
+	    &spawn_attr, argv, envp);
+	if (stdio)
+		posix_spawn_file_actions_destroy(&actions);
+	if (error) {
+		errno = error;
+		log_exec(wentry);
+		return 0;
+	}
 
-	/* Handover control to the command */
-	execve(argv[0], argv, wentry->envp);
+	return result;
+}
 
-	/* Report error */
-	log_exec(wentry);
-	_exit(EXIT_FAILURE);
+
+/* append_str - copy a NUL-terminated string into the helper buffer */
+/*   Return the new offset, or 0 when the buffer is too small. */
+static size_t
+append_str(size_t offset, const char *str) {
+	size_t len = strlen(str) + 1;
+
+	if (offset == 0 || len > HELPER_MSG_MAX - offset)
+		return 0;
+	memcpy(helper_buf + offset, str, len);
+	return offset + len;
+}
+
+
+/* helper_spawn - have the spawn helper start a command */
+/*   Return the pid, 0 when the command failed, or -1 on helper failure. */
+static pid_t
+helper_spawn(struct watch_entry *wentry, char **envp, const int *stdio,
+    int exec_fd) {
+	struct helper_request req;
+	union helper_cmsg cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t size = sizeof req, i;
+	struct helper_reply reply;
+	int fds[3], nfds = 0;
+	ssize_t ret;
+
+	/* Build the request */
+	req.type = HELPER_SPAWN;
+	req.pid = 0;
+	req.uid = wentry->uid;
+	req.gid = wentry->gid;
+	req.owned = wentry->owned;
+	req.has_chroot = (wentry->chroot != 0);
+	req.has_stdio = (stdio != 0);
+	req.has_exec_fd = (exec_fd >= 0);
+	req.nenv = 0;
+	if (wentry->chroot)
+		size = append_str(size, wentry->chroot);
+	size = append_str(size, wentry->command);
+	for (i = 0; envp[i]; i++, req.nenv++)
+		size = append_str(size, envp[i]);
+
+	/* Entries too large for a single message are run locally */
+	if (size == 0)
+		return spawn_local(wentry, envp, stdio, exec_fd);
+	memcpy(helper_buf, &req, sizeof req);
+
+	/* Send it with the descriptors, and wait for the pid */
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = helper_buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (stdio) {
+		fds[nfds++] = stdio[0];
+		fds[nfds++] = stdio[1];
+	}
+	if (exec_fd >= 0)
+		fds[nfds++] = exec_fd;
+	if (nfds) {
+		memset(&cmsg, 0, sizeof cmsg);
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), fds, nfds * sizeof(int));
+	}
+	ret = sendmsg(helper_fd, &msg, MSG_NOSIGNAL);
+	if (ret < 0 || (size_t)ret != size) {
+		log_helper("send");
+		return -1;
+	}
+	do {
+		ret = recv(helper_fd, &reply, sizeof reply, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof reply) {
+		log_helper("recv");
+		return -1;
+	}
+
+	launched = reply.launched | RUN_HELPED;
+	return reply.pid;
+}
+
+
+/* helper_main - serve spawn requests until the daemon goes away */
+static void
+helper_main(int sock) {
+	struct watch_entry wentry;
+	struct helper_request req;
+	struct helper_reply reply;
+	union helper_cmsg cmsg;
+	struct cmsghdr *hdr;
+	struct msghdr msg;
+	struct iovec iov;
+	char **strs = 0;
+	size_t str_cap = 0, nstr, offset, i;
+	ssize_t n;
+	int fds[3], nfds, status;
+
+	/* Commands stay zombies until the daemon has noticed their exit */
+	signal(SIGCHLD, SIG_DFL);
+
+	while (1) {
+		memset(&msg, 0, sizeof msg);
+		iov.iov_base = helper_buf;
+		iov.iov_len = sizeof helper_buf;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof cmsg.buf;
+		n = recvmsg(sock, &msg, HELPER_RECV_FLAGS);
+		if (n == 0)
+			_exit(EXIT_SUCCESS);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			log_helper("recv");
+			_exit(EXIT_FAILURE);
+		}
+
+		/* Take the descriptors, whatever the request turns out to be */
+		nfds = 0;
+		hdr = CMSG_FIRSTHDR(&msg);
+		if (hdr && hdr->cmsg_level == SOL_SOCKET
+		    && hdr->cmsg_type == SCM_RIGHTS
+		    && hdr->cmsg_len >= CMSG_LEN(sizeof(int))
+		    && hdr->cmsg_len <= CMSG_LEN(sizeof fds)) {
+			nfds = (int)((hdr->cmsg_len - CMSG_LEN(0))
+			    / sizeof(int));
+			memcpy(fds, CMSG_DATA(hdr), nfds * sizeof(int));
+		}
+
+		/* Commands only get them through dup2(), never leaked */
+		if (HELPER_RECV_FLAGS == 0)
+			for (i = 0; i < (size_t)nfds; i++)
+				fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+
+		if ((size_t)n < sizeof req || helper_buf[n - 1] != 0) {
+			while (nfds > 0)
+				close(fds[--nfds]);
+			continue;
+		}
+		memcpy(&req, helper_buf, sizeof req);
+
+		/* Hand the wait status to the daemon, which is not the
+		 * parent of the command */
+		if (req.type == HELPER_REAP) {
+			if (waitpid(req.pid, &status, WNOHANG) != req.pid)
+				status = -1;
+			if (send(sock, &status, sizeof status, MSG_NOSIGNAL) < 0)
+				_exit(EXIT_FAILURE);
+			continue;
+		}
+
+		/* Split strings, all bounded by the final NUL of the message */
+		nstr = req.nenv + (req.has_chroot ? 2 : 1);
+		if (nstr >= str_cap) {
+			char **new_strs;
+
+			new_strs = realloc(strs, (nstr + 1) * sizeof *strs);
+			if (!new_strs) {
+				log_alloc("spawn helper request");
+				_exit(EXIT_FAILURE);
+			}
+			strs = new_strs;
+			str_cap = nstr + 1;
+		}
+		offset = sizeof req;
+		for (i = 0; i < nstr && offset < (size_t)n; i++) {
+			strs[i] = helper_buf + offset;
+			offset += strlen(strs[i]) + 1;
+		}
+		strs[i] = 0;
+
+		/* Rebuild an entry from the request */
+		wentry_init(&wentry);
+		wentry.uid = req.uid;
+		wentry.gid = req.gid;
+		wentry.owned = req.owned;
+		if (req.has_chroot)
+			wentry.chroot = strs[0];
+		wentry.command = strs[req.has_chroot ? 1 : 0];
+
+		reply.pid = (i == nstr && nfds == (req.has_stdio ? 2 : 0)
+		    + (req.has_exec_fd ? 1 : 0))
+		    ? spawn_local(&wentry, strs + (req.has_chroot ? 2 : 1),
+		      req.has_stdio ? fds : 0,
+		      req.has_exec_fd ? fds[nfds - 1] : -1) : 0;
+		reply.launched = launched;
+		while (nfds > 0)
+			close(fds[--nfds]);
+		if (send(sock, &reply, sizeof reply, MSG_NOSIGNAL) < 0)
+			_exit(EXIT_FAILURE);
+	}
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* run_init - select the launcher and prepare its attributes */
+int
+run_init(int new_launcher) {
+	sigset_t set;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	int error;
+
+	launcher = new_launcher;
+	if (launcher != RUN_SPAWN)
+		return 0;
+
+	/* Commands must not share the session of the daemon */
+#ifdef POSIX_SPAWN_SETSID
+	flags |= POSIX_SPAWN_SETSID;
+#else
+	log_spawn_session();
+	return -1;
+#endif
+
+	error = posix_spawnattr_init(&spawn_attr);
+	if (!error)
+		error = posix_spawnattr_setflags(&spawn_attr, flags);
+
+	/* Commands start with an empty mask and SIGCHLD not ignored */
+	sigemptyset(&set);
+	if (!error)
+		error = posix_spawnattr_setsigmask(&spawn_attr, &set);
+	sigaddset(&set, SIGCHLD);
+	if (!error)
+		error = posix_spawnattr_setsigdefault(&spawn_attr, &set);
+
+	if (error) {
+		errno = error;
+		log_spawnattr();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* run_entry - start the command associated with the given entry */
+pid_t
+run_entry(struct watch_entry *wentry, const int *stdio, int exec_fd) {
+	pid_t result;
+	char **envp;
+
+	/* Shared strings, user variables and TRIGGER of this run */
+	envp = wentry_envp(wentry);
+	if (!envp)
+		return 0;
+
+	if (helper_fd < 0)
+		result = spawn_local(wentry, envp, stdio, exec_fd);
+	else if ((result = helper_spawn(wentry, envp, stdio, exec_fd)) < 0) {
+		/* Give up on a broken helper */
+		close(helper_fd);
+		helper_fd = -1;
+		result = spawn_local(wentry, envp, stdio, exec_fd);
+	}
+
+	return result;
+}
+
+
+/* run_launched - launcher that has actually started the last command */
+int
+run_launched(void) {
+	return launched;
+}
+
+
+/* run_helper_start - fork the spawn helper used by later run_entry() */
+int
+run_helper_start(int daemonize) {
+	int sv[2], null_fd;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_helper("socketpair");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		log_fork();
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	/* Detach like daemon(), but without forking again, so that the
+	 * process forked here is the helper */
+	if (pid == 0) {
+		close(sv[0]);
+		if (daemonize) {
+			setsid();
+			if (chdir("/") < 0)
+				log_helper("chdir");
+			null_fd = open("/dev/null", O_RDWR);
+			if (null_fd >= 0) {
+				dup2(null_fd, STDIN_FILENO);
+				dup2(null_fd, STDOUT_FILENO);
+				dup2(null_fd, STDERR_FILENO);
+				if (null_fd > STDERR_FILENO)
+					close(null_fd);
+			}
+			set_report(&syslog);
+		}
+		helper_main(sv[1]);
+	}
+
+	close(sv[1]);
+	helper_fd = sv[0];
+	return 0;
+}
+
+
+/* run_reap - release the process of a command whose exit was noticed */
+int
+run_reap(pid_t pid, int status) {
+	struct helper_request req;
+	ssize_t ret;
+
+	if (helper_fd < 0) return status;
+
+	memset(&req, 0, sizeof req);
+	req.type = HELPER_REAP;
+	req.pid = pid;
+	memcpy(helper_buf, &req, sizeof req);
+	helper_buf[sizeof req] = 0;
+	if (send(helper_fd, helper_buf, sizeof req + 1, MSG_NOSIGNAL) < 0) {
+		log_helper("send");
+		close(helper_fd);
+		helper_fd = -1;
+		return status;
+	}
+
+	do {
+		ret = recv(helper_fd, &status, sizeof status, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof status) {
+		log_helper("recv");
+		close(helper_fd);
+		helper_fd = -1;
+		return -1;
+	}
+	return status;
+}
+
+
+/* run_entry_forked - start a command through vfork() */
+pid_t
+run_entry_forked(struct watch_entry *wentry, const int *stdio, int exec_fd) {
+	char **envp;
+
+	envp = wentry_envp(wentry);
+	if (!envp)
+		return 0;
+	return spawn_forked(wentry, envp, stdio, exec_fd);
 }
@@ -23,8 +23,47 @@
 
 #include "watchtab.h"
 
+/* command launchers */
+#define RUN_VFORK	0		/* vfork() and execve(), the default */
+#define RUN_SPAWN	1		/* posix_spawn(), vfork() for credentials */
+
+/* flag of run_launched() for commands started by the spawn helper */
+#define RUN_HELPED	4
+
+/* run_init - select the launcher and prepare its attributes */
+/*   Fail when posix_spawn() cannot start commands in a new session. */
+int
+run_init(int launcher);
+
 /* run_entry - start the command associated with the given entry */
+/*   stdio holds the descriptors of its standard output and error, or is
+ *   null to inherit them. When exec_fd is not -1, a child started through
+ *   vfork() writes there the CLOCK_MONOTONIC struct timespec of its
+ *   execve() call, while posix_spawn() leaves it empty. Return the pid of
+ *   the command, or 0 on failure. */
+pid_t
+run_entry(struct watch_entry *wentry, const int *stdio, int exec_fd);
+
+/* run_launched - launcher that has actually started the last command */
+/*   RUN_VFORK or RUN_SPAWN, with RUN_HELPED when the spawn helper did. */
+int
+run_launched(void);
+
+/* run_helper_start - fork the spawn helper used by later run_entry() */
+/*   To be called early, while the address space is still small. */
+int
+run_helper_start(int daemonize);
+
+/* run_reap - release the process of a command whose exit was noticed */
+/*   Return its wait status: status as reported by the event queue when
+ *   the daemon started it, or as reported by the spawn helper, which is
+ *   the parent of the commands it started, -1 when unknown. */
+int
+run_reap(pid_t pid, int status);
+
+/* run_entry_forked - start a command through vfork() */
+/*   Whatever the launcher, supporting chroot and credentials. */
 pid_t
-run_entry(struct watch_entry *wentry);
+run_entry_forked(struct watch_entry *wentry, const int *stdio, int exec_fd);
 
 #endif /* ndef FILEWATCHER_RUN_H */
@@ -0,0 +1,199 @@
+/* sched.c - global command scheduler */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "log.h"
+#include "sched.h"
+#include "timer.h"
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* account_wait - add the time an entry has spent at the queue head */
+static void
+account_wait(struct sched *sched, struct watch_entry *wentry) {
+	struct timespec now, wait;
+	uint64_t ns;
+
+	timer_now(&now);
+	timer_until(&wait, &now, &wentry->ready_since);
+	ns = (uint64_t)wait.tv_sec * 1000000000 + wait.tv_nsec;
+	sched->stats.wait_total_ns += ns;
+	if (ns > sched->stats.wait_max_ns)
+		sched->stats.wait_max_ns = ns;
+	wentry->ready_since = now;
+}
+
+
+/* find_user - running commands of a user, or null when it has none */
+static struct sched_user *
+find_user(struct sched *sched, uid_t uid) {
+	size_t i;
+
+	for (i = 0; i < sched->nusers; i++)
+		if (sched->users[i].uid == uid)
+			return &sched->users[i];
+	return 0;
+}
+
+
+/* user_has_room - whether a command of the entry can start now */
+static int
+user_has_room(struct sched *sched, const struct watch_entry *wentry) {
+	const struct sched_user *user;
+
+	if (!sched->max_user)
+		return 1;
+	user = find_user(sched, wentry->uid);
+	return !user || user->running < sched->max_user;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* sched_init - initialize an empty scheduler */
+void
+sched_init(struct sched *sched, unsigned max_running, unsigned max_user) {
+	size_t i;
+
+	sched->max_running = max_running;
+	sched->max_user = max_user;
+	sched->users = 0;
+	sched->nusers = 0;
+	sched->users_cap = 0;
+	for (i = 0; i < WPRIO_COUNT; i++)
+		TAILQ_INIT(&sched->ready[i]);
+	sched->stats.running = 0;
+	sched->stats.depth = 0;
+	sched->stats.max_depth = 0;
+	sched->stats.started = 0;
+	sched->stats.wait_total_ns = 0;
+	sched->stats.wait_max_ns = 0;
+}
+
+
+/* sched_submit - add a ready run of the given entry */
+void
+sched_submit(struct sched *sched, struct watch_entry *wentry) {
+	if (wentry->ready++ == 0) {
+		timer_now(&wentry->ready_since);
+		TAILQ_INSERT_TAIL(&sched->ready[wentry->priority],
+		    wentry, ready_link);
+	}
+
+	if (++sched->stats.depth > sched->stats.max_depth)
+		sched->stats.max_depth = sched->stats.depth;
+}
+
+
+/* sched_cancel - drop all ready runs of the given entry */
+void
+sched_cancel(struct sched *sched, struct watch_entry *wentry) {
+	if (!wentry->ready) return;
+
+	TAILQ_REMOVE(&sched->ready[wentry->priority], wentry, ready_link);
+	sched->stats.depth -= wentry->ready;
+	wentry->ready = 0;
+}
+
+
+/* sched_next - entry whose run should be started now, or 0 */
+struct watch_entry *
+sched_next(struct sched *sched) {
+	struct watch_entry *wentry = 0;
+	size_t i;
+
+	if (sched->max_running && sched->stats.running >= sched->max_running)
+		return 0;
+
+	/* Entries of users at their limit wait in place */
+	for (i = 0; i < WPRIO_COUNT && !wentry; i++) {
+		TAILQ_FOREACH(wentry, &sched->ready[i], ready_link)
+			if (user_has_room(sched, wentry))
+				break;
+	}
+	if (!wentry)
+		return 0;
+
+	/* Take one run, and rotate the entry if it has more */
+	account_wait(sched, wentry);
+	TAILQ_REMOVE(&sched->ready[wentry->priority], wentry, ready_link);
+	if (--wentry->ready > 0)
+		TAILQ_INSERT_TAIL(&sched->ready[wentry->priority],
+		    wentry, ready_link);
+	sched->stats.depth--;
+
+	return wentry;
+}
+
+
+/* sched_started - account for a command started, or not when pid is 0 */
+void
+sched_started(struct sched *sched, const struct watch_entry *wentry,
+    pid_t pid) {
+	struct sched_user *user, *new_users;
+	size_t new_cap;
+
+	if (!pid) return;
+	sched->stats.running++;
+	sched->stats.started++;
+	if (!sched->max_user) return;
+
+	user = find_user(sched, wentry->uid);
+	if (!user) {
+		if (sched->nusers >= sched->users_cap) {
+			new_cap = sched->users_cap ? sched->users_cap * 2 : 16;
+			new_users = realloc(sched->users,
+			    new_cap * sizeof *new_users);
+			if (!new_users) {
+				log_alloc("scheduler users");
+				return;
+			}
+			sched->users = new_users;
+			sched->users_cap = new_cap;
+		}
+		user = &sched->users[sched->nusers++];
+		user->uid = wentry->uid;
+		user->running = 0;
+	}
+	user->running++;
+}
+
+
+/* sched_exited - account for the end of a command started earlier */
+void
+sched_exited(struct sched *sched, const struct watch_entry *wentry) {
+	struct sched_user *user;
+
+	if (!sched->stats.running) {
+		LOG_ASSERT("sched->stats.running");
+		return;
+	}
+	sched->stats.running--;
+
+	/* Users without running commands are forgotten, a command whose
+	 * user could not be recorded being left uncounted */
+	user = sched->max_user ? find_user(sched, wentry->uid) : 0;
+	if (user && --user->running == 0)
+		*user = sched->users[--sched->nusers];
+}
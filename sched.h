@@ -0,0 +1,108 @@
+/* sched.h - global command scheduler */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Triggered entries do not start their command directly, they submit a
+ * ready run to the scheduler, which starts them as long as the number of
+ * running commands is below the daemon-wide limit.
+ *
+ * Each priority class has a round-robin queue of entries with at least
+ * one ready run, each entry appearing once whatever its number of ready
+ * runs. An entry is rotated to the tail after each start, so a hot entry
+ * cannot starve the others of its class. Classes are served in strict
+ * priority order.
+ *
+ * A limit of running commands can also be set for each user commands run
+ * as. Entries of a user at its limit are passed over, keeping their place
+ * in the queue, so that a user with many pending runs cannot hold back
+ * those of the others.
+ */
+
+#ifndef FILEWATCHER_SCHED_H
+#define FILEWATCHER_SCHED_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "watchtab.h"
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct sched_stats - counters of the scheduler */
+struct sched_stats {
+	unsigned	running;	/* commands started and not yet exited */
+	size_t		depth;		/* number of ready runs */
+	size_t		max_depth;	/* highest number of ready runs */
+	uint64_t	started;	/* number of runs started */
+	uint64_t	wait_total_ns;	/* total time spent ready */
+	uint64_t	wait_max_ns;	/* longest time spent ready */
+};
+
+/* struct sched_user - running commands of a user */
+struct sched_user {
+	uid_t		uid;		/* user commands run as */
+	unsigned	running;	/* commands started and not yet exited */
+};
+
+/* struct sched - global scheduler state */
+struct sched {
+	unsigned	max_running;	/* limit of running commands, 0 for none */
+	unsigned	max_user;	/* limit for each user, 0 for none */
+	struct sched_user *users;	/* users with running commands */
+	size_t		nusers;		/* number of users above */
+	size_t		users_cap;	/* number of users allocated */
+	TAILQ_HEAD(, watch_entry) ready[WPRIO_COUNT];
+	struct sched_stats stats;	/* exported counters */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* sched_init - initialize an empty scheduler */
+void
+sched_init(struct sched *sched, unsigned max_running, unsigned max_user);
+
+/* sched_submit - add a ready run of the given entry */
+void
+sched_submit(struct sched *sched, struct watch_entry *wentry);
+
+/* sched_cancel - drop all ready runs of the given entry */
+void
+sched_cancel(struct sched *sched, struct watch_entry *wentry);
+
+/* sched_next - entry whose run should be started now, or 0 */
+/*   The caller must report the outcome with sched_started(). */
+struct watch_entry *
+sched_next(struct sched *sched);
+
+/* sched_started - account for a command started, or not when pid is 0 */
+void
+sched_started(struct sched *sched, const struct watch_entry *wentry,
+    pid_t pid);
+
+/* sched_exited - account for the end of a command started earlier */
+void
+sched_exited(struct sched *sched, const struct watch_entry *wentry);
+
+#endif /* ndef FILEWATCHER_SCHED_H */
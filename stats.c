@@ -0,0 +1,631 @@
+/* stats.c - counters shared with monitoring through a mapped file */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "run.h"
+#include "stats.h"
+#include "timer.h"
+
+/* initial number of started commands remembered, must be a power of 2 */
+#define STATS_STARTS 64
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct start - start time of a running command */
+struct start {
+	pid_t		pid;		/* command, or 0 for an empty cell */
+	uint64_t	ns;		/* monotonic time of the start */
+};
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* stats_path - path of the file, or null when statistics are off */
+static char *stats_path = 0;
+
+/* header - mapped file */
+static struct stats_header *header = 0;
+
+/* slots - entry slots, right after the header */
+static struct stats_slot *slots = 0;
+
+/* owners - entry of each slot, null when free */
+static struct watch_entry **owners = 0;
+
+/* free_slots - stack of free slot indices, lowest on top at first */
+static size_t *free_slots = 0;
+
+/* nfree - number of indices in free_slots */
+static size_t nfree = 0;
+
+/* starts - open-addressing table of running commands */
+static struct start *starts = 0;
+
+/* nstarts - number of cells in starts, a power of 2 */
+static size_t nstarts = 0;
+
+/* nrunning - number of used cells in starts */
+static size_t nrunning = 0;
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* now_ns - monotonic time in nanoseconds */
+static uint64_t
+now_ns(void) {
+	struct timespec now;
+
+	timer_now(&now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/* write_begin - make counters odd before changing them */
+static void
+write_begin(struct stats_counters *c) {
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/* write_end - make counters even again once changed */
+static void
+write_end(struct stats_counters *c) {
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* bucket - histogram bucket of a duration in nanoseconds */
+static unsigned
+bucket(uint64_t ns) {
+	uint64_t us = ns / 1000;
+	unsigned e = 0, i;
+
+	if (us < 4)
+		return (unsigned)us;
+	while (us >> (e + 1))
+		e++;
+	i = 4 * (e - 1) + (unsigned)((us >> (e - 2)) & 3);
+	return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+
+/* count_exit - account for a wait status in a set of counters */
+static void
+count_exit(struct stats_counters *c, int status, uint64_t duration,
+    uint64_t now) {
+	int n;
+
+	if (status < 0)
+		c->exits_unknown++;
+	else if (WIFSIGNALED(status)) {
+		n = WTERMSIG(status);
+		c->signals[n < STATS_SIGNALS ? n : STATS_SIGNALS - 1]++;
+	}
+	else {
+		n = WEXITSTATUS(status);
+		c->exits[n < STATS_EXIT_CODES ? n : STATS_EXIT_CODES - 1]++;
+	}
+	if (c->running > 0)
+		c->running--;
+	if (duration)
+		c->duration[bucket(duration)]++;
+	c->last_exit_ns = now;
+}
+
+
+/* count_launch - count the launcher of a command */
+static void
+count_launch(struct stats_counters *c, int launched) {
+	c->launches[(launched & RUN_SPAWN) ? RUN_SPAWN : RUN_VFORK]++;
+	if (launched & RUN_HELPED)
+		c->helped++;
+}
+
+
+/* count_stages - account for the stage times of a run */
+static void
+count_stages(struct stats_counters *c, const uint64_t spent[TRACE_STAGES]) {
+	unsigned i;
+
+	for (i = 0; i < TRACE_STAGES; i++) {
+		if (!spent[i])
+			continue;
+		c->stage_count[i]++;
+		c->stage_total_ns[i] += spent[i];
+		if (spent[i] > c->stage_max_ns[i])
+			c->stage_max_ns[i] = spent[i];
+	}
+}
+
+
+/* start_cell - cell of a running command, or the empty one to fill */
+static struct start *
+start_cell(pid_t pid) {
+	size_t i = (size_t)pid * 2654435761U & (nstarts - 1);
+
+	while (starts[i].pid && starts[i].pid != pid)
+		i = (i + 1) & (nstarts - 1);
+	return starts + i;
+}
+
+
+/* add_start - remember the start time of a command */
+static void
+add_start(pid_t pid, uint64_t ns) {
+	struct start *cell;
+
+	/* Keep the table at most half full */
+	if (nrunning + 1 > nstarts / 2) {
+		struct start *old = starts;
+		size_t old_size = nstarts, i;
+
+		starts = calloc(old_size ? old_size * 2 : STATS_STARTS,
+		    sizeof *starts);
+		if (!starts) {
+			log_alloc("command start times");
+			starts = old;
+			return;
+		}
+		nstarts = old_size ? old_size * 2 : STATS_STARTS;
+		for (i = 0; i < old_size; i++)
+			if (old[i].pid)
+				*start_cell(old[i].pid) = old[i];
+		free(old);
+	}
+
+	cell = start_cell(pid);
+	cell->pid = pid;
+	cell->ns = ns;
+	nrunning++;
+}
+
+
+/* take_start - forget a command, returning its start time or 0 */
+static uint64_t
+take_start(pid_t pid) {
+	struct start *cell, *next;
+	uint64_t result;
+	size_t i, j, k;
+
+	if (!nstarts)
+		return 0;
+	cell = start_cell(pid);
+	if (!cell->pid)
+		return 0;
+	result = cell->ns;
+	nrunning--;
+
+	/* Shift back the cells that probed past the removed one */
+	i = (size_t)(cell - starts);
+	j = i;
+	while (1) {
+		j = (j + 1) & (nstarts - 1);
+		next = starts + j;
+		if (!next->pid)
+			break;
+		k = (size_t)next->pid * 2654435761U & (nstarts - 1);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		starts[i] = *next;
+		i = j;
+	}
+	starts[i].pid = 0;
+	return result;
+}
+
+
+/* new_file - write a new file at the path with the given slots */
+/*   Slots in use are copied from the current file, which is marked as
+ *   replaced, and their entries are pointed to the new one. Return -1
+ *   after logging when the file cannot be made. */
+static int
+new_file(size_t n) {
+	struct stats_header *new_header;
+	size_t size = sizeof *header + n * sizeof *slots;
+	size_t len = strlen(stats_path);
+	size_t old_n = header ? header->nslots : 0, i;
+	struct watch_entry **new_owners;
+	size_t *new_free;
+	char *tmp;
+	int fd;
+
+	/* Grow the local tables first, the larger ones are still correct */
+	new_owners = realloc(owners, n * sizeof *owners);
+	if (!new_owners) {
+		log_alloc("statistics slots");
+		return -1;
+	}
+	owners = new_owners;
+	new_free = realloc(free_slots, n * sizeof *free_slots);
+	if (!new_free) {
+		log_alloc("statistics slots");
+		return -1;
+	}
+	free_slots = new_free;
+
+	tmp = malloc(len + 8);
+	if (!tmp) {
+		log_alloc("statistics path");
+		return -1;
+	}
+	memcpy(tmp, stats_path, len);
+	memcpy(tmp + len, ".XXXXXX", 8);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		log_stats(tmp, "mkstemp");
+		free(tmp);
+		return -1;
+	}
+	if (fchmod(fd, 0644) < 0) {
+		log_stats(tmp, "fchmod");
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)size) < 0) {
+		log_stats(tmp, "ftruncate");
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	new_header = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (new_header == MAP_FAILED) {
+		log_stats(tmp, "mmap");
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	/* Carry over the counters, or start afresh */
+	if (header) {
+		memcpy(new_header, header,
+		    sizeof *header + header->nslots * sizeof *slots);
+		new_header->global.seq = 0;
+		new_header->sched.seq = 0;
+	}
+	else {
+		new_header->magic = STATS_MAGIC;
+		new_header->version = STATS_VERSION;
+		new_header->header_size = sizeof *header;
+		new_header->slot_size = sizeof *slots;
+		new_header->pid = (uint64_t)getpid();
+		new_header->start_ns = now_ns();
+	}
+	new_header->nslots = (uint32_t)n;
+
+	if (rename(tmp, stats_path) < 0) {
+		log_stats(stats_path, "rename");
+		munmap(new_header, size);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	if (header) {
+		__atomic_store_n(&header->replaced, 1, __ATOMIC_RELEASE);
+		munmap(header, sizeof *header + header->nslots * sizeof *slots);
+	}
+	header = new_header;
+	slots = (struct stats_slot *)(header + 1);
+
+	for (i = 0; i < old_n; i++)
+		if (owners[i])
+			owners[i]->stats = slots + i;
+	for (i = n; i > old_n; i--) {
+		owners[i - 1] = 0;
+		free_slots[nfree++] = i - 1;
+	}
+	return 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* stats_open - create the file at the given path, with room for n slots */
+int
+stats_open(const char *path, size_t n) {
+	stats_path = strdup(path);
+	if (!stats_path) {
+		log_alloc("statistics path");
+		return -1;
+	}
+
+	if (new_file(n > 0 ? n : 1) < 0) {
+		free(stats_path);
+		stats_path = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* stats_assign - give a slot to entries of the watchtab without one */
+/*   Only the given watchtab is walked, slots being taken from a stack of
+ *   free ones, and entries of other watchtabs are only visited when the
+ *   file grows. */
+void
+stats_assign(struct watchtab *wtab) {
+	struct watch_entry *wentry;
+	size_t needed = 0, i, len;
+
+	if (!header) return;
+
+	SLIST_FOREACH(wentry, wtab, next)
+		if (!wentry->stats)
+			needed++;
+
+	/* Grow the file, moving slot pointers along */
+	if (needed > nfree) {
+		size_t n = header->nslots * 2;
+
+		if (n < header->nslots - nfree + needed)
+			n = header->nslots - nfree + needed;
+		if (new_file(n) < 0)
+			return;
+	}
+
+	SLIST_FOREACH(wentry, wtab, next) {
+		if (wentry->stats)
+			continue;
+		if (!nfree)
+			break;
+		i = free_slots[--nfree];
+		owners[i] = wentry;
+
+		/* A reused slot starts afresh, under a new sequence */
+		wentry->stats = slots + i;
+		write_begin(&wentry->stats->c);
+		memset((char *)&wentry->stats->c + sizeof wentry->stats->c.seq,
+		    0, sizeof wentry->stats->c - sizeof wentry->stats->c.seq);
+		wentry->stats->state = STATS_IDLE;
+		len = strlen(wentry->path);
+		if (len >= STATS_PATH_MAX)
+			len = STATS_PATH_MAX - 1;
+		memcpy(wentry->stats->path, wentry->path, len);
+		wentry->stats->path[len] = 0;
+		write_end(&wentry->stats->c);
+	}
+}
+
+
+/* stats_release - free the slot of an entry removed from the watchtab */
+void
+stats_release(struct watch_entry *wentry) {
+	if (!wentry->stats) return;
+
+	write_begin(&wentry->stats->c);
+	wentry->stats->path[0] = 0;
+	wentry->stats->state = STATS_IDLE;
+	write_end(&wentry->stats->c);
+	owners[wentry->stats - slots] = 0;
+	free_slots[nfree++] = (size_t)(wentry->stats - slots);
+	wentry->stats = 0;
+}
+
+
+/* stats_state - record whether an entry is watched */
+void
+stats_state(struct watch_entry *wentry, unsigned state) {
+	if (!wentry->stats) return;
+
+	write_begin(&wentry->stats->c);
+	wentry->stats->state = state;
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_event - count the events received for an entry */
+void
+stats_event(struct watch_entry *wentry, u_int events) {
+	unsigned i;
+
+	if (!header) return;
+
+	write_begin(&header->global);
+	for (i = 0; i < STATS_EVENTS; i++)
+		if (events & (1U << i))
+			header->global.events[i]++;
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	for (i = 0; i < STATS_EVENTS; i++)
+		if (events & (1U << i))
+			wentry->stats->c.events[i]++;
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_trigger - count a trigger, starting its pending time */
+void
+stats_trigger(struct watch_entry *wentry) {
+	uint64_t now;
+
+	if (!header) return;
+
+	now = now_ns();
+	if (!wentry->pending_since)
+		wentry->pending_since = now;
+
+	write_begin(&header->global);
+	header->global.triggers++;
+	header->global.last_trigger_ns = now;
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	wentry->stats->c.triggers++;
+	wentry->stats->c.last_trigger_ns = now;
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_catchup - count a change found when the entry was armed again */
+void
+stats_catchup(struct watch_entry *wentry) {
+	if (!header) return;
+
+	write_begin(&header->global);
+	header->global.catchups++;
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	wentry->stats->c.catchups++;
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_spawn - count the start of a command, or its failure if pid is 0 */
+/*   The pending time runs from the earliest trigger not yet served, and
+ *   starts again at once for runs still waiting. */
+void
+stats_spawn(struct watch_entry *wentry, pid_t pid, int launched) {
+	uint64_t now, pending = 0;
+	unsigned b = 0;
+
+	if (!header) return;
+
+	now = now_ns();
+	if (wentry->pending_since) {
+		pending = now - wentry->pending_since;
+		b = bucket(pending);
+	}
+	wentry->pending_since = (wentry->ready || wentry->queued
+	    || theap_pending(&wentry->timer)) ? now : 0;
+	if (pid)
+		add_start(pid, now);
+
+	write_begin(&header->global);
+	if (pid) {
+		header->global.spawns++;
+		header->global.running++;
+		count_launch(&header->global, launched);
+	}
+	else
+		header->global.spawn_failures++;
+	if (pending)
+		header->global.pending[b]++;
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	if (pid) {
+		wentry->stats->c.spawns++;
+		wentry->stats->c.running++;
+		count_launch(&wentry->stats->c, launched);
+	}
+	else
+		wentry->stats->c.spawn_failures++;
+	if (pending)
+		wentry->stats->c.pending[b]++;
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_exit - count the end of a command, with its wait status or -1 */
+void
+stats_exit(struct watch_entry *wentry, pid_t pid, int status) {
+	uint64_t now, start, duration = 0;
+
+	if (!header) return;
+
+	now = now_ns();
+	start = take_start(pid);
+	if (start)
+		duration = now > start ? now - start : 1;
+
+	write_begin(&header->global);
+	count_exit(&header->global, status, duration, now);
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	count_exit(&wentry->stats->c, status, duration, now);
+	write_end(&wentry->stats->c);
+}
+
+
+/* stats_sched - copy the counters of the scheduler */
+void
+stats_sched(const struct sched_stats *stats) {
+	struct stats_sched *s;
+
+	if (!header) return;
+	s = &header->sched;
+
+	/* Most loops change nothing, leave the cache line alone then */
+	if (s->running == stats->running && s->depth == stats->depth
+	    && s->max_depth == stats->max_depth && s->started == stats->started)
+		return;
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->running = stats->running;
+	s->depth = stats->depth;
+	s->max_depth = stats->max_depth;
+	s->started = stats->started;
+	s->wait_total_ns = stats->wait_total_ns;
+	s->wait_max_ns = stats->wait_max_ns;
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* stats_stages - add the stage times of a complete run, 0 when not timed */
+void
+stats_stages(struct watch_entry *wentry, const uint64_t spent[TRACE_STAGES]) {
+	if (!header) return;
+
+	write_begin(&header->global);
+	count_stages(&header->global, spent);
+	write_end(&header->global);
+
+	if (!wentry->stats) return;
+	write_begin(&wentry->stats->c);
+	count_stages(&wentry->stats->c, spent);
+	write_end(&wentry->stats->c);
+}
@@ -0,0 +1,198 @@
+/* stats.h - counters shared with monitoring through a mapped file */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The file is a struct stats_header followed by nslots struct stats_slot,
+ * all fields in host byte order, and is only ever written by the event
+ * loop of the daemon. Readers map it read-only and never talk to the
+ * daemon:
+ *   - a slot, the global counters or the scheduler counters are read by
+ *     loading their seq, copying the structure, then loading seq again;
+ *     the copy is consistent when both values are equal and even,
+ *     otherwise the reader tries again
+ *   - a slot is in use when its path is not empty, and is reset with a
+ *     new path when reused for another entry
+ *   - when more slots are needed, the daemon writes a new file and renames
+ *     it over the old one, after setting replaced in the old header, so a
+ *     reader seeing replaced reopens the path
+ *
+ * Durations are kept in log-linear histograms of microseconds: values
+ * below 4 have a bucket each, and every further power of two is split into
+ * 4 buckets, bucket i starting at STATS_BUCKET_LOW(i). The last bucket also
+ * holds anything longer.
+ *
+ * Stage counters are indexed by TRACE_* stage, from trace.h, and add up
+ * the time of complete runs from the earlier stage each one is timed from.
+ */
+
+#ifndef FILEWATCHER_STATS_H
+#define FILEWATCHER_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sched.h"
+#include "trace.h"
+#include "watchtab.h"
+
+/* first field of the header, "FWST" */
+#define STATS_MAGIC	0x46575354
+
+/* layout version, changed whenever a structure below changes */
+#define STATS_VERSION	5
+
+/* number of buckets of a duration histogram, up to about 2 hours */
+#define STATS_BUCKETS	128
+
+/* STATS_BUCKET_LOW - smallest value in microseconds of a bucket */
+#define STATS_BUCKET_LOW(i) ((i) < 4 ? (uint64_t)(i) \
+    : (uint64_t)(4 + (i) % 4) << ((i) / 4 - 1))
+
+/* number of exit codes counted separately, the last one for all above */
+#define STATS_EXIT_CODES 16
+
+/* number of signals counted separately, the last one for all above */
+#define STATS_SIGNALS	32
+
+/* number of WEV_* event types */
+#define STATS_EVENTS	7
+
+/* number of RUN_* launchers, from run.h */
+#define STATS_LAUNCHERS	2
+
+/* size of the path of a slot, longer ones are truncated */
+#define STATS_PATH_MAX	256
+
+/* states of an entry */
+#define STATS_IDLE	0		/* not watched, waiting for room */
+#define STATS_WATCHING	1		/* waiting for an event */
+#define STATS_INACTIVE	2		/* failed, until the watchtab reload */
+#define STATS_MISSING	3		/* waiting for the path to appear */
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct stats_counters - counters of an entry, or of the whole daemon */
+struct stats_counters {
+	uint64_t	seq;		/* odd while being written */
+	uint64_t	events[STATS_EVENTS];	/* events by WEV_* bit */
+	uint64_t	triggers;	/* events that have triggered a run */
+	uint64_t	catchups;	/* changes found when armed again */
+	uint64_t	spawns;		/* commands started */
+	uint64_t	spawn_failures;	/* commands that could not be started */
+	uint64_t	launches[STATS_LAUNCHERS];	/* starts by launcher */
+	uint64_t	helped;		/* starts through the spawn helper */
+	uint64_t	exits[STATS_EXIT_CODES];	/* exits by code */
+	uint64_t	signals[STATS_SIGNALS];	/* deaths by signal */
+	uint64_t	exits_unknown;	/* exits of an unknown status */
+	uint64_t	running;	/* commands not yet exited */
+	uint64_t	last_trigger_ns;/* monotonic time of the last trigger */
+	uint64_t	last_exit_ns;	/* monotonic time of the last exit */
+	uint64_t	pending[STATS_BUCKETS];	/* trigger to start, in us */
+	uint64_t	duration[STATS_BUCKETS];/* start to exit, in us */
+	uint64_t	stage_count[TRACE_STAGES];	/* runs timed by stage */
+	uint64_t	stage_total_ns[TRACE_STAGES];	/* time up to stage */
+	uint64_t	stage_max_ns[TRACE_STAGES];	/* longest of those */
+};
+
+/* struct stats_sched - counters of the global scheduler, from sched.h */
+struct stats_sched {
+	uint64_t	seq;		/* odd while being written */
+	uint64_t	running;	/* commands started and not yet exited */
+	uint64_t	depth;		/* number of ready runs */
+	uint64_t	max_depth;	/* highest number of ready runs */
+	uint64_t	started;	/* number of runs started */
+	uint64_t	wait_total_ns;	/* total time spent ready */
+	uint64_t	wait_max_ns;	/* longest time spent ready */
+};
+
+/* struct stats_slot - counters of a watchtab entry */
+struct stats_slot {
+	struct stats_counters c;
+	uint32_t	state;		/* STATS_* entry state */
+	uint32_t	reserved;
+	char		path[STATS_PATH_MAX];	/* entry path, empty if free */
+};
+
+/* struct stats_header - start of the file */
+struct stats_header {
+	uint32_t	magic;		/* STATS_MAGIC */
+	uint32_t	version;	/* STATS_VERSION */
+	uint32_t	header_size;	/* sizeof(struct stats_header) */
+	uint32_t	slot_size;	/* sizeof(struct stats_slot) */
+	uint32_t	nslots;		/* number of slots after the header */
+	uint32_t	replaced;	/* whether a newer file is at the path */
+	uint64_t	pid;		/* daemon process */
+	uint64_t	start_ns;	/* monotonic time of daemon start */
+	struct stats_counters global;	/* counters of all entries */
+	struct stats_sched sched;	/* counters of the scheduler */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* stats_open - create the file at the given path, with room for n slots */
+int
+stats_open(const char *path, size_t n);
+
+/* stats_assign - give a slot to entries of the watchtab without one */
+void
+stats_assign(struct watchtab *wtab);
+
+/* stats_release - free the slot of an entry removed from the watchtab */
+void
+stats_release(struct watch_entry *wentry);
+
+/* stats_state - record whether an entry is watched */
+void
+stats_state(struct watch_entry *wentry, unsigned state);
+
+/* stats_event - count the events received for an entry */
+void
+stats_event(struct watch_entry *wentry, u_int events);
+
+/* stats_trigger - count a trigger, starting its pending time */
+void
+stats_trigger(struct watch_entry *wentry);
+
+/* stats_catchup - count a change found when the entry was armed again */
+void
+stats_catchup(struct watch_entry *wentry);
+
+/* stats_spawn - count the start of a command, or its failure if pid is 0 */
+/*   launched is the launcher that started it, as run_launched() returns. */
+void
+stats_spawn(struct watch_entry *wentry, pid_t pid, int launched);
+
+/* stats_exit - count the end of a command, with its wait status or -1 */
+void
+stats_exit(struct watch_entry *wentry, pid_t pid, int status);
+
+/* stats_sched - copy the counters of the scheduler */
+void
+stats_sched(const struct sched_stats *stats);
+
+/* stats_stages - add the stage times of a complete run, 0 when not timed */
+void
+stats_stages(struct watch_entry *wentry, const uint64_t spent[TRACE_STAGES]);
+
+#endif /* ndef FILEWATCHER_STATS_H */
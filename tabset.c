@@ -0,0 +1,301 @@
+/* tabset.c - watchtabs read from a file or from a directory */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "log.h"
+#include "tabset.h"
+
+/* initial number of names read from the directory */
+#define TABSET_NAMES 64
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* dir_len - length of a directory path without its trailing slashes */
+static size_t
+dir_len(const char *path) {
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	return len;
+}
+
+
+/* skip_name - whether a directory entry is not a watchtab */
+static int
+skip_name(const struct dirent *dent) {
+	size_t len = strlen(dent->d_name);
+
+	return len == 0 || dent->d_name[0] == '.'
+	    || dent->d_name[len - 1] == '~' || dent->d_type == DT_DIR;
+}
+
+
+/* cmp_names - compare two names for qsort() */
+static int
+cmp_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* new_tab - allocate an empty watchtab */
+/*   dir is the directory of the file named name, or null when name is
+ *   a path on its own. */
+static struct watch_tab *
+new_tab(const char *dir, const char *name) {
+	size_t dlen = dir ? dir_len(dir) : 0, nlen = strlen(name);
+	struct watch_tab *tab;
+
+	tab = malloc(sizeof *tab + dlen + nlen + 2);
+	if (!tab) {
+		log_alloc("watchtab");
+		return 0;
+	}
+
+	tab->node = WNODE_TAB;
+	tab->f = 0;
+	tab->timer = 0;
+	tab->error = 0;
+	tab->loaded = 0;
+	tab->queued = 0;
+	tab->owner = 0;
+	tab->count = 0;
+	SLIST_INIT(&tab->entries);
+	tab->next = 0;
+	tab->qnext = 0;
+	if (dir) {
+		memcpy(tab->path, dir, dlen);
+		tab->path[dlen] = '/';
+		memcpy(tab->path + dlen + 1, name, nlen + 1);
+	}
+	else
+		memcpy(tab->path, name, nlen + 1);
+
+	return tab;
+}
+
+
+/* unqueue - take a watchtab out of the reload queue */
+static void
+unqueue(struct tab_set *set, struct watch_tab *tab) {
+	struct watch_tab **prev = &set->queue;
+
+	if (!tab->queued) return;
+	while (*prev != tab)
+		prev = &(*prev)->qnext;
+	*prev = tab->qnext;
+	if (set->qlast == &tab->qnext)
+		set->qlast = prev;
+	tab->queued = 0;
+}
+
+
+/* read_names - sorted names of the watchtabs in the open directory */
+/*   Return the number of names, or -1 after logging. */
+static ssize_t
+read_names(struct tab_set *set, char ***names) {
+	struct dirent *dent;
+	char **list = 0, **new_list;
+	size_t n = 0, size = 0;
+
+	rewinddir(set->dir);
+	errno = 0;
+	while ((dent = readdir(set->dir)) != 0) {
+		if (skip_name(dent))
+			continue;
+
+		if (n >= size) {
+			size = size ? size * 2 : TABSET_NAMES;
+			new_list = realloc(list, size * sizeof *list);
+			if (!new_list) {
+				log_alloc("watchtab names");
+				break;
+			}
+			list = new_list;
+		}
+		list[n] = strdup(dent->d_name);
+		if (!list[n]) {
+			log_alloc("watchtab names");
+			break;
+		}
+		n++;
+		errno = 0;
+	}
+
+	/* Partial listings would remove the missing watchtabs */
+	if (dent || errno) {
+		if (!dent)
+			log_open_watchtab(set->path);
+		while (n)
+			free(list[--n]);
+		free(list);
+		return -1;
+	}
+
+	qsort(list, n, sizeof *list, cmp_names);
+	*names = list;
+	return (ssize_t)n;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* tabset_open - list the watchtabs at the given path */
+int
+tabset_open(struct tab_set *set, const char *path) {
+	struct watch_tab *removed = 0;
+	struct stat st;
+
+	set->node = WNODE_TABSET;
+	set->is_dir = 0;
+	set->dir = 0;
+	set->timer = 0;
+	set->error = 0;
+	set->rescan = 0;
+	set->owned = 0;
+	set->max_entries = 0;
+	set->tabs = 0;
+	set->queue = 0;
+	set->qlast = &set->queue;
+	set->path = path;
+
+	if (stat(path, &st) < 0) {
+		log_open_watchtab(path);
+		return -1;
+	}
+
+	/* A single watchtab */
+	if (!S_ISDIR(st.st_mode)) {
+		set->tabs = new_tab(0, path);
+		if (!set->tabs)
+			return -1;
+		tabset_queue(set, set->tabs);
+		return 0;
+	}
+
+	set->is_dir = 1;
+	set->dir = opendir(path);
+	if (!set->dir) {
+		log_open_watchtab(path);
+		return -1;
+	}
+	return tabset_scan(set, &removed);
+}
+
+
+/* tabset_scan - list the open directory again */
+int
+tabset_scan(struct tab_set *set, struct watch_tab **removed) {
+	struct watch_tab **prev = &set->tabs, *tab;
+	size_t plen = dir_len(set->path) + 1, i = 0;
+	ssize_t n;
+	char **names;
+	int cmp;
+
+	if (!set->dir) {
+		LOG_ASSERT("set->dir");
+		return -1;
+	}
+	n = read_names(set, &names);
+	if (n < 0)
+		return -1;
+
+	/* Merge the sorted names into the sorted watchtabs */
+	while (*prev || i < (size_t)n) {
+		tab = *prev;
+		if (!tab)
+			cmp = 1;
+		else if (i >= (size_t)n)
+			cmp = -1;
+		else
+			cmp = strcmp(tab->path + plen, names[i]);
+
+		if (cmp < 0) {
+			*prev = tab->next;
+			unqueue(set, tab);
+			tab->next = *removed;
+			*removed = tab;
+		}
+		else if (cmp > 0) {
+			tab = new_tab(set->path, names[i++]);
+			if (!tab)
+				continue;
+			tab->next = *prev;
+			*prev = tab;
+			prev = &tab->next;
+			tabset_queue(set, tab);
+		}
+		else {
+			prev = &tab->next;
+			i++;
+		}
+	}
+
+	for (i = 0; i < (size_t)n; i++)
+		free(names[i]);
+	free(names);
+	return 0;
+}
+
+
+/* tabset_queue - queue a watchtab for reload, unless already queued */
+void
+tabset_queue(struct tab_set *set, struct watch_tab *tab) {
+	if (tab->queued) return;
+
+	tab->queued = 1;
+	tab->qnext = 0;
+	*set->qlast = tab;
+	set->qlast = &tab->qnext;
+}
+
+
+/* tabset_next - take the next watchtab to reload, or null */
+struct watch_tab *
+tabset_next(struct tab_set *set) {
+	struct watch_tab *tab = set->queue;
+
+	if (!tab) return 0;
+
+	set->queue = tab->qnext;
+	if (!set->queue)
+		set->qlast = &set->queue;
+	tab->queued = 0;
+	return tab;
+}
+
+
+/* tabset_free - free a watchtab out of its set, without its entries */
+void
+tabset_free(struct watch_tab *tab) {
+	if (tab->f)
+		fclose(tab->f);
+	free(tab);
+}
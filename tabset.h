@@ -0,0 +1,116 @@
+/* tabset.h - watchtabs read from a file or from a directory */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The daemon reads its entries either from a single watchtab, or from
+ * every file of a directory, like cron.d. Each file is a watchtab of its
+ * own, with its own stream, kernel registration, reload timer and
+ * entries, so that a change to one file only parses that file again and
+ * only touches its entries. The directory is watched too, and only its
+ * listing is read again when it changes, to find added and removed files.
+ *
+ * Names starting with a dot or ending with a tilde are skipped, as hidden
+ * or backup files.
+ *
+ * When the set is owned, like a cron spool of per-user files, the entries
+ * of each watchtab run as the owner of its file, which then has to be a
+ * regular file with a single link that nobody else can write. The entries
+ * of all the watchtabs of an owner can be limited in number, a watchtab
+ * that would go above the limit being refused as a whole. Reload timers are identified by the address of their
+ * watchtab or set, which is also the pointer given along their events.
+ */
+
+#ifndef FILEWATCHER_TABSET_H
+#define FILEWATCHER_TABSET_H
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "watchtab.h"
+
+/* events making a watchtab or its directory read again */
+#define TABSET_EVENTS	(WEV_DELETE | WEV_WRITE | WEV_RENAME | WEV_REVOKE)
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct watch_tab - a watchtab file and its entries */
+struct watch_tab {
+	int		node;		/* WNODE_TAB */
+	FILE		*f;		/* open file, or null while reloading */
+	int		timer;		/* whether its reload timer is started */
+	int		error;		/* whether a failure to open is logged */
+	int		loaded;		/* whether it has been read once */
+	int		queued;		/* whether waiting in the reload queue */
+	uid_t		owner;		/* owner of the file, when owned */
+	size_t		count;		/* number of entries */
+	struct watchtab	entries;	/* entries read from the file */
+	struct watch_tab *next;		/* next watchtab of the set, by name */
+	struct watch_tab *qnext;	/* next watchtab in the reload queue */
+	char		path[];		/* path of the file */
+};
+
+/* struct tab_set - every watchtab of the daemon */
+struct tab_set {
+	int		node;		/* WNODE_TABSET */
+	int		is_dir;		/* whether path is a directory */
+	DIR		*dir;		/* open directory, or null while reloading */
+	int		timer;		/* whether its rescan timer is started */
+	int		error;		/* whether a failure to open is logged */
+	int		rescan;		/* whether its rescan timer has expired */
+	int		owned;		/* whether entries run as file owners */
+	size_t		max_entries;	/* limit for each owner, 0 for none */
+	struct watch_tab *tabs;		/* watchtabs, sorted by path */
+	struct watch_tab *queue;	/* watchtabs to reload */
+	struct watch_tab **qlast;	/* end of the reload queue */
+	const char	*path;		/* watchtab or directory of watchtabs */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* tabset_open - list the watchtabs at the given path */
+/*   A directory is left open in the set, to be watched. */
+int
+tabset_open(struct tab_set *set, const char *path);
+
+/* tabset_scan - list the open directory again */
+/*   New watchtabs are queued for their first load, and removed ones are
+ *   taken out of the set and the queue and linked into removed, to be
+ *   released by the caller with tabset_free(). */
+int
+tabset_scan(struct tab_set *set, struct watch_tab **removed);
+
+/* tabset_queue - queue a watchtab for reload, unless already queued */
+void
+tabset_queue(struct tab_set *set, struct watch_tab *tab);
+
+/* tabset_next - take the next watchtab to reload, or null */
+struct watch_tab *
+tabset_next(struct tab_set *set);
+
+/* tabset_free - free a watchtab out of its set, without its entries */
+void
+tabset_free(struct watch_tab *tab);
+
+#endif /* ndef FILEWATCHER_TABSET_H */
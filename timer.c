@@ -0,0 +1,222 @@
+/* timer.c - deadline heap for delayed commands */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "log.h"
+#include "timer.h"
+
+/* number of pointers allocated at once in timer_heap */
+#define THEAP_ALLOC_UNIT 64
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* place - store a node at the given 0-based heap position */
+static void
+place(struct timer_heap *heap, struct timer_node *node, size_t i) {
+	heap->nodes[i] = node;
+	node->index = i + 1;
+}
+
+
+/* sift_up - move a node towards the root until heap order is restored */
+static void
+sift_up(struct timer_heap *heap, size_t i) {
+	struct timer_node *node = heap->nodes[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (timer_cmp(&heap->nodes[parent]->deadline,
+		    &node->deadline) <= 0)
+			break;
+		place(heap, heap->nodes[parent], i);
+		i = parent;
+	}
+
+	place(heap, node, i);
+}
+
+
+/* sift_down - move a node towards the leaves until heap order is restored */
+static void
+sift_down(struct timer_heap *heap, size_t i) {
+	struct timer_node *node = heap->nodes[i];
+
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= heap->size) break;
+		if (child + 1 < heap->size
+		    && timer_cmp(&heap->nodes[child + 1]->deadline,
+		    &heap->nodes[child]->deadline) < 0)
+			child++;
+		if (timer_cmp(&node->deadline,
+		    &heap->nodes[child]->deadline) <= 0)
+			break;
+		place(heap, heap->nodes[child], i);
+		i = child;
+	}
+
+	place(heap, node, i);
+}
+
+
+
+/******************
+ * TIME FUNCTIONS *
+ ******************/
+
+/* timer_now - read the current monotonic time */
+void
+timer_now(struct timespec *now) {
+	clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+
+/* timer_add - add a relative delay to a time */
+void
+timer_add(struct timespec *dest, const struct timespec *from,
+    const struct timespec *delay) {
+	dest->tv_sec = from->tv_sec + delay->tv_sec;
+	dest->tv_nsec = from->tv_nsec + delay->tv_nsec;
+	if (dest->tv_nsec >= 1000000000) {
+		dest->tv_sec++;
+		dest->tv_nsec -= 1000000000;
+	}
+}
+
+
+/* timer_cmp - compare two times, with the same result as strcmp() */
+int
+timer_cmp(const struct timespec *a, const struct timespec *b) {
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+
+/* timer_until - relative time from now until deadline, zero if past */
+void
+timer_until(struct timespec *dest, const struct timespec *deadline,
+    const struct timespec *now) {
+	if (timer_cmp(deadline, now) <= 0) {
+		dest->tv_sec = 0;
+		dest->tv_nsec = 0;
+		return;
+	}
+
+	dest->tv_sec = deadline->tv_sec - now->tv_sec;
+	dest->tv_nsec = deadline->tv_nsec - now->tv_nsec;
+	if (dest->tv_nsec < 0) {
+		dest->tv_sec--;
+		dest->tv_nsec += 1000000000;
+	}
+}
+
+
+
+/******************
+ * HEAP INTERFACE *
+ ******************/
+
+/* theap_init - initialize an empty heap */
+void
+theap_init(struct timer_heap *heap) {
+	heap->nodes = 0;
+	heap->size = 0;
+	heap->capacity = 0;
+}
+
+
+/* theap_release - free the heap array, leaving nodes idle */
+void
+theap_release(struct timer_heap *heap) {
+	size_t i;
+
+	for (i = 0; i < heap->size; i++)
+		heap->nodes[i]->index = 0;
+	free(heap->nodes);
+	theap_init(heap);
+}
+
+
+/* theap_insert - add an idle node with its deadline already set */
+int
+theap_insert(struct timer_heap *heap, struct timer_node *node) {
+	if (theap_pending(node)) {
+		LOG_ASSERT("node->index");
+		return -1;
+	}
+
+	if (heap->size >= heap->capacity) {
+		size_t new_cap = heap->capacity + THEAP_ALLOC_UNIT;
+		struct timer_node **new_nodes;
+
+		new_nodes = realloc(heap->nodes, new_cap * sizeof *new_nodes);
+		if (!new_nodes) {
+			log_alloc("timer heap");
+			return -1;
+		}
+		heap->nodes = new_nodes;
+		heap->capacity = new_cap;
+	}
+
+	heap->nodes[heap->size++] = node;
+	sift_up(heap, heap->size - 1);
+	return 0;
+}
+
+
+/* theap_remove - remove a pending node */
+void
+theap_remove(struct timer_heap *heap, struct timer_node *node) {
+	size_t i;
+
+	if (!theap_pending(node)) return;
+	i = node->index - 1;
+	node->index = 0;
+
+	/* Fill the hole with the last node */
+	heap->size--;
+	if (i == heap->size) return;
+	place(heap, heap->nodes[heap->size], i);
+	theap_update(heap, heap->nodes[i]);
+}
+
+
+/* theap_update - restore heap order after changing a node deadline */
+void
+theap_update(struct timer_heap *heap, struct timer_node *node) {
+	size_t i = node->index - 1;
+
+	if (i > 0 && timer_cmp(&heap->nodes[(i - 1) / 2]->deadline,
+	    &node->deadline) > 0)
+		sift_up(heap, i);
+	else
+		sift_down(heap, i);
+}
+
+
+/* theap_first - node with the earliest deadline, or 0 when empty */
+struct timer_node *
+theap_first(struct timer_heap *heap) {
+	return heap->size ? heap->nodes[0] : 0;
+}
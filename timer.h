@@ -0,0 +1,102 @@
+/* timer.h - deadline heap for delayed commands */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pending deadlines are kept in a binary min-heap of pointers to nodes
+ * embedded in their owner, so a pending deadline costs one pointer in the
+ * heap array on top of the node itself, and can be removed or moved in
+ * O(log n). The event loop sleeps until the earliest deadline.
+ * All times use CLOCK_MONOTONIC.
+ */
+
+#ifndef FILEWATCHER_TIMER_H
+#define FILEWATCHER_TIMER_H
+
+#include <stddef.h>
+#include <time.h>
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct timer_node - a deadline, embedded in the structure it belongs to */
+struct timer_node {
+	struct timespec	deadline;	/* expiry time */
+	size_t		index;		/* heap position + 1, or 0 when idle */
+};
+
+/* struct timer_heap - min-heap of timer nodes */
+struct timer_heap {
+	struct timer_node **nodes;	/* heap array */
+	size_t		size;		/* number of nodes in the heap */
+	size_t		capacity;	/* allocated number of pointers */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* timer_now - read the current monotonic time */
+void
+timer_now(struct timespec *now);
+
+/* timer_add - add a relative delay to a time */
+void
+timer_add(struct timespec *dest, const struct timespec *from,
+    const struct timespec *delay);
+
+/* timer_cmp - compare two times, with the same result as strcmp() */
+int
+timer_cmp(const struct timespec *a, const struct timespec *b);
+
+/* timer_until - relative time from now until deadline, zero if past */
+void
+timer_until(struct timespec *dest, const struct timespec *deadline,
+    const struct timespec *now);
+
+
+/* theap_init - initialize an empty heap */
+void
+theap_init(struct timer_heap *heap);
+
+/* theap_release - free the heap array, leaving nodes idle */
+void
+theap_release(struct timer_heap *heap);
+
+/* theap_insert - add an idle node with its deadline already set */
+int
+theap_insert(struct timer_heap *heap, struct timer_node *node);
+
+/* theap_remove - remove a pending node */
+void
+theap_remove(struct timer_heap *heap, struct timer_node *node);
+
+/* theap_update - restore heap order after changing a node deadline */
+void
+theap_update(struct timer_heap *heap, struct timer_node *node);
+
+/* theap_first - node with the earliest deadline, or 0 when empty */
+struct timer_node *
+theap_first(struct timer_heap *heap);
+
+/* theap_pending - whether a node is currently in a heap */
+#define theap_pending(node) ((node)->index != 0)
+
+#endif /* ndef FILEWATCHER_TIMER_H */
@@ -0,0 +1,468 @@
+/* trace.c - timing of each stage from kernel event to command exit */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+
+/* size of the output buffer of the trace file */
+#define TRACE_BUFFER 65536
+
+/* longest single record written to the trace file, path excluded */
+#define TRACE_RECORD 256
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* enabled - whether timestamps are collected */
+static int enabled = 0;
+
+/* trace_fd - trace file, or -1 */
+static int trace_fd = -1;
+
+/* out - pending output of the trace file */
+static char out[TRACE_BUFFER];
+
+/* out_len - number of bytes in out */
+static size_t out_len = 0;
+
+/* daemon_pid - pid of all records */
+static long daemon_pid = 0;
+
+/* last_id - track of the latest traced entry */
+static unsigned last_id = 0;
+
+/* last_serial - identifier of the latest completed run */
+static unsigned long last_serial = 0;
+
+/* wakeup_ns - time the current batch of events has been dequeued */
+static uint64_t wakeup_ns = 0;
+
+/* exec_pipe - pipe of the command being started */
+static int exec_pipe[2] = { -1, -1 };
+
+/* from_stage - stage each stage is timed from, when it has been reached */
+static const int from_stage[TRACE_STAGES] = {
+    TRACE_EVENT,		/* TRACE_EVENT */
+    TRACE_EVENT,		/* TRACE_CLOSED */
+    TRACE_CLOSED,		/* TRACE_READY */
+    TRACE_READY,		/* TRACE_STARTING */
+    TRACE_STARTING,		/* TRACE_SPAWNED */
+    TRACE_STARTING,		/* TRACE_EXEC */
+    TRACE_EXEC,			/* TRACE_EXITED */
+    TRACE_CLOSED		/* TRACE_REARMED */
+};
+
+/* stage_names - names of the time spent up to each stage */
+static const char *stage_names[TRACE_STAGES] = TRACE_NAMES;
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* now_ns - monotonic time in nanoseconds */
+static uint64_t
+now_ns(void) {
+	struct timespec now;
+
+	timer_now(&now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/* flush_out - write the pending output to the trace file */
+static void
+flush_out(void) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < out_len) {
+		n = write(trace_fd, out + done, out_len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			log_trace("write");
+			close(trace_fd);
+			trace_fd = -1;
+			break;
+		}
+		done += (size_t)n;
+	}
+	out_len = 0;
+}
+
+
+/* put_raw - append bytes to the trace output */
+static void
+put_raw(const char *data, size_t size) {
+	if (out_len + size > sizeof out)
+		flush_out();
+	if (size > sizeof out)
+		size = sizeof out;
+	memcpy(out + out_len, data, size);
+	out_len += size;
+}
+
+
+/* put_fmt - append a formatted record to the trace output */
+static void
+put_fmt(const char *fmt, ...) {
+	char buf[TRACE_RECORD];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		put_raw(buf, (size_t)n < sizeof buf ? (size_t)n : sizeof buf - 1);
+}
+
+
+/* put_string - append a string as a JSON literal */
+static void
+put_string(const char *s) {
+	char esc[8];
+	size_t i;
+
+	put_raw("\"", 1);
+	for (i = 0; s[i]; i++) {
+		if (s[i] == '"' || s[i] == '\\') {
+			esc[0] = '\\';
+			esc[1] = s[i];
+			put_raw(esc, 2);
+		}
+		else if ((unsigned char)s[i] < 0x20) {
+			snprintf(esc, sizeof esc, "\\u%04x", (unsigned char)s[i]);
+			put_raw(esc, 6);
+		}
+		else
+			put_raw(s + i, 1);
+	}
+	put_raw("\"", 1);
+}
+
+
+/* entry_track - track of an entry, named in the trace on first use */
+static unsigned
+entry_track(struct watch_entry *wentry) {
+	if (wentry->trace_id)
+		return wentry->trace_id;
+
+	wentry->trace_id = ++last_id;
+	put_fmt("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+	    "\"tid\":%u,\"args\":{\"name\":", daemon_pid, wentry->trace_id);
+	put_string(wentry->path);
+	put_raw("}},\n", 4);
+	return wentry->trace_id;
+}
+
+
+/* start_stage - earliest reached stage a stage is timed from, or -1 */
+static int
+start_stage(const struct trace_run *run, int stage) {
+	int from = from_stage[stage];
+
+	while (!run->at[from] && from != TRACE_EVENT)
+		from = from_stage[from];
+	return run->at[from] ? from : -1;
+}
+
+
+/* finish_run - account for a complete run and release it */
+static void
+finish_run(struct watch_entry *wentry, struct trace_run *run) {
+	uint64_t spent[TRACE_STAGES];
+	unsigned long serial = ++last_serial;
+	unsigned track = 0;
+	int i, from;
+
+	if (trace_fd >= 0)
+		track = entry_track(wentry);
+
+	for (i = 0; i < TRACE_STAGES; i++) {
+		spent[i] = 0;
+		from = i == TRACE_EVENT ? -1 : start_stage(run, i);
+		if (!run->at[i] || from < 0 || run->at[i] < run->at[from])
+			continue;
+
+		/* A stage reached at once is still counted */
+		spent[i] = run->at[i] - run->at[from] + 1;
+		if (trace_fd < 0)
+			continue;
+		put_fmt("{\"name\":\"%s\",\"cat\":\"run\",\"ph\":\"b\","
+		    "\"id\":%lu,\"pid\":%ld,\"tid\":%u,\"ts\":%.3f,"
+		    "\"args\":{\"command\":%ld}},\n", stage_names[i], serial,
+		    daemon_pid, track, run->at[from] / 1e3, (long)run->pid);
+		put_fmt("{\"name\":\"%s\",\"cat\":\"run\",\"ph\":\"e\","
+		    "\"id\":%lu,\"pid\":%ld,\"tid\":%u,\"ts\":%.3f},\n",
+		    stage_names[i], serial, daemon_pid, track,
+		    run->at[i] / 1e3);
+	}
+
+	stats_stages(wentry, spent);
+	free(run);
+}
+
+
+/* take_run - detach the run of a command from its entry */
+static struct trace_run *
+take_run(struct watch_entry *wentry, pid_t pid) {
+	struct trace_run **link, *run;
+
+	for (link = &wentry->trace_runs; *link; link = &(*link)->next) {
+		if ((*link)->pid != pid)
+			continue;
+		run = *link;
+		*link = run->next;
+		return run;
+	}
+	return 0;
+}
+
+
+/* close_exec_pipe - close what is left of the exec pipe */
+static void
+close_exec_pipe(void) {
+	if (exec_pipe[0] >= 0)
+		close(exec_pipe[0]);
+	if (exec_pipe[1] >= 0)
+		close(exec_pipe[1]);
+	exec_pipe[0] = exec_pipe[1] = -1;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* trace_init - start collecting timestamps, written to path if not null */
+int
+trace_init(const char *path) {
+	enabled = 1;
+	daemon_pid = (long)getpid();
+	if (!path) return 0;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0) {
+		log_open_trace(path);
+		return -1;
+	}
+
+	/* The closing bracket is optional in the array format */
+	put_raw("[\n", 2);
+	put_fmt("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+	    "\"tid\":0,\"args\":{\"name\":\"event loop\"}},\n", daemon_pid);
+	flush_out();
+	return 0;
+}
+
+
+/* trace_wakeup - record the time events have been dequeued */
+void
+trace_wakeup(void) {
+	if (enabled)
+		wakeup_ns = now_ns();
+}
+
+
+/* trace_loop - end of a wakeup that has handled count events */
+void
+trace_loop(int count) {
+	if (trace_fd < 0) return;
+
+	put_fmt("{\"name\":\"wakeup\",\"ph\":\"X\",\"pid\":%ld,\"tid\":0,"
+	    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"events\":%d}},\n",
+	    daemon_pid, wakeup_ns / 1e3, (now_ns() - wakeup_ns) / 1e3, count);
+	flush_out();
+}
+
+
+/* trace_trigger - stamp the event of a trigger, if none is pending yet */
+void
+trace_trigger(struct watch_entry *wentry, int closed) {
+	struct trace_run *run;
+
+	if (!enabled || wentry->trace_next) return;
+
+	run = calloc(1, sizeof *run);
+	if (!run) {
+		log_alloc("trace run");
+		return;
+	}
+	run->at[TRACE_EVENT] = wakeup_ns;
+	if (closed)
+		run->at[TRACE_CLOSED] = now_ns();
+	wentry->trace_next = run;
+}
+
+
+/* trace_ready - stamp the submission of a run to the scheduler */
+void
+trace_ready(struct watch_entry *wentry) {
+	if (wentry->trace_next && !wentry->trace_next->at[TRACE_READY])
+		wentry->trace_next->at[TRACE_READY] = now_ns();
+}
+
+
+/* trace_starting - stamp the call to the launcher */
+int
+trace_starting(struct watch_entry *wentry) {
+	if (!enabled) return -1;
+
+	/* Runs queued behind a command are timed from their start */
+	if (!wentry->trace_next) {
+		wentry->trace_next = calloc(1, sizeof *wentry->trace_next);
+		if (!wentry->trace_next) {
+			log_alloc("trace run");
+			return -1;
+		}
+	}
+
+	/* Only the reading end stays in the daemon, never blocking */
+	if (pipe(exec_pipe) < 0) {
+		log_trace("pipe");
+		exec_pipe[0] = exec_pipe[1] = -1;
+	}
+	else if (fcntl(exec_pipe[0], F_SETFD, FD_CLOEXEC) < 0
+	    || fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC) < 0
+	    || fcntl(exec_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+		log_trace("fcntl");
+		close_exec_pipe();
+	}
+
+	wentry->trace_next->at[TRACE_STARTING] = now_ns();
+	return exec_pipe[1];
+}
+
+
+/* trace_spawned - stamp the return of the launcher, with pid 0 on failure */
+/*   The child has written its exec time before the launcher returned, and
+ *   closed the pipe by exec, so reading does not wait. */
+void
+trace_spawned(struct watch_entry *wentry, pid_t pid) {
+	struct trace_run *run = wentry->trace_next;
+	struct timespec exec_time;
+
+	if (!run) return;
+	run->at[TRACE_SPAWNED] = now_ns();
+	if (exec_pipe[1] >= 0) {
+		close(exec_pipe[1]);
+		exec_pipe[1] = -1;
+		if (read(exec_pipe[0], &exec_time, sizeof exec_time)
+		    == sizeof exec_time)
+			run->at[TRACE_EXEC] = (uint64_t)exec_time.tv_sec
+			    * 1000000000ULL + (uint64_t)exec_time.tv_nsec;
+	}
+	close_exec_pipe();
+
+	/* Later triggers start a new run */
+	wentry->trace_next = 0;
+	if (!pid) {
+		free(run);
+		return;
+	}
+	run->pid = pid;
+	run->next = wentry->trace_runs;
+	wentry->trace_runs = run;
+}
+
+
+/* trace_exited - stamp the exit of a command */
+/*   The run is complete at once when the entry is already watched again,
+ *   is always watched as a tree or a persistent file, or is not watched
+ *   anymore. */
+void
+trace_exited(struct watch_entry *wentry, pid_t pid) {
+	struct trace_run *run;
+
+	if (!enabled) return;
+	run = take_run(wentry, pid);
+	if (!run) return;
+	run->at[TRACE_EXITED] = now_ns();
+
+	if (run->at[TRACE_REARMED] || wentry->tree
+	    || (wentry->persist && wentry->file) || wentry->removed)
+		finish_run(wentry, run);
+	else {
+		run->next = wentry->trace_runs;
+		wentry->trace_runs = run;
+	}
+}
+
+
+/* trace_armed - stamp the watch of an entry, completing exited runs */
+void
+trace_armed(struct watch_entry *wentry) {
+	struct trace_run **link, *run;
+	uint64_t now;
+
+	if (!enabled) return;
+	now = now_ns();
+	if (wentry->trace_next && wentry->trace_next->at[TRACE_CLOSED]
+	    && !wentry->trace_next->at[TRACE_REARMED])
+		wentry->trace_next->at[TRACE_REARMED] = now;
+
+	link = &wentry->trace_runs;
+	while ((run = *link) != 0) {
+		if (!run->at[TRACE_REARMED])
+			run->at[TRACE_REARMED] = now;
+		if (run->at[TRACE_EXITED]) {
+			*link = run->next;
+			finish_run(wentry, run);
+		}
+		else
+			link = &run->next;
+	}
+}
+
+
+/* trace_release - complete the runs of an entry removed from the watchtab */
+void
+trace_release(struct watch_entry *wentry) {
+	struct trace_run **link, *run;
+
+	if (!enabled) return;
+	free(wentry->trace_next);
+	wentry->trace_next = 0;
+
+	link = &wentry->trace_runs;
+	while ((run = *link) != 0) {
+		if (run->at[TRACE_EXITED]) {
+			*link = run->next;
+			finish_run(wentry, run);
+		}
+		else
+			link = &run->next;
+	}
+}
@@ -0,0 +1,117 @@
+/* trace.h - timing of each stage from kernel event to command exit */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Each run of a command collects monotonic timestamps of its stages. The
+ * first stages belong to the earliest trigger not yet served, and are
+ * kept on the entry until a command starts. The exec stage is stamped by
+ * the child itself, just before execve(), and sent over a close-on-exec
+ * pipe, which only commands started through vfork() can do: with the
+ * posix_spawn() launcher, the stage is missing and the command is timed
+ * from the launcher call.
+ *
+ * A run is complete once the command has exited and the entry is watched
+ * again. The time spent in each stage is then added to the counters of
+ * the entry in the statistics file, and written to the trace file if any,
+ * in Chrome trace event format along with the duration of each wakeup of
+ * the event loop.
+ */
+
+#ifndef FILEWATCHER_TRACE_H
+#define FILEWATCHER_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "watchtab.h"
+
+/* stages of a run */
+#define TRACE_EVENT	0		/* event dequeued, at the wakeup */
+#define TRACE_CLOSED	1		/* watched descriptor closed */
+#define TRACE_READY	2		/* submitted to the scheduler */
+#define TRACE_STARTING	3		/* launcher called */
+#define TRACE_SPAWNED	4		/* launcher returned */
+#define TRACE_EXEC	5		/* execve() reached in the child */
+#define TRACE_EXITED	6		/* exit noticed by the event loop */
+#define TRACE_REARMED	7		/* entry watched again */
+#define TRACE_STAGES	8
+
+/* names of what happens up to each stage, from an earlier stage */
+#define TRACE_NAMES { "event", "close", "delay", "queue", "spawn", "exec", \
+    "command", "unwatched" }
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct trace_run - timestamps of a run, 0 for stages not reached */
+struct trace_run {
+	uint64_t	at[TRACE_STAGES];
+	pid_t		pid;		/* command, once started */
+	struct trace_run *next;		/* other runs of the entry */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* trace_init - start collecting timestamps, written to path if not null */
+int
+trace_init(const char *path);
+
+/* trace_wakeup - record the time events have been dequeued */
+void
+trace_wakeup(void);
+
+/* trace_loop - end of a wakeup that has handled count events */
+void
+trace_loop(int count);
+
+/* trace_trigger - stamp the event of a trigger, if none is pending yet */
+/*   closed tells whether the watched descriptor has just been closed. */
+void
+trace_trigger(struct watch_entry *wentry, int closed);
+
+/* trace_ready - stamp the submission of a run to the scheduler */
+void
+trace_ready(struct watch_entry *wentry);
+
+/* trace_starting - stamp the call to the launcher */
+/*   Return the descriptor the child writes its exec time to, or -1. */
+int
+trace_starting(struct watch_entry *wentry);
+
+/* trace_spawned - stamp the return of the launcher, with pid 0 on failure */
+void
+trace_spawned(struct watch_entry *wentry, pid_t pid);
+
+/* trace_exited - stamp the exit of a command */
+void
+trace_exited(struct watch_entry *wentry, pid_t pid);
+
+/* trace_armed - stamp the watch of an entry, completing exited runs */
+void
+trace_armed(struct watch_entry *wentry);
+
+/* trace_release - complete the runs of an entry removed from the watchtab */
+void
+trace_release(struct watch_entry *wentry);
+
+#endif /* ndef FILEWATCHER_TRACE_H */
@@ -0,0 +1,730 @@
+/* tree.c - recursive watch of directory trees */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "match.h"
+#include "tree.h"
+
+/* maximum number of threads of an initial scan */
+#define TREE_MAX_THREADS 8
+
+/* initial number of hash buckets of a tree, must be a power of 2 */
+#define TREE_BUCKETS 64
+
+/* events always watched on directories, to keep the tree up to date */
+#define TREE_EVENTS (WEV_DELETE | WEV_WRITE | WEV_LINK | WEV_RENAME \
+    | WEV_REVOKE)
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct scan - initial walk of a tree shared by the scanning threads */
+struct scan {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;		/* signaled when dirs or busy change */
+	struct evqueue	*evq;		/* queue directories are watched in */
+	struct watch_tree *tree;	/* tree being built */
+	struct watch_dir **dirs;	/* all directories, in discovery order */
+	size_t		ndirs;		/* number of items in dirs */
+	size_t		capacity;	/* number of items allocated in dirs */
+	size_t		next;		/* index of the next one to read */
+	unsigned	busy;		/* number of threads reading one */
+	int		error;		/* whether an allocation has failed */
+};
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* number of threads of initial scans */
+static unsigned scan_threads = 1;
+
+/* directories dropped during the current batch */
+static struct watch_dir *dropped = 0;
+
+/* whether the descriptor limit has been raised for trees */
+static int limit_raised = 0;
+
+
+
+/*********************
+ * LOCAL SUBPROGRAMS *
+ *********************/
+
+/* dir_path - build the full path of a directory entry */
+/*   name may be null for the directory itself. */
+static char *
+dir_path(const struct watch_dir *dir, const char *name) {
+	const struct watch_dir *d;
+	size_t len = name ? strlen(name) + 1 : 0, n;
+	char *result, *s;
+
+	for (d = dir; d; d = d->parent)
+		len += strlen(d->name) + (d->parent ? 1 : 0);
+
+	result = malloc(len + 1);
+	if (!result) {
+		log_alloc("trigger path");
+		return 0;
+	}
+
+	/* Fill from the end */
+	s = result + len;
+	*s = 0;
+	if (name) {
+		n = strlen(name);
+		s -= n;
+		memcpy(s, name, n);
+		*--s = '/';
+	}
+	for (d = dir; d; d = d->parent) {
+		n = strlen(d->name);
+		s -= n;
+		memcpy(s, d->name, n);
+		if (d->parent) *--s = '/';
+	}
+
+	return result;
+}
+
+
+/* hash_dir - hash a directory on its parent and name */
+static size_t
+hash_dir(const struct watch_dir *parent, const char *name) {
+	uint64_t hash = 0xcbf29ce484222325ULL ^ (uintptr_t)parent;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (size_t)hash;
+}
+
+
+/* find_dir - lookup a subdirectory in the tree */
+static struct watch_dir *
+find_dir(struct watch_tree *tree, const struct watch_dir *parent,
+    const char *name) {
+	struct watch_dir *dir;
+
+	dir = tree->buckets[hash_dir(parent, name) & (tree->nbuckets - 1)];
+	while (dir && (dir->parent != parent || strcmp(dir->name, name) != 0))
+		dir = dir->hnext;
+	return dir;
+}
+
+
+/* link_dir - insert a new directory in the tree */
+static void
+link_dir(struct watch_tree *tree, struct watch_dir *dir) {
+	struct watch_dir **bucket;
+
+	/* Double the number of buckets when chains get long */
+	if (tree->ndirs >= tree->nbuckets * 2) {
+		struct watch_dir **old = tree->buckets, *d;
+		size_t old_size = tree->nbuckets, i;
+
+		tree->buckets = calloc(old_size * 2, sizeof *tree->buckets);
+		if (tree->buckets) {
+			tree->nbuckets = old_size * 2;
+			for (i = 0; i < old_size; i++) {
+				while ((d = old[i]) != 0) {
+					old[i] = d->hnext;
+					bucket = tree->buckets
+					    + (hash_dir(d->parent, d->name)
+					    & (tree->nbuckets - 1));
+					d->hnext = *bucket;
+					*bucket = d;
+				}
+			}
+			free(old);
+		}
+		else
+			tree->buckets = old;
+	}
+
+	bucket = tree->buckets
+	    + (hash_dir(dir->parent, dir->name) & (tree->nbuckets - 1));
+	dir->hnext = *bucket;
+	*bucket = dir;
+	if (dir->parent)
+		LIST_INSERT_HEAD(&dir->parent->children, dir, sibling);
+	tree->ndirs++;
+}
+
+
+/* drop_dir - stop watching a directory and its subdirectories */
+/*   Structures are only freed by tree_gc(), since events of the current
+ *   batch may still point to them. */
+static void
+drop_dir(struct evqueue *evq, struct watch_tree *tree, struct watch_dir *dir) {
+	struct watch_dir **prev, *child;
+
+	while ((child = LIST_FIRST(&dir->children)) != 0)
+		drop_dir(evq, tree, child);
+
+	prev = tree->buckets
+	    + (hash_dir(dir->parent, dir->name) & (tree->nbuckets - 1));
+	while (*prev && *prev != dir)
+		prev = &(*prev)->hnext;
+	if (*prev) {
+		*prev = dir->hnext;
+		tree->ndirs--;
+	}
+	if (dir->parent)
+		LIST_REMOVE(dir, sibling);
+	if (tree->root == dir)
+		tree->root = 0;
+
+	evq_unwatch(evq, dir->fd, dir);
+	close(dir->fd);
+	dir->fd = -1;
+	dir->hnext = dropped;
+	dropped = dir;
+}
+
+
+/* new_dir - open a directory and allocate its structure */
+/*   Return null after logging when the directory cannot be opened, or
+ *   cannot be read by the owner of the entry. */
+static struct watch_dir *
+new_dir(struct watch_entry *wentry, struct watch_dir *parent,
+    const char *name, unsigned state) {
+	struct watch_dir *dir;
+	size_t len = strlen(name);
+	int fd, allowed;
+
+	/* Symbolic links are only followed at the root */
+	allowed = parent ? 1 : wentry_reaches(wentry, name, R_OK | X_OK);
+	fd = allowed <= 0 ? -1 : parent
+	    ? openat(parent->fd, name,
+	        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+	    : open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	/* Below the root, the parent is known to be reachable */
+	if (fd >= 0 && parent)
+		allowed = wentry_allows(wentry, fd, R_OK | X_OK);
+	if (fd < 0 || allowed <= 0) {
+		char *path = parent ? dir_path(parent, name) : 0;
+		if (allowed)
+			log_open_entry(path ? path : name);
+		else
+			log_entry_unreachable(wentry, path ? path : name);
+		free(path);
+		if (fd >= 0) close(fd);
+		if (!allowed) errno = EACCES;
+		return 0;
+	}
+
+	dir = malloc(sizeof *dir + len + 1);
+	if (!dir) {
+		log_alloc("watched directory");
+		close(fd);
+		return 0;
+	}
+
+	dir->node = WNODE_DIR;
+	dir->fd = fd;
+	dir->entry = wentry;
+	dir->parent = parent;
+	LIST_INIT(&dir->children);
+	dir->hnext = 0;
+	dir->nlink = 0;
+	dir->mark = 1;
+	dir->state = state;
+	memcpy(dir->name, name, len + 1);
+	return dir;
+}
+
+
+/* is_subdir - whether a directory entry is a subdirectory to watch */
+static int
+is_subdir(int dirfd, const struct dirent *de) {
+	struct stat st;
+
+	if (de->d_name[0] == '.' && (de->d_name[1] == 0
+	    || (de->d_name[1] == '.' && de->d_name[2] == 0)))
+		return 0;
+#ifdef DT_DIR
+	if (de->d_type == DT_DIR)
+		return 1;
+	if (de->d_type != DT_UNKNOWN)
+		return 0;
+#endif
+	return fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+	    && S_ISDIR(st.st_mode);
+}
+
+
+/* read_dir - open subdirectories not yet in the tree */
+/*   With a null tree, all subdirectories are new. Otherwise known ones
+ *   are marked. New ones are chained through hnext in front of *found.
+ *   Subdirectories where a glob cannot match are skipped.
+ *   Return -1 when out of memory, 0 otherwise. */
+static int
+read_dir(struct watch_tree *tree, struct watch_dir *dir,
+    struct watch_dir **found) {
+	const struct matcher *glob = dir->entry->glob;
+	const struct dirent *de;
+	struct watch_dir *child;
+	struct stat st;
+	unsigned state = MATCH_START;
+	int fd, result = 0;
+	DIR *d;
+
+	/* A new descriptor, so that reading does not share dir->fd offset */
+	fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || !(d = fdopendir(fd))) {
+		char *path = dir_path(dir, 0);
+		log_open_entry(path ? path : dir->name);
+		free(path);
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	if (fstat(fd, &st) == 0)
+		dir->nlink = st.st_nlink;
+
+	while ((de = readdir(d)) != 0) {
+		if (!is_subdir(fd, de))
+			continue;
+		if (glob && (state = match_dir(glob, dir->state, de->d_name))
+		    == MATCH_DEAD)
+			continue;
+		if (tree && (child = find_dir(tree, dir, de->d_name)) != 0) {
+			child->mark = 1;
+			continue;
+		}
+		child = new_dir(dir->entry, dir, de->d_name, state);
+		if (!child) {
+			if (errno != ENOMEM) continue;
+			result = -1;
+			break;
+		}
+		child->hnext = *found;
+		*found = child;
+	}
+
+	closedir(d);
+	return result;
+}
+
+
+/* watch_dir - register a directory in the event queue */
+static int
+watch_dir(struct evqueue *evq, struct watch_dir *dir) {
+	if (evq_watch_persist(evq, dir->fd, dir->entry->events | TREE_EVENTS,
+	    dir) == 0)
+		return 0;
+
+	if (dir->parent) {
+		char *path = dir_path(dir, 0);
+		log_kevent_entry(path ? path : dir->name);
+		free(path);
+	}
+	else
+		log_kevent_entry(dir->name);
+	return -1;
+}
+
+
+/* grow_tree - insert, watch and scan new directories in place */
+/*   Directories are watched before being read, so that nothing created
+ *   in between goes unnoticed. */
+static void
+grow_tree(struct evqueue *evq, struct watch_tree *tree,
+    struct watch_dir *found) {
+	struct watch_dir *dir;
+
+	while ((dir = found) != 0) {
+		found = dir->hnext;
+		link_dir(tree, dir);
+		if (watch_dir(evq, dir) < 0) {
+			drop_dir(evq, tree, dir);
+			continue;
+		}
+		read_dir(0, dir, &found);
+	}
+}
+
+
+/* rescan_dir - synchronize the subdirectories of a directory */
+static void
+rescan_dir(struct evqueue *evq, struct watch_tree *tree,
+    struct watch_dir *dir) {
+	struct watch_dir *child, *next, *found = 0;
+
+	LIST_FOREACH(child, &dir->children, sibling)
+		child->mark = 0;
+	read_dir(tree, dir, &found);
+
+	/* Forget subdirectories that are gone, even if their own event
+	 * was lost, then add the new ones */
+	for (child = LIST_FIRST(&dir->children); child; child = next) {
+		next = LIST_NEXT(child, sibling);
+		if (!child->mark)
+			drop_dir(evq, tree, child);
+	}
+	grow_tree(evq, tree, found);
+}
+
+
+/* rescan_tree - synchronize a directory and all its subdirectories */
+static void
+rescan_tree(struct evqueue *evq, struct watch_tree *tree,
+    struct watch_dir *dir) {
+	struct watch_dir *child;
+
+	rescan_dir(evq, tree, dir);
+	LIST_FOREACH(child, &dir->children, sibling)
+		rescan_tree(evq, tree, child);
+}
+
+
+/* scan_worker - read directories of an initial scan until none is left */
+/*   Directories are watched before being read, as in grow_tree(), while
+ *   holding the lock since the event queue is not shared between threads. */
+static void *
+scan_worker(void *arg) {
+	struct scan *scan = arg;
+	struct watch_dir *dir, *found, *child;
+	int ret;
+
+	pthread_mutex_lock(&scan->lock);
+	while (1) {
+		while (scan->next == scan->ndirs && scan->busy > 0
+		    && !scan->error)
+			pthread_cond_wait(&scan->cond, &scan->lock);
+		if (scan->next == scan->ndirs || scan->error)
+			break;
+
+		dir = scan->dirs[scan->next++];
+		if (watch_dir(scan->evq, dir) < 0) {
+			if (dir == scan->tree->root)
+				scan->error = 1;
+			else
+				drop_dir(scan->evq, scan->tree, dir);
+			continue;
+		}
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+
+		found = 0;
+		ret = read_dir(0, dir, &found);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->busy--;
+		if (ret < 0)
+			scan->error = 1;
+		while ((child = found) != 0) {
+			found = child->hnext;
+			link_dir(scan->tree, child);
+			if (scan->ndirs >= scan->capacity) {
+				size_t new_cap = scan->capacity * 2;
+				struct watch_dir **new_dirs;
+
+				new_dirs = realloc(scan->dirs,
+				    new_cap * sizeof *new_dirs);
+				if (!new_dirs) {
+					log_alloc("directory scan");
+					scan->error = 1;
+					continue;
+				}
+				scan->dirs = new_dirs;
+				scan->capacity = new_cap;
+			}
+			scan->dirs[scan->ndirs++] = child;
+		}
+		pthread_cond_broadcast(&scan->cond);
+	}
+
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->lock);
+	return 0;
+}
+
+
+/* run_scan - walk the tree from its root with a pool of threads */
+static int
+run_scan(struct scan *scan) {
+	pthread_t threads[TREE_MAX_THREADS];
+	unsigned n = 0, i;
+	int error;
+
+	while (scan_threads > 1 && n < scan_threads) {
+		error = pthread_create(threads + n, 0, &scan_worker, scan);
+		if (error) {
+			errno = error;
+			log_thread("pthread_create");
+			break;
+		}
+		n++;
+	}
+
+	/* Without any thread, walk from here */
+	if (n == 0)
+		scan_worker(scan);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], 0);
+
+	return scan->error ? -1 : 0;
+}
+
+
+/* dir_matches - whether a change in a directory concerns its entry */
+/*   Without a name, as always with kqueue, any change may concern a path
+ *   matching the glob. */
+static int
+dir_matches(const struct watch_dir *dir, const char *name) {
+	const struct matcher *glob = dir->entry->glob;
+
+	if (!glob || !name)
+		return 1;
+	return match_accepts(glob, match_step(glob, dir->state, name));
+}
+
+
+/* set_trigger - remember the changed path of an entry */
+static void
+set_trigger(struct watch_entry *wentry, const struct watch_dir *dir,
+    const char *name) {
+	char *path = dir_path(dir, name);
+
+	if (!path) return;
+	free(wentry->trigger);
+	wentry->trigger = path;
+}
+
+
+/* free_tree - release the tree structure of an entry, once it is empty */
+static void
+free_tree(struct watch_entry *wentry) {
+	free(wentry->tree->buckets);
+	free(wentry->tree);
+	wentry->tree = 0;
+}
+
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* tree_init - set the number of threads of initial scans, 0 for auto */
+void
+tree_init(unsigned threads) {
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned)cpus : 1;
+	}
+	scan_threads = threads < TREE_MAX_THREADS ? threads : TREE_MAX_THREADS;
+}
+
+
+/* tree_arm - scan the tree of a recursive entry and watch its directories */
+int
+tree_arm(struct evqueue *evq, struct watch_entry *wentry) {
+	struct watch_tree *tree;
+	struct watch_dir *root;
+	struct scan scan;
+	struct rlimit rl;
+
+	/* Every watched directory holds a descriptor */
+	if (!limit_raised) {
+		limit_raised = 1;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0
+		    && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+
+	tree = malloc(sizeof *tree);
+	if (tree)
+		tree->buckets = calloc(TREE_BUCKETS, sizeof *tree->buckets);
+	if (!tree || !tree->buckets) {
+		log_alloc("watched tree");
+		free(tree);
+		return -1;
+	}
+	tree->nbuckets = TREE_BUCKETS;
+	tree->ndirs = 0;
+	wentry->tree = tree;
+
+	/* A glob is rooted at its longest literal directory */
+	root = wentry->glob
+	    ? new_dir(wentry, 0, wentry->glob->base, wentry->glob->base_state)
+	    : new_dir(wentry, 0, wentry->path, MATCH_START);
+	if (!root) {
+		free_tree(wentry);
+		return -1;
+	}
+	link_dir(tree, root);
+	tree->root = root;
+
+	/* Walk and watch the whole tree */
+	memset(&scan, 0, sizeof scan);
+	pthread_mutex_init(&scan.lock, 0);
+	pthread_cond_init(&scan.cond, 0);
+	scan.evq = evq;
+	scan.tree = tree;
+	scan.capacity = 64;
+	scan.dirs = malloc(scan.capacity * sizeof *scan.dirs);
+	if (!scan.dirs) {
+		log_alloc("directory scan");
+		scan.error = 1;
+	}
+	else {
+		scan.dirs[scan.ndirs++] = root;
+		run_scan(&scan);
+	}
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+	free(scan.dirs);
+
+	if (scan.error) {
+		drop_dir(evq, tree, root);
+		free_tree(wentry);
+		return -1;
+	}
+
+	log_tree_armed(wentry, tree->ndirs);
+	return 0;
+}
+
+
+/* tree_release - stop watching all directories of a recursive entry */
+void
+tree_release(struct evqueue *evq, struct watch_entry *wentry) {
+	if (!wentry->tree) return;
+
+	if (wentry->tree->root)
+		drop_dir(evq, wentry->tree, wentry->tree->root);
+	free_tree(wentry);
+}
+
+
+/* tree_event - update the tree after an event on one of its directories */
+struct watch_entry *
+tree_event(struct evqueue *evq, struct watch_dir *dir,
+    const struct evq_event *event) {
+	struct watch_entry *wentry = dir->entry;
+	struct watch_tree *tree = wentry->tree;
+	struct watch_dir *parent = dir->parent;
+	int triggered = (event->events & wentry->events) != 0
+	    && dir_matches(dir, event->name);
+	struct stat st;
+
+	/* Dropped earlier in the batch */
+	if (dir->fd < 0)
+		return 0;
+
+	if (triggered)
+		set_trigger(wentry, dir, event->name);
+
+	/* The directory itself is gone, its parent may know where */
+	if (!event->name
+	    && (event->events & (WEV_DELETE | WEV_RENAME | WEV_REVOKE))) {
+		drop_dir(evq, tree, dir);
+		if (!parent)
+			free_tree(wentry);
+		else if (event->events & WEV_RENAME)
+			rescan_dir(evq, tree, parent);
+		return triggered ? wentry : 0;
+	}
+
+	/* Look for new or removed subdirectories, only when the link count
+	 * may have changed, so that a burst of files costs no directory read */
+	if ((event->events & WEV_LINK)
+	    && (fstat(dir->fd, &st) < 0 || st.st_nlink < 2
+	    || st.st_nlink != dir->nlink))
+		rescan_dir(evq, tree, dir);
+
+	return triggered ? wentry : 0;
+}
+
+
+/* tree_lost - update the whole tree after events have been lost */
+struct watch_entry *
+tree_lost(struct evqueue *evq, struct watch_entry *wentry) {
+	struct watch_tree *tree = wentry->tree;
+	struct stat st;
+
+	if (!tree || !tree->root)
+		return 0;
+	set_trigger(wentry, tree->root, 0);
+
+	/* The root itself may be gone */
+	if (fstat(tree->root->fd, &st) < 0 || st.st_nlink == 0) {
+		drop_dir(evq, tree, tree->root);
+		free_tree(wentry);
+		return wentry;
+	}
+
+	rescan_tree(evq, tree, tree->root);
+	return wentry;
+}
+
+
+/* tree_error - drop a directory whose registration has failed */
+void
+tree_error(struct evqueue *evq, struct watch_dir *dir) {
+	struct watch_entry *wentry = dir->entry;
+
+	if (dir->fd < 0)
+		return;
+
+	if (dir->parent) {
+		char *path = dir_path(dir, 0);
+		log_kevent_entry(path ? path : dir->name);
+		free(path);
+	}
+	else
+		log_kevent_entry(dir->name);
+
+	drop_dir(evq, wentry->tree, dir);
+	if (!wentry->tree->root)
+		free_tree(wentry);
+}
+
+
+/* tree_gc - free directories dropped while handling the last batch */
+void
+tree_gc(void) {
+	struct watch_dir *dir;
+
+	while ((dir = dropped) != 0) {
+		dropped = dir->hnext;
+		free(dir);
+	}
+}
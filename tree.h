@@ -0,0 +1,108 @@
+/* tree.h - recursive watch of directory trees */
+
+/*
+ * Copyright (c) 2013, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A recursive entry registers every directory below its path, and no
+ * regular file: a directory reports entries being added or removed, and
+ * on Linux also the name of the changed entry, which becomes TRIGGER.
+ *
+ * A glob entry is a tree rooted at the literal directory before its first
+ * wildcard, keeping only the subdirectories where the pattern can still
+ * match, and triggered only by names it accepts.
+ *
+ * Directories are watched for good with persistent registrations, whether
+ * or not the entry can take another trigger, so that no event is lost
+ * between two batches and new subdirectories are always picked up.
+ */
+
+#ifndef FILEWATCHER_TREE_H
+#define FILEWATCHER_TREE_H
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "evqueue.h"
+#include "watchtab.h"
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct watch_dir - a watched directory of a recursive or glob entry */
+struct watch_dir {
+	int		node;		/* WNODE_DIR */
+	int		fd;		/* open directory, or -1 once dropped */
+	struct watch_entry *entry;	/* recursive entry owning the tree */
+	struct watch_dir *parent;	/* containing directory, null for root */
+	LIST_HEAD(, watch_dir) children;/* watched subdirectories */
+	LIST_ENTRY(watch_dir) sibling;
+	struct watch_dir *hnext;	/* hash chain, or list of dropped ones */
+	nlink_t		nlink;		/* link count when last scanned */
+	unsigned	mark;		/* seen by the current rescan */
+	unsigned	state;		/* glob matcher state after the path */
+	char		name[];		/* entry name, full path for the root */
+};
+
+/* struct watch_tree - directories of a recursive entry */
+struct watch_tree {
+	struct watch_dir *root;		/* directory at the entry path */
+	struct watch_dir **buckets;	/* hash table on parent and name */
+	size_t		nbuckets;	/* number of buckets, a power of 2 */
+	size_t		ndirs;		/* number of watched directories */
+};
+
+
+/********************
+ * PUBLIC INTERFACE *
+ ********************/
+
+/* tree_init - set the number of threads of initial scans, 0 for auto */
+void
+tree_init(unsigned threads);
+
+/* tree_arm - scan the tree of a recursive entry and watch its directories */
+int
+tree_arm(struct evqueue *evq, struct watch_entry *wentry);
+
+/* tree_release - stop watching all directories of a recursive entry */
+void
+tree_release(struct evqueue *evq, struct watch_entry *wentry);
+
+/* tree_event - update the tree after an event on one of its directories */
+/*   Return the entry when the event is one it watches, after having
+ *   recorded the changed path in its trigger, or null otherwise. */
+struct watch_entry *
+tree_event(struct evqueue *evq, struct watch_dir *dir,
+    const struct evq_event *event);
+
+/* tree_lost - update the whole tree after events have been lost */
+/*   Every directory is read again, and the entry is returned with its
+ *   trigger set to the root, since which files have changed is unknown. */
+struct watch_entry *
+tree_lost(struct evqueue *evq, struct watch_entry *wentry);
+
+/* tree_error - drop a directory whose registration has failed */
+void
+tree_error(struct evqueue *evq, struct watch_dir *dir);
+
+/* tree_gc - free directories dropped while handling the last batch */
+void
+tree_gc(void);
+
+#endif /* ndef FILEWATCHER_TREE_H */
@@ -19,106 +19,814 @@
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/event.h>
 
 #include "log.h"
+#include "match.h"
 #include "watchtab.h"
 
 /* number of pointers allocated at once in watch_env */
 #define WENV_ALLOC_UNIT 16;
 
+/* smallest chunk allocated in a watchtab arena */
+#define ARENA_MIN_CHUNK 65536
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct arena_chunk - block of memory carved by a watchtab arena */
+struct arena_chunk {
+	struct arena_chunk *prev;	/* chunk filled before this one */
+	char		data[];
+};
+
+/* struct wtab_arena - strings of the entries of a watchtab generation */
+/*   Strings are never freed on their own, but all at once when the last
+ *   entry using the arena is released. */
+struct wtab_arena {
+	unsigned	refs;		/* entries using the arena */
+	struct arena_chunk *chunk;	/* current chunk, or null */
+	size_t		used;		/* bytes taken in the current chunk */
+	size_t		size;		/* bytes available in the current chunk */
+	size_t		next_size;	/* size of the next chunk */
+};
+
+/* struct id_record - outcome of a user or group lookup */
+struct id_record {
+	uint64_t	hash;		/* of kind and key */
+	char		kind;		/* 'u'ser, 'g'roup or 's'elf */
+	int		error;		/* errno of a failed lookup, or -1 */
+	uid_t		uid;		/* of a user */
+	gid_t		gid;		/* of a group, or primary group of a user */
+	char		*name;		/* login of a user */
+	char		*home;		/* home directory of a user */
+	char		key[];		/* user or group field of the watchtab */
+};
+
+/* struct wtab_load - state of a watchtab being parsed */
+struct wtab_load {
+	struct wtab_arena *arena;	/* strings of the new entries */
+	struct id_record **ids;		/* open-addressing table of lookups */
+	size_t		id_count;	/* records in the table */
+	size_t		id_mask;	/* table size minus one */
+	struct wtab_lookups lookups;	/* cache hits, misses and time */
+	const struct id_record *owner;	/* user forced on entries, or null */
+};
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* envp_buf - environment array assembled by wentry_envp() */
+static char **envp_buf = 0;
+static size_t envp_cap = 0;
+
+/* trigger_buf - TRIGGER variable assembled by wentry_envp() */
+static char *trigger_buf = 0;
+static size_t trigger_cap = 0;
+
+
+
 /*********************
  * LOCAL SUBPROGRAMS *
  *********************/
 
-/* parse_events - process a configuration string into fflags vnode events */
+/* event_name - look up a lowercase event name */
+/*   Return its WEV_* flag, or 0 when the name is unknown. */
+static u_int
+event_name(const char *name, size_t len) {
+	const char *ref;
+	u_int flag;
+
+	switch (len) {
+	    case 4:
+		ref = "link", flag = WEV_LINK;
+		break;
+	    case 5:
+		ref = "write", flag = WEV_WRITE;
+		break;
+	    case 6:
+		switch (name[0]) {
+		    case 'a':
+			ref = "attrib", flag = WEV_ATTRIB;
+			break;
+		    case 'd':
+			ref = "delete", flag = WEV_DELETE;
+			break;
+		    case 'e':
+			ref = "extend", flag = WEV_EXTEND;
+			break;
+		    case 'r':
+			if (name[2] == 'n')
+				ref = "rename", flag = WEV_RENAME;
+			else
+				ref = "revoke", flag = WEV_REVOKE;
+			break;
+		    default:
+			return 0;
+		}
+		break;
+	    default:
+		return 0;
+	}
+
+	return memcmp(name, ref, len) == 0 ? flag : 0;
+}
+
+
+/* parse_events - process a configuration string into WEV_* events */
+/*   Names are all lowercase or all uppercase, separated by one byte. */
 static u_int
 parse_events(const char *line, size_t len) {
-	u_int result = 0;
-	size_t i = 0;
+	char name[8];
+	u_int result = 0, flag;
+	size_t i = 0, n;
+	int lower, upper;
 
 	/* Check wildcard */
 	if (len == 1 && line[0] == '*')
-		return NOTE_DELETE | NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB
-		    | NOTE_LINK | NOTE_RENAME | NOTE_REVOKE;
+		return WEV_ALL;
 
-	/*
-	 * Parse entry as a list of token separated by a single
-	 * non-letter byte.
-	 */
 	while (i < len) {
-		if (strncmp(line + i, "delete", 6) == 0
-		    || strncmp(line + i, "DELETE", 6) == 0) {
-			result |= NOTE_DELETE;
-			i += 6;
-		}
-		else if (strncmp(line + i, "write", 5) == 0
-		    || strncmp(line + i, "WRITE", 5) == 0) {
-			result |= NOTE_WRITE;
-			i += 5;
-		}
-		else if (strncmp(line + i, "extend", 6) == 0
-		    || strncmp(line + i, "EXTEND", 6) == 0) {
-			result |= NOTE_EXTEND;
-			i += 6;
-		}
-		else if (strncmp(line + i, "attrib", 6) == 0
-		    || strncmp(line + i, "ATTRIB", 6) == 0) {
-			result |= NOTE_ATTRIB;
-			i += 6;
+		/* Fold the next word into lowercase */
+		n = lower = upper = 0;
+		while (i < len && ((line[i] >= 'a' && line[i] <= 'z')
+		    || (line[i] >= 'A' && line[i] <= 'Z'))) {
+			if (n == sizeof name)
+				return 0;
+			if (line[i] >= 'a') {
+				name[n++] = line[i];
+				lower = 1;
+			}
+			else {
+				name[n++] = line[i] - 'A' + 'a';
+				upper = 1;
+			}
+			i++;
 		}
-		else if (strncmp(line + i, "link", 4) == 0
-		    || strncmp(line + i, "LINK", 4) == 0) {
-			result |= NOTE_LINK;
-			i += 4;
+
+		flag = lower && upper ? 0 : event_name(name, n);
+		if (!flag)
+			return 0;
+		result |= flag;
+		i++;
+	}
+
+	return result;
+}
+
+
+/* options_offset - find where entry options start in an events field */
+/*   Options are name=value words, which event names never are. */
+static size_t
+options_offset(const char *line, size_t len) {
+	size_t i = 0, word;
+
+	while (i < len) {
+		word = i;
+		while (i < len && ((line[i] >= 'a' && line[i] <= 'z')
+		    || (line[i] >= 'A' && line[i] <= 'Z') || line[i] == '_'))
+			i++;
+		if (i > word && i < len && line[i] == '=')
+			return word;
+		i++;
+	}
+
+	return len;
+}
+
+
+/* parse_count - decode an option value made of decimal digits */
+/*   Return 0 on success or -1 when the value is not a plain number. */
+static int
+parse_count(const char *value, size_t len, unsigned *dest) {
+	unsigned long result = 0;
+	size_t i;
+
+	if (len == 0 || len > 9)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		result = result * 10 + (value[i] - '0');
+	}
+
+	*dest = (unsigned)result;
+	return 0;
+}
+
+
+/* parse_priority - decode a scheduling class name */
+static int
+parse_priority(const char *value, size_t len, unsigned *dest) {
+	if (len == 4 && strncmp(value, "high", 4) == 0)
+		*dest = WPRIO_HIGH;
+	else if (len == 6 && strncmp(value, "normal", 6) == 0)
+		*dest = WPRIO_NORMAL;
+	else if (len == 3 && strncmp(value, "low", 3) == 0)
+		*dest = WPRIO_LOW;
+	else
+		return -1;
+	return 0;
+}
+
+
+/* parse_bool - decode a yes or no option value */
+static int
+parse_bool(const char *value, size_t len, int *dest) {
+	if (len == 3 && strncmp(value, "yes", 3) == 0)
+		*dest = 1;
+	else if (len == 2 && strncmp(value, "no", 2) == 0)
+		*dest = 0;
+	else
+		return -1;
+	return 0;
+}
+
+
+/* parse_persist - decode the persistence of a file watch */
+static int
+parse_persist(const char *value, size_t len, int *dest) {
+	if (len == 2 && strncmp(value, "no", 2) == 0)
+		*dest = WPERSIST_NONE;
+	else if (len == 4 && strncmp(value, "path", 4) == 0)
+		*dest = WPERSIST_PATH;
+	else if (len == 5 && strncmp(value, "inode", 5) == 0)
+		*dest = WPERSIST_INODE;
+	else
+		return -1;
+	return 0;
+}
+
+
+/* parse_options - process comma or semicolon separated entry options */
+/*   Return 0 on success, or -1 after logging the offending option. */
+static int
+parse_options(struct watch_entry *dest, const char *line, size_t len,
+    const char *filename, unsigned line_no) {
+	size_t i = 0, name, name_len, value, value_len;
+	int valid;
+
+	while (i < len) {
+		name = i;
+		while (i < len && line[i] != '=' && line[i] != ','
+		    && line[i] != ';')
+			i++;
+		name_len = i - name;
+		value = value_len = 0;
+		if (i < len && line[i] == '=') {
+			value = ++i;
+			while (i < len && line[i] != ',' && line[i] != ';')
+				i++;
+			value_len = i - value;
 		}
-		else if (strncmp(line + i, "rename", 6) == 0
-		    || strncmp(line + i, "RENAME", 6) == 0) {
-			result |= NOTE_RENAME;
-			i += 6;
+
+		if (name_len == 11
+		    && strncmp(line + name, "concurrency", 11) == 0)
+			valid = parse_count(line + value, value_len,
+			    &dest->max_concurrency) == 0
+			    && dest->max_concurrency > 0;
+		else if (name_len == 5
+		    && strncmp(line + name, "queue", 5) == 0)
+			valid = parse_count(line + value, value_len,
+			    &dest->max_queue) == 0;
+		else if (name_len == 8
+		    && strncmp(line + name, "priority", 8) == 0)
+			valid = parse_priority(line + value, value_len,
+			    &dest->priority) == 0;
+		else if (name_len == 6
+		    && strncmp(line + name, "output", 6) == 0)
+			valid = parse_count(line + value, value_len,
+			    &dest->max_output) == 0;
+		else if (name_len == 9
+		    && strncmp(line + name, "recursive", 9) == 0)
+			valid = parse_bool(line + value, value_len,
+			    &dest->recursive) == 0;
+		else if (name_len == 7
+		    && strncmp(line + name, "persist", 7) == 0)
+			valid = parse_persist(line + value, value_len,
+			    &dest->persist) == 0;
+		else
+			valid = 0;
+
+		if (!valid) {
+			log_watchtab_invalid_option(filename, line_no,
+			    line + name, i - name);
+			return -1;
 		}
-		else if (strncmp(line + i, "revoke", 6) == 0
-		    || strncmp(line + i, "REVOKE", 6) == 0) {
-			result |= NOTE_REVOKE;
-			i += 6;
+		i++;
+	}
+
+	return 0;
+}
+
+
+/* parse_time - decode a number of seconds with optional decimals */
+/*   Return a pointer to the first byte after the number. */
+static char *
+parse_time(char *line, struct timespec *dest) {
+	char *s;
+
+	/* Decode integer part */
+	dest->tv_sec = strtol(line, &s, 10);
+
+	/* Decode fractional part if any */
+	if (*s == '.') {
+		char *ns;
+		dest->tv_nsec = strtol(s + 1, &ns, 10);
+		while (ns - s <= 9) {
+			dest->tv_nsec *= 10;
+			s--;
 		}
-		else return 0;
+		s = ns;
+	}
 
-		if (i < len && ((line[i] >= 'a' && line[i] <= 'z')
-		    || (line[i] >= 'A' && line[i] <= 'Z')))
-			return 0;
-		else
-			i++;
+	return s;
+}
+
+
+/* field_end - find the first unescaped tabulation or the end of a line */
+/*   The search relies on strcspn(), which the C library vectorizes. */
+static size_t
+field_end(const char *line, size_t i) {
+	i += strcspn(line + i, "\t");
+	while (line[i] == '\t' && i > 0 && line[i-1] == '\\')
+		i += 1 + strcspn(line + i + 1, "\t");
+	return i;
+}
+
+
+/* arena_new - create an empty arena, the first chunk taking hint bytes */
+static struct wtab_arena *
+arena_new(size_t hint) {
+	struct wtab_arena *arena = malloc(sizeof *arena);
+
+	if (!arena) {
+		log_alloc("watchtab arena");
+		return 0;
 	}
 
-	return result;
+	arena->refs = 0;
+	arena->chunk = 0;
+	arena->used = arena->size = 0;
+	arena->next_size = hint > ARENA_MIN_CHUNK ? hint : ARENA_MIN_CHUNK;
+	return arena;
 }
 
 
-/* strdupesc - duplicate and unescape an input string */
+/* arena_alloc - carve bytes from an arena, adding a chunk when needed */
 static char *
-strdupesc(const char *src, size_t len) {
-	size_t s = 0, d = 0;
-	char *dest = malloc(len + 1);
+arena_alloc(struct wtab_arena *arena, size_t len) {
+	struct arena_chunk *chunk;
+	size_t size;
 
-	if (!dest) {
-		log_alloc("watchtab entry internal string");
+	if (arena->chunk && arena->size - arena->used >= len) {
+		arena->used += len;
+		return arena->chunk->data + (arena->used - len);
+	}
+
+	/* Chunks double in size, so that a watchtab takes a few of them */
+	size = arena->next_size;
+	while (size < len) size *= 2;
+	chunk = malloc(sizeof *chunk + size);
+	if (!chunk) {
+		log_alloc("watchtab arena chunk");
 		return 0;
 	}
 
-	while (src[s] && s < len) {
-		if (src[s] != '\\' || (s > 0 && src[s-1] == '\\'))
-			dest[d++] = src[s];
+	chunk->prev = arena->chunk;
+	arena->chunk = chunk;
+	arena->size = size;
+	arena->used = len;
+	arena->next_size = size * 2;
+	return chunk->data;
+}
+
+
+/* arena_unref - drop a reference, freeing the arena after the last one */
+static void
+arena_unref(struct wtab_arena *arena) {
+	struct arena_chunk *chunk;
+
+	if (!arena || --arena->refs > 0)
+		return;
+
+	while ((chunk = arena->chunk) != 0) {
+		arena->chunk = chunk->prev;
+		free(chunk);
+	}
+	free(arena);
+}
+
+
+/* strdupesc - duplicate and unescape an input string into an arena */
+/*   A backslash is dropped, unless it follows another backslash. */
+static char *
+strdupesc(struct wtab_arena *arena, const char *src, size_t len) {
+	size_t s = 0, d = 0, run;
+	char *dest = arena_alloc(arena, len + 1);
+	const char *esc;
+
+	if (!dest)
+		return 0;
+
+	/* Copy runs between backslashes at once */
+	while (s < len) {
+		esc = memchr(src + s, '\\', len - s);
+		run = esc ? (size_t)(esc - src) - s : len - s;
+		memcpy(dest + d, src + s, run);
+		d += run;
+		s += run;
+		if (!esc)
+			break;
+		if (s > 0 && src[s-1] == '\\')
+			dest[d++] = '\\';
 		s++;
 	}
 	dest[d] = 0;
 	return dest;
 }
 
+
+/* read_all - read a whole file into a NUL-terminated buffer */
+/*   Return the buffer and its length in size, or 0 after logging. */
+static char *
+read_all(int fd, size_t *size) {
+	struct stat st;
+	size_t cap, len = 0;
+	ssize_t ret;
+	char *buf, *grown;
+
+	/* Room for the expected size, the end of file and a terminator */
+	cap = fstat(fd, &st) == 0 && st.st_size > 0
+	    ? (size_t)st.st_size + 2 : 4096;
+	buf = malloc(cap);
+	if (!buf) {
+		log_alloc("watchtab contents");
+		return 0;
+	}
+
+	while ((ret = read(fd, buf + len, cap - len - 1)) != 0) {
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			log_watchtab_read();
+			free(buf);
+			return 0;
+		}
+
+		len += ret;
+		if (len + 1 == cap) {
+			grown = realloc(buf, cap * 2);
+			if (!grown) {
+				log_alloc("watchtab contents");
+				free(buf);
+				return 0;
+			}
+			buf = grown;
+			cap *= 2;
+		}
+	}
+
+	buf[len] = 0;
+	*size = len;
+	return buf;
+}
+
+
+/* user_env - build the variables set for each entry */
+/*   Return LOGNAME, USER and HOME as three consecutive strings, or 0. */
+static char *
+user_env(struct wtab_arena *arena, const char *login, const char *home) {
+	char *result, *s;
+
+	result = arena_alloc(arena, 2 * strlen(login) + strlen(home) + 21);
+	if (!result)
+		return 0;
+
+	s = result;
+	s += sprintf(s, "LOGNAME=%s", login) + 1;
+	s += sprintf(s, "USER=%s", login) + 1;
+	sprintf(s, "HOME=%s", home);
+	return result;
+}
+
+
+/* entry_var - check whether an environment string is set by each entry */
+static int
+entry_var(const char *str) {
+	static const char *const names[] = {
+	    "LOGNAME=", "USER=", "HOME=", "TRIGGER=" };
+	size_t i;
+
+	for (i = 0; i < sizeof names / sizeof names[0]; i++)
+		if (strncmp(str, names[i], strlen(names[i])) == 0)
+			return 1;
+	return 0;
+}
+
+
+/* hash_str - FNV-1a hash of a string, continuing from a previous hash */
+static uint64_t
+hash_str(uint64_t hash, const char *str) {
+	if (!str) return hash * 0x100000001b3ULL;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	/* hash the terminator too, so that field boundaries matter */
+	return hash * 0x100000001b3ULL;
+}
+
+
+/* id_new - record the outcome of a system lookup */
+/*   Return the record, or 0 after logging an allocation failure. */
+static struct id_record *
+id_new(char kind, const char *key, uint64_t hash,
+    const struct passwd *pw, const struct group *grp) {
+	size_t key_len = strlen(key) + 1, name_len = 0, home_len = 0;
+	struct id_record *rec;
+
+	if (pw) {
+		name_len = strlen(pw->pw_name) + 1;
+		home_len = strlen(pw->pw_dir) + 1;
+	}
+	rec = malloc(sizeof *rec + key_len + name_len + home_len);
+	if (!rec) {
+		log_alloc("user lookup cache");
+		return 0;
+	}
+
+	rec->hash = hash;
+	rec->kind = kind;
+	rec->error = (pw || grp) ? -1 : errno;
+	rec->uid = pw ? pw->pw_uid : 0;
+	rec->gid = pw ? pw->pw_gid : (grp ? grp->gr_gid : 0);
+	memcpy(rec->key, key, key_len);
+	rec->name = rec->home = 0;
+	if (pw) {
+		rec->name = rec->key + key_len;
+		memcpy(rec->name, pw->pw_name, name_len);
+		rec->home = rec->name + name_len;
+		memcpy(rec->home, pw->pw_dir, home_len);
+	}
+	return rec;
+}
+
+
+/* lookup_id - resolve a user, a group or the daemon's own user */
+/*
+ * Outcomes are kept for the whole load, failures included, so that the
+ * system is asked once for each distinct spelling. Return the record,
+ * with errno set to its error when the lookup failed, or 0 when the
+ * record cannot be allocated.
+ */
+static const struct id_record *
+lookup_id(struct wtab_load *load, char kind, const char *key) {
+	struct id_record **ids, *rec;
+	const struct passwd *pw = 0;
+	const struct group *grp = 0;
+	struct timespec start, end;
+	uint64_t hash;
+	size_t i, j;
+	char *login;
+
+	hash = hash_str((uint64_t)kind * 0x100000001b3ULL, key);
+	for (i = hash & load->id_mask; load->ids[i];
+	    i = (i + 1) & load->id_mask) {
+		rec = load->ids[i];
+		if (rec->hash == hash && rec->kind == kind
+		    && strcmp(rec->key, key) == 0) {
+			load->lookups.hits++;
+			errno = rec->error >= 0 ? rec->error : 0;
+			return rec;
+		}
+	}
+
+	/* Ask the system, numeric fields being ids */
+	load->lookups.misses++;
+	for (j = 0; key[j] >= '0' && key[j] <= '9'; j++);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	errno = 0;
+	if (kind == 'g')
+		grp = key[j] ? getgrnam(key) : getgrgid(strtol(key, 0, 10));
+	else if (kind == 'u')
+		pw = key[j] ? getpwnam(key) : getpwuid(strtol(key, 0, 10));
+	else {
+		login = getlogin();
+		pw = login ? getpwnam(login) : 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	load->lookups.time_ns += (uint64_t)(end.tv_sec - start.tv_sec)
+	    * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+	rec = id_new(kind, key, hash, pw, grp);
+	if (!rec)
+		return 0;
+	load->ids[i] = rec;
+	load->id_count++;
+
+	/* Keep the table at most half full */
+	if (load->id_count * 2 > load->id_mask) {
+		ids = calloc((load->id_mask + 1) * 2, sizeof *ids);
+		if (!ids) {
+			log_alloc("user lookup cache");
+			return rec;
+		}
+		for (i = 0; i <= load->id_mask; i++) {
+			if (!load->ids[i]) continue;
+			for (j = load->ids[i]->hash & (load->id_mask * 2 + 1);
+			    ids[j]; j = (j + 1) & (load->id_mask * 2 + 1));
+			ids[j] = load->ids[i];
+		}
+		free(load->ids);
+		load->ids = ids;
+		load->id_mask = load->id_mask * 2 + 1;
+	}
+
+	errno = rec->error >= 0 ? rec->error : 0;
+	return rec;
+}
+
+
+/* load_init - prepare the arena and the lookup cache of a load */
+/*   size is the length of the file, which strings mostly fit in. */
+static int
+load_init(struct wtab_load *load, size_t size) {
+	load->arena = arena_new(size);
+	if (!load->arena)
+		return -1;
+	load->arena->refs++;
+
+	load->id_count = 0;
+	load->id_mask = 15;
+	load->ids = calloc(load->id_mask + 1, sizeof *load->ids);
+	if (!load->ids) {
+		log_alloc("user lookup cache");
+		arena_unref(load->arena);
+		return -1;
+	}
+
+	load->lookups.hits = load->lookups.misses = 0;
+	load->lookups.time_ns = 0;
+	load->owner = 0;
+	return 0;
+}
+
+
+/* load_release - free the lookup cache and release the arena */
+/*   The arena lives on as long as entries use it. */
+static void
+load_release(struct wtab_load *load) {
+	size_t i;
+
+	for (i = 0; i <= load->id_mask; i++)
+		free(load->ids[i]);
+	free(load->ids);
+	arena_unref(load->arena);
+}
+
+
+/* wentry_hash - hash configuration fields of an entry */
+static uint64_t
+wentry_hash(const struct watch_entry *wentry) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	hash = hash_str(hash, wentry->path);
+	hash = hash_str(hash, wentry->chroot);
+	hash = hash_str(hash, wentry->command);
+	hash ^= wentry->events;
+	hash *= 0x100000001b3ULL;
+	hash ^= (uint64_t)wentry->delay.tv_sec << 30 ^ wentry->delay.tv_nsec;
+	hash *= 0x100000001b3ULL;
+	hash ^= (uint64_t)wentry->max_wait.tv_sec << 30
+	    ^ wentry->max_wait.tv_nsec ^ (uint64_t)wentry->debounce << 62;
+	hash *= 0x100000001b3ULL;
+	hash ^= (uint64_t)wentry->uid << 32 ^ wentry->gid
+	    ^ (uint64_t)wentry->owned << 31;
+	hash *= 0x100000001b3ULL;
+	hash ^= (uint64_t)wentry->max_concurrency << 32 ^ wentry->max_queue
+	    ^ (uint64_t)wentry->priority << 60
+	    ^ (uint64_t)wentry->recursive << 63;
+	hash *= 0x100000001b3ULL;
+	hash ^= wentry->max_output ^ (uint64_t)wentry->persist << 32;
+	hash *= 0x100000001b3ULL;
+	for (i = 0; wentry->env && wentry->env->environ[i]; i++)
+		hash = hash_str(hash, wentry->env->environ[i]);
+	hash = hash_str(hash, wentry->user_env);
+
+	return hash;
+}
+
+
+/* str_equal - compare strings that may be null */
+static int
+str_equal(const char *a, const char *b) {
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+
+/* user_env_equal - compare the variables of two entries, that may be null */
+static int
+user_env_equal(const char *a, const char *b) {
+	int i;
+
+	if (!a || !b)
+		return a == b;
+	for (i = 0; i < 3; i++) {
+		if (strcmp(a, b) != 0)
+			return 0;
+		a += strlen(a) + 1;
+		b += strlen(b) + 1;
+	}
+	return 1;
+}
+
+
+/* wentry_equal - compare configuration fields of two entries */
+static int
+wentry_equal(const struct watch_entry *a, const struct watch_entry *b) {
+	size_t i;
+
+	if (a->events != b->events
+	    || a->delay.tv_sec != b->delay.tv_sec
+	    || a->delay.tv_nsec != b->delay.tv_nsec
+	    || a->max_wait.tv_sec != b->max_wait.tv_sec
+	    || a->max_wait.tv_nsec != b->max_wait.tv_nsec
+	    || a->debounce != b->debounce
+	    || a->max_concurrency != b->max_concurrency
+	    || a->max_queue != b->max_queue
+	    || a->priority != b->priority
+	    || a->recursive != b->recursive
+	    || a->persist != b->persist
+	    || a->max_output != b->max_output
+	    || a->uid != b->uid
+	    || a->gid != b->gid
+	    || a->owned != b->owned
+	    || !str_equal(a->path, b->path)
+	    || !str_equal(a->chroot, b->chroot)
+	    || !str_equal(a->command, b->command))
+		return 0;
+
+	if (!user_env_equal(a->user_env, b->user_env))
+		return 0;
+	if (a->env == b->env)
+		return 1;
+	if (!a->env || !b->env || a->env->size != b->env->size)
+		return 0;
+	for (i = 0; i < a->env->size; i++)
+		if (strcmp(a->env->environ[i], b->env->environ[i]) != 0)
+			return 0;
+	return 1;
+}
+
+
+/* wentry_adopt - swap the strings of two entries with equal fields */
+/*
+ * A kept entry takes the strings of its parsed counterpart, so that the
+ * arena of the previous watchtab is freed once the entries it no longer
+ * has are gone, instead of lasting as long as the oldest kept entry.
+ */
+static void
+wentry_adopt(struct watch_entry *kept, struct watch_entry *parsed) {
+	struct watch_entry tmp;
+
+	tmp.path = kept->path;
+	tmp.chroot = kept->chroot;
+	tmp.command = kept->command;
+	tmp.env = kept->env;
+	tmp.user_env = kept->user_env;
+	tmp.arena = kept->arena;
+
+	kept->path = parsed->path;
+	kept->chroot = parsed->chroot;
+	kept->command = parsed->command;
+	kept->env = parsed->env;
+	kept->user_env = parsed->user_env;
+	kept->arena = parsed->arena;
+
+	parsed->path = tmp.path;
+	parsed->chroot = tmp.chroot;
+	parsed->command = tmp.command;
+	parsed->env = tmp.env;
+	parsed->user_env = tmp.user_env;
+	parsed->arena = tmp.arena;
+}
+
+
 /* wenv_resize - preallocate enough storage for new_size pointers */
 static int
 wenv_resize(struct watch_env *wenv, size_t new_size) {
@@ -152,6 +860,27 @@ wenv_resize(struct watch_env *wenv, size_t new_size) {
 }
 
 
+/* owner_allows - whether permission bits grant access to an entry owner */
+/*   The command of an owned entry runs with the primary group of the
+ *   owner as only group, so that uid and gid are all there is to check.
+ *   mode is a combination of R_OK and X_OK. */
+static int
+owner_allows(const struct watch_entry *wentry, const struct stat *st,
+    int mode) {
+	mode_t bits = 0;
+
+	if (mode & R_OK)
+		bits |= S_IROTH;
+	if (mode & X_OK)
+		bits |= S_IXOTH;
+	if (st->st_uid == wentry->uid)
+		bits <<= 6;
+	else if (st->st_gid == wentry->gid)
+		bits <<= 3;
+	return (st->st_mode & bits) == bits;
+}
+
+
 
 /********************
  * PUBLIC INTERFACE *
@@ -162,16 +891,46 @@ void
 wentry_init(struct watch_entry *wentry) {
 	if (!wentry) return;
 
+	wentry->node = WNODE_ENTRY;
 	wentry->path = 0;
 	wentry->events = 0;
 	wentry->delay.tv_sec = 0;
 	wentry->delay.tv_nsec = 0;
+	wentry->max_wait.tv_sec = 0;
+	wentry->max_wait.tv_nsec = 0;
+	wentry->debounce = 0;
+	wentry->max_concurrency = 1;
+	wentry->max_queue = 0;
+	wentry->priority = WPRIO_NORMAL;
+	wentry->max_output = WOUTPUT_LIMIT;
+	wentry->recursive = 0;
+	wentry->persist = WPERSIST_NONE;
+	wentry->glob = 0;
 	wentry->uid = 0;
 	wentry->gid = 0;
+	wentry->owned = 0;
 	wentry->chroot = 0;
 	wentry->command = 0;
-	wentry->envp = 0;
-	wentry->fd = -1;
+	wentry->env = 0;
+	wentry->user_env = 0;
+	wentry->arena = 0;
+	wentry->file = 0;
+	wentry->ancestor = 0;
+	wentry->snap.valid = 0;
+	wentry->caught = 0;
+	wentry->fired = 0;
+	wentry->tree = 0;
+	wentry->trigger = 0;
+	wentry->running = 0;
+	wentry->queued = 0;
+	wentry->ready = 0;
+	wentry->removed = 0;
+	wentry->timer.index = 0;
+	wentry->stats = 0;
+	wentry->pending_since = 0;
+	wentry->trace_next = 0;
+	wentry->trace_runs = 0;
+	wentry->trace_id = 0;
 }
 
 
@@ -180,24 +939,32 @@ void
 wentry_release(struct watch_entry *wentry) {
 	if (!wentry) return;
 
-	free((void *)(wentry->path));
-	free((void *)(wentry->chroot));
-	free((void *)(wentry->command));
+	/* Strings of a watchtab entry go away with its arena */
+	if (wentry->arena)
+		arena_unref(wentry->arena);
+	else {
+		free((void *)(wentry->path));
+		free((void *)(wentry->chroot));
+		free((void *)(wentry->command));
+		free(wentry->user_env);
+	}
+	wentry->arena = 0;
 	wentry->path = 0;
 	wentry->chroot = 0;
 	wentry->command = 0;
 
-	if (wentry->envp) {
-		size_t i = 0;
-		while (wentry->envp[i])
-			free(wentry->envp[i++]);
-		free(wentry->envp);
-	}
-	wentry->envp = 0;
+	match_free(wentry->glob);
+	wentry->glob = 0;
+
+	wenv_unshare(wentry->env);
+	wentry->env = 0;
+	wentry->user_env = 0;
+
+	free(wentry->trigger);
+	wentry->trigger = 0;
 
-	if (wentry->fd != -1)
-		close(wentry->fd);
-	wentry->fd = -1;
+	free(wentry->trace_next);
+	wentry->trace_next = 0;
 }
 
 
@@ -215,47 +982,48 @@ wentry_free(struct watch_entry *wentry) {
 /*   Return 0 on success or -1 on failure. */
 int
 wentry_readline(struct watch_entry *dest, char *line,
-    struct watch_env *base_env, int has_home,
+    struct watch_env *base_env, int has_home, struct wtab_load *load,
     const char *filename, unsigned line_no) {
 	size_t path_len = 0;
-	size_t event_first = 0, event_len = 0;
+	size_t event_first = 0, event_len = 0, options_first;
 	size_t delay_first = 0, delay_len = 0;
 	size_t user_first = 0, user_len = 0;
 	size_t chroot_first = 0, chroot_len = 0;
 	size_t cmd_first = 0, cmd_len = 0;
-	struct passwd *pw = 0;
-	struct group *grp = 0;
-	size_t i = 1;
+	const struct id_record *pw = 0;
+	const struct id_record *grp = 0;
+	struct wtab_arena *arena;
+	struct matcher *glob;
+	const char *home;
+	size_t i;
 
 	/* Sanity checks */
-	if (!line || line[0] == 0 || line[0] == '\t') {
+	if (!line || line[0] == 0 || line[0] == '\t' || !load) {
 		LOG_ASSERT(0);
 		return -1;
 	}
 
 	/* Look for fields boundaries */
-	while (line[i] != 0 && (line[i] != '\t' || line[i-1] == '\\')) i++;
-	path_len = i;
+	i = path_len = field_end(line, 1);
 	while (line[i] == '\t') i++;
 	event_first = i;
-	while (line[i] != 0 && (line[i] != '\t' || line[i-1] == '\\')) i++;
+	i = field_end(line, i);
 	event_len = i - event_first;
 	while (line[i] == '\t') i++;
 	delay_first = i;
-	while (line[i] != 0 && (line[i] != '\t' || line[i-1] == '\\')) i++;
+	i = field_end(line, i);
 	delay_len = i - delay_first;
 	while (line[i] == '\t') i++;
 	user_first = i;
-	while (line[i] != 0 && (line[i] != '\t' || line[i-1] == '\\')) i++;
+	i = field_end(line, i);
 	user_len = i - user_first;
 	while (line[i] == '\t') i++;
 	chroot_first = i;
-	while (line[i] != 0 && (line[i] != '\t' || line[i-1] == '\\')) i++;
+	i = field_end(line, i);
 	chroot_len = i - chroot_first;
 	while (line[i] == '\t') i++;
 	cmd_first = i;
-	while (line[i] != 0) i++;
-	cmd_len = i - cmd_first;
+	cmd_len = strlen(line + i);
 
 	/* Less than 3 fields found is a parse error */
 	if (line[delay_first] == 0) {
@@ -285,6 +1053,21 @@ wentry_readline(struct watch_entry *dest, char *line,
 		chroot_first = chroot_len = 0;
 	}
 
+	/* Split options from the event set */
+	dest->max_concurrency = 1;
+	dest->max_queue = 0;
+	dest->priority = WPRIO_NORMAL;
+	dest->max_output = WOUTPUT_LIMIT;
+	dest->recursive = 0;
+	dest->persist = WPERSIST_NONE;
+	options_first = options_offset(line + event_first, event_len);
+	if (options_first < event_len) {
+		if (parse_options(dest, line + event_first + options_first,
+		    event_len - options_first, filename, line_no) < 0)
+			return -1;
+		event_len = options_first ? options_first - 1 : 0;
+	}
+
 	/* Parse event set */
 	dest->events = parse_events(line + event_first, event_len);
 	if (dest->events == 0) {
@@ -293,26 +1076,24 @@ wentry_readline(struct watch_entry *dest, char *line,
 		return -1;
 	}
 
-	/* Parse delay */
+	/* Parse delay, or debounce window and optional cap */
 	dest->delay.tv_sec = 0;
 	dest->delay.tv_nsec = 0;
+	dest->max_wait.tv_sec = 0;
+	dest->max_wait.tv_nsec = 0;
+	dest->debounce = 0;
 	if (delay_len > 0
 	    && !(delay_len == 1 && line[delay_first] == '*')) {
-		char *s;
-
-		/* Decode integer part */
-		dest->delay.tv_sec = strtol(line + delay_first, &s, 10);
-
-		/* Decode fractional part if any */
-		if (*s == '.') {
-			char *ns;
-			dest->delay.tv_nsec = strtol(s + 1, &ns, 10);
-			while (ns - s <= 9) {
-				dest->delay.tv_nsec *= 10;
-				s--;
-			}
-			s = ns;
+		char *s = line + delay_first;
+
+		if (*s == '~') {
+			dest->debounce = 1;
+			s = parse_time(s + 1, &dest->delay);
+			if (*s == '/')
+				s = parse_time(s + 1, &dest->max_wait);
 		}
+		else
+			s = parse_time(s, &dest->delay);
 
 		/* Check trailing non-digits */
 		if (s < line + delay_first + delay_len) {
@@ -323,8 +1104,17 @@ wentry_readline(struct watch_entry *dest, char *line,
 		}
 	}
 
+	/* The owner of the watchtab overrides the user field */
+	if (load->owner) {
+		if (chroot_len > 0 && load->owner->uid != 0) {
+			log_watchtab_owner_chroot(filename, line_no);
+			return -1;
+		}
+		pw = load->owner;
+	}
+
 	/* Process user name and optional group name */
-	if (user_len > 0) {
+	else if (user_len > 0) {
 		char *login = line + user_first;
 		char *group = 0;
 
@@ -335,70 +1125,174 @@ wentry_readline(struct watch_entry *dest, char *line,
 		if (group) {
 			*group = 0;
 			group++;
-			for (i = 0; group[i] >= '0' && group[i] <= '9'; i++);
-			errno = 0;
-			grp = group[i]
-			    ? getgrnam(group)
-			    : getgrgid(strtol(group, 0, 10));
-			if (!grp) {
+			grp = lookup_id(load, 'g', group);
+			if (!grp || grp->error >= 0) {
 				log_lookup_group(group);
 				return -1;
 			}
 		}
 
 		/* Lookup user name */
-		for (i = 0; login[i] >= '0' && login[i] <= '9'; i++);
-		errno = 0;
-		pw = login[i]
-		    ? getpwnam(login)
-		    : getpwuid(strtol(login, 0, 10));
-		if (!pw) {
+		pw = lookup_id(load, 'u', login);
+		if (!pw || pw->error >= 0) {
 			log_lookup_pw(login);
 			return -1;
 		}
 	}
 
 	/* Store numeric ids */
-	dest->uid = pw ? pw->pw_uid : 0;
-	dest->gid = grp ? grp->gr_gid : (pw ? pw->pw_gid : 0);
+	dest->uid = pw ? pw->uid : 0;
+	dest->gid = grp ? grp->gid : (pw ? pw->gid : 0);
+	dest->owned = (load->owner != 0);
 
 	/* Lookup self name if not overridden */
 	if (!pw) {
-		char *login;
-		errno = 0;
-		login = getlogin();
-		pw = login ? getpwnam(login) : 0;
-		if (!pw) {
+		pw = lookup_id(load, 's', "");
+		if (!pw || pw->error >= 0) {
 			log_lookup_self();
 			return -1;
 		}
 	}
 
+	/* Compile the path when it is a pattern */
+	glob = 0;
+	if (match_is_glob(line, path_len)) {
+		glob = match_compile(line, path_len);
+		if (!glob) {
+			log_watchtab_invalid_pattern(filename, line_no,
+			    line, path_len);
+			return -1;
+		}
+	}
+
 	/* At this point, no parse error can occur, filling in data */
 
 	/* Clean up destination */
 	wentry_release(dest);
 
-	/* Copy string parameters */
-	dest->path = strdupesc(line, path_len);
-	dest->command = strdupesc(line + cmd_first, cmd_len);
+	/* Copy string parameters, next to each other in the arena */
+	arena = load->arena;
+	dest->arena = arena;
+	arena->refs++;
+	dest->path = strdupesc(arena, line, path_len);
+	dest->glob = glob;
+	dest->command = strdupesc(arena, line + cmd_first, cmd_len);
 
 	if (chroot_len > 0)
-		dest->chroot = strdupesc(line + chroot_first, chroot_len);
+		dest->chroot = strdupesc(arena, line + chroot_first,
+		    chroot_len);
 	else
 		dest->chroot = 0;
 
-	/* Setup environment */
-	wenv_set(base_env, "LOGNAME", pw->pw_name, 1);
-	wenv_set(base_env, "USER", pw->pw_name, 1);
-	wenv_set(base_env, "HOME", pw->pw_dir, !has_home);
-	wenv_set(base_env, "TRIGGER", dest->path, 1);
-	dest->envp = wenv_dup(base_env);
+	/* Share the environment, keeping only user variables apart */
+	home = has_home ? wenv_get(base_env, "HOME") : 0;
+	dest->env = wenv_share(base_env);
+	dest->user_env = user_env(arena, pw->name, home ? home : pw->home);
 
 	return 0;
 }
 
 
+/* wentry_envp - assemble the environment of a command */
+/*   Return an array valid until the next call, or 0 on failure. */
+char **
+wentry_envp(const struct watch_entry *wentry) {
+	size_t shared, len, i, k;
+	const char *trigger, *s;
+	char **new_envp;
+	char *new_trigger;
+
+	/* Make room for shared strings, user variables and TRIGGER */
+	shared = wentry->env ? wentry->env->size : 0;
+	if (shared + 5 > envp_cap) {
+		new_envp = realloc(envp_buf, (shared + 5) * sizeof *envp_buf);
+		if (!new_envp) {
+			log_alloc("command environment");
+			return 0;
+		}
+		envp_buf = new_envp;
+		envp_cap = shared + 5;
+	}
+
+	/* TRIGGER is the changed path of a tree, or the entry path */
+	trigger = wentry->trigger ? wentry->trigger : wentry->path;
+	len = trigger ? strlen(trigger) + 9 : 0;
+	if (len > trigger_cap) {
+		new_trigger = realloc(trigger_buf, len);
+		if (!new_trigger) {
+			log_alloc("TRIGGER variable");
+			return 0;
+		}
+		trigger_buf = new_trigger;
+		trigger_cap = len;
+	}
+
+	if (shared)
+		memcpy(envp_buf, wentry->env->environ,
+		    shared * sizeof *envp_buf);
+	i = shared;
+	for (k = 0, s = wentry->user_env; s && k < 3; k++) {
+		envp_buf[i++] = (char *)s;
+		s += strlen(s) + 1;
+	}
+	if (trigger) {
+		memcpy(trigger_buf, "TRIGGER=", 8);
+		memcpy(trigger_buf + 8, trigger, len - 8);
+		envp_buf[i++] = trigger_buf;
+	}
+	envp_buf[i] = 0;
+
+	return envp_buf;
+}
+
+
+/* wentry_allows - whether the owner of an entry may access an open file */
+int
+wentry_allows(const struct watch_entry *wentry, int fd, int mode) {
+	struct stat st;
+
+	if (!wentry->owned || wentry->uid == 0)
+		return 1;
+	if (fstat(fd, &st) < 0)
+		return -1;
+	return owner_allows(wentry, &st, mode);
+}
+
+
+/* wentry_reaches - whether the owner of an entry may access a path */
+int
+wentry_reaches(const struct watch_entry *wentry, const char *path, int mode) {
+	struct stat st;
+	size_t len = 1;
+	int result = 1, last;
+	char *real, c;
+
+	if (!wentry->owned || wentry->uid == 0)
+		return 1;
+	real = realpath(path, 0);
+	if (!real)
+		return -1;
+
+	/* Walk down from the root, every directory needing search access */
+	for (;;) {
+		c = real[len];
+		real[len] = 0;
+		last = (c == 0);
+		if (stat(real, &st) < 0)
+			result = -1;
+		else if (!owner_allows(wentry, &st, last ? mode : X_OK))
+			result = 0;
+		real[len] = c;
+		if (last || result <= 0)
+			break;
+		len += 1 + strcspn(real + len + 1, "/");
+	}
+
+	free(real);
+	return result;
+}
+
+
 
 /***********************
  * WATCH_ENV INTERFACE *
@@ -414,7 +1308,8 @@ wenv_init(struct watch_env *wenv) {
 
 	wenv->capacity = WENV_ALLOC_UNIT;
 	wenv->size = 0;
-	wenv->environ = malloc(sizeof *wenv->environ * wenv->capacity);
+	wenv->shared = 0;
+	wenv->environ = calloc(wenv->capacity, sizeof *wenv->environ);
 	if (!wenv->environ) {
 		log_alloc("initial environment variables");
 		return -1;
@@ -427,9 +1322,15 @@ wenv_init(struct watch_env *wenv) {
 /* wenv_release - free string memory in a struct watch_env but not the struct*/
 void
 wenv_release(struct watch_env *wenv) {
+	size_t i;
+
+	for (i = 0; i < wenv->size; i++)
+		free((void *)wenv->environ[i]);
 	free(wenv->environ);
 	wenv->size = 0;
 	wenv->environ = 0;
+	wenv_unshare(wenv->shared);
+	wenv->shared = 0;
 }
 
 
@@ -441,6 +1342,10 @@ wenv_add(struct watch_env *wenv, const char *env_str) {
 		return -1;
 	}
 
+	/* Entries sharing the old strings keep them */
+	wenv_unshare(wenv->shared);
+	wenv->shared = 0;
+
 	/* Increase array size if needed */
 	if (wenv_resize(wenv, wenv->size + 2) < 0) return -1;
 
@@ -463,6 +1368,10 @@ wenv_set(struct watch_env *wenv, const char *name, const char *value,
 	if (!wenv->environ && wenv_init(wenv) < 0)
 		return -1;
 
+	/* Entries sharing the old strings keep them */
+	wenv_unshare(wenv->shared);
+	wenv->shared = 0;
+
 	/* Build the environment line */
 	namelen = strlen(name);
 	linelen = namelen + 1 + strlen(value);
@@ -471,9 +1380,9 @@ wenv_set(struct watch_env *wenv, const char *name, const char *value,
 		log_alloc("environment variable entry");
 		return -1;
 	}
-	strncpy(line, name, namelen);
+	memcpy(line, name, namelen);
 	line[namelen] = '=';
-	strncpy(line + namelen + 1, value, linelen - (namelen + 1));
+	memcpy(line + namelen + 1, value, linelen - (namelen + 1));
 	line[linelen] = 0;
 
 	/* Look for an existing entry for the name */
@@ -525,31 +1434,66 @@ wenv_get(struct watch_env *wenv, const char *name) {
 }
 
 
-/* wenv_dup - deep copy environment strings */
-char **
-wenv_dup(struct watch_env *wenv) {
-	char **result;
-	size_t len, i;
-	int reported = 0;
-
-	if (!wenv) return 0;
-	len = (wenv->environ ? wenv->size : 0);
-	result = malloc((len + 1) * sizeof *result);
-	if (!result) {
-		log_alloc("environment duplicate");
+/* wenv_share - reference to an immutable snapshot of the environment */
+/*
+ * The snapshot leaves out variables set for each entry, and is kept in
+ * wenv until the next change, so that consecutive entries share it.
+ */
+struct wenv_block *
+wenv_share(struct watch_env *wenv) {
+	struct wenv_block *block;
+	size_t i, n = 0, size = 0, len;
+	char *dest;
+
+	if (!wenv) {
+		LOG_ASSERT(0);
 		return 0;
 	}
 
-	for (i = 0; i < len; i++) {
-		result[i] = strdup(wenv->environ[i]);
-		if (!result[i] && !reported) {
-			log_alloc("environment item duplication");
-			reported = 1;
-		}
+	if (wenv->shared) {
+		wenv->shared->refs++;
+		return wenv->shared;
 	}
-	result[len] = 0;
 
-	return result;
+	/* Allocate pointers and strings at once */
+	for (i = 0; i < wenv->size; i++) {
+		if (entry_var(wenv->environ[i]))
+			continue;
+		n++;
+		size += strlen(wenv->environ[i]) + 1;
+	}
+	block = malloc(sizeof *block + (n + 1) * sizeof *block->environ
+	    + size);
+	if (!block) {
+		log_alloc("shared environment");
+		return 0;
+	}
+
+	dest = (char *)(block->environ + n + 1);
+	block->size = n;
+	n = 0;
+	for (i = 0; i < wenv->size; i++) {
+		if (entry_var(wenv->environ[i]))
+			continue;
+		len = strlen(wenv->environ[i]) + 1;
+		memcpy(dest, wenv->environ[i], len);
+		block->environ[n++] = dest;
+		dest += len;
+	}
+	block->environ[n] = 0;
+
+	/* One reference for the caller, one for wenv */
+	block->refs = 2;
+	wenv->shared = block;
+	return block;
+}
+
+
+/* wenv_unshare - drop a reference to an environment snapshot */
+void
+wenv_unshare(struct wenv_block *block) {
+	if (block && --block->refs == 0)
+		free(block);
 }
 
 
@@ -573,11 +1517,18 @@ wtab_release(struct watchtab *tab) {
 
 
 /* wtab_readfile - parse the given file to build a new watchtab */
+/*
+ * The whole file is read at once and parsed in place, each line being
+ * cut at its newline, so that entries only copy the fields they keep,
+ * into an arena shared by all the entries of the new watchtab.
+ */
 int
-wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
-	char *line = 0;
-	size_t linecap = 0;
-	ssize_t linelen;
+wtab_readfile(struct watchtab *tab, int fd, const char *filename,
+    const uid_t *owner, struct wtab_lookups *lookups) {
+	struct wtab_load load;
+	char owner_key[24];
+	char *data, *line, *end;
+	size_t size, linelen;
 	unsigned line_no = 0;
 	struct watch_entry *entry = 0;
 	int result = 0, has_home = 0;
@@ -589,13 +1540,39 @@ wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
 		return -1;
 	}
 
+	data = read_all(fd, &size);
+	if (!data)
+		return -1;
+
+	if (load_init(&load, size) < 0) {
+		free(data);
+		return -1;
+	}
+
+	/* Resolve the owner once for all the entries */
+	if (owner) {
+		snprintf(owner_key, sizeof owner_key, "%lu",
+		    (unsigned long)*owner);
+		load.owner = lookup_id(&load, 'u', owner_key);
+		if (!load.owner || load.owner->error >= 0) {
+			log_lookup_pw(owner_key);
+			load_release(&load);
+			free(data);
+			return -1;
+		}
+	}
+
 	/* Setup default environment */
 	wenv_init(&env);
 	wenv_set(&env, "SHELL", "/bin/sh", 1);
 	wenv_set(&env, "PATH", "/usr/bin:/bin", 1);
 
-	/* Read the input data */
-	while ((linelen = getdelim(&line, &linecap, '\n', input)) >= 0) {
+	/* Split the input data into lines */
+	for (line = data; line < data + size; line = end + 1) {
+		end = memchr(line, '\n', data + size - line);
+		if (!end)
+			end = data + size;
+		linelen = end - line;
 		line_no++;
 
 		/* Skip leading blanks */
@@ -603,14 +1580,13 @@ wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
 		while (line[skip] == ' ' || line[skip] == '\t') skip++;
 
 		/* Trim trailing blanks */
-		while ((size_t)linelen > skip && (line[linelen-1] == '\n'
-		    || line[linelen-1] == '\r' || line[linelen-1] == ' '
-		    || line[linelen-1] == '\t'))
+		while (linelen > skip && (line[linelen-1] == '\r'
+		    || line[linelen-1] == ' ' || line[linelen-1] == '\t'))
 			linelen--;
 		line[linelen] = 0;
 
 		/* Ignore empty lines and comments */
-		if ((size_t)linelen <= skip || line[skip] == '#')
+		if (linelen <= skip || line[skip] == '#')
 			continue;
 
 		/*
@@ -618,10 +1594,7 @@ wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
 		 * tabulation ('\t') or backslash ('\\').
 		 */
 
-		i = skip;
-		while (line[i] != 0 && line[i] != '='
-		    && line[i] != '\\' && line[i] != '\t')
-			i++;
+		i = skip + strcspn(line + skip, "=\\\t");
 
 		/* Record an environment variable */
 		if (line[i] == '=') {
@@ -647,10 +1620,13 @@ wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
 		entry = malloc(sizeof *entry);
 		if (!entry) {
 			log_alloc("watchtab entry");
+			wenv_release(&env);
+			load_release(&load);
+			free(data);
 			return -1;
 		}
 		wentry_init(entry);
-		if (wentry_readline(entry, line + skip, &env, has_home,
+		if (wentry_readline(entry, line + skip, &env, has_home, &load,
 		    filename, line_no) < 0) {
 			/* propagate an error but keep parsing */
 			result = -1;
@@ -662,10 +1638,96 @@ wtab_readfile(struct watchtab *tab, FILE *input, const char *filename) {
 		SLIST_INSERT_HEAD(tab, entry, next);
 	}
 
-	if (ferror(input)) {
-		log_watchtab_read();
+	if (lookups)
+		*lookups = load.lookups;
+	wenv_release(&env);
+	load_release(&load);
+	free(data);
+	return result;
+}
+
+
+/* wtab_merge - replace new entries by identical old ones */
+/*
+ * Every entry of tab that has an identical counterpart in old is freed
+ * and replaced by that counterpart, so that its file descriptor, kernel
+ * registration, pending delay and running command survive. Entries of
+ * old without any counterpart are moved into removed, leaving old empty.
+ * Return 0 on success or -1 on failure, in which case nothing is changed.
+ */
+int
+wtab_merge(struct watchtab *tab, struct watchtab *old,
+    struct watchtab *removed, struct wtab_diff *diff) {
+	struct merge_slot {
+		uint64_t		hash;
+		struct watch_entry	*entry;
+		int			taken;
+	} *slots;
+	struct watch_entry *entry, *last = 0;
+	size_t count = 0, mask = 1, i;
+
+	if (!tab || !old || !removed || !diff) {
+		LOG_ASSERT(0);
 		return -1;
 	}
+	diff->kept = diff->added = diff->removed = 0;
+
+	/* Build an open-addressing hash table of old entries */
+	SLIST_FOREACH(entry, old, next) count++;
+	while (mask < count * 2) mask <<= 1;
+	slots = calloc(mask, sizeof *slots);
+	if (!slots) {
+		log_alloc("watchtab merge table");
+		return -1;
+	}
+	mask--;
+	SLIST_FOREACH(entry, old, next) {
+		uint64_t hash = wentry_hash(entry);
+		for (i = hash & mask; slots[i].entry; i = (i + 1) & mask);
+		slots[i].hash = hash;
+		slots[i].entry = entry;
+	}
 
-	return result;
+	/* Rebuild tab in the same order, with old entries when possible */
+	/* local */{
+		struct watchtab parsed = *tab;
+
+		SLIST_INIT(tab);
+		while ((entry = SLIST_FIRST(&parsed)) != 0) {
+			uint64_t hash = wentry_hash(entry);
+
+			SLIST_REMOVE_HEAD(&parsed, next);
+			for (i = hash & mask; slots[i].entry;
+			    i = (i + 1) & mask) {
+				if (slots[i].taken || slots[i].hash != hash
+				    || !wentry_equal(slots[i].entry, entry))
+					continue;
+				slots[i].taken = 1;
+				wentry_adopt(slots[i].entry, entry);
+				wentry_free(entry);
+				entry = slots[i].entry;
+				diff->kept++;
+				break;
+			}
+			if (!slots[i].entry)
+				diff->added++;
+
+			if (last)
+				SLIST_INSERT_AFTER(last, entry, next);
+			else
+				SLIST_INSERT_HEAD(tab, entry, next);
+			last = entry;
+		}
+	}
+
+	/* Move remaining old entries to removed */
+	SLIST_INIT(old);
+	for (i = 0; i <= mask; i++) {
+		if (!slots[i].entry || slots[i].taken) continue;
+		SLIST_INSERT_HEAD(removed, slots[i].entry, next);
+		diff->removed++;
+	}
+
+	free(slots);
+	return 0;
 }
@@ -19,38 +19,160 @@
 #ifndef FILEWATCHER_WATCHTAB_H
 #define FILEWATCHER_WATCHTAB_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "timer.h"
+
 
 /********************
  * TYPE DEFINITIONS *
  ********************/
 
+/* watched events, values matching kqueue(2) vnode fflags */
+#define WEV_DELETE	0x0001		/* file has been unlinked */
+#define WEV_WRITE	0x0002		/* file contents have changed */
+#define WEV_EXTEND	0x0004		/* file size has increased */
+#define WEV_ATTRIB	0x0008		/* file attributes have changed */
+#define WEV_LINK	0x0010		/* file link count has changed */
+#define WEV_RENAME	0x0020		/* file has been renamed */
+#define WEV_REVOKE	0x0040		/* file access has been revoked */
+#define WEV_ALL		0x007f
+
+/* scheduling classes of entries, served in increasing order */
+#define WPRIO_HIGH	0
+#define WPRIO_NORMAL	1
+#define WPRIO_LOW	2
+#define WPRIO_COUNT	3
+
+/* persistence of the watch of a file entry across its triggers */
+#define WPERSIST_NONE	0		/* dropped at each trigger */
+#define WPERSIST_PATH	1		/* kept until deleted or renamed */
+#define WPERSIST_INODE	2		/* kept until deleted, across renames */
+
+/* default number of output bytes logged per stream of a command */
+#define WOUTPUT_LIMIT	65536
+
+/* kinds of structures given to evq_watch(), stored as their first member */
+#define WNODE_ENTRY	0		/* struct watch_entry */
+#define WNODE_DIR	1		/* struct watch_dir, from tree.h */
+#define WNODE_FILE	2		/* struct watch_file, from fanout.h */
+#define WNODE_TAB	3		/* struct watch_tab, from tabset.h */
+#define WNODE_TABSET	4		/* struct tab_set, from tabset.h */
+
+/* WNODE_KIND - kind of the structure behind an event pointer */
+#define WNODE_KIND(udata) (*(const int *)(udata))
+
+struct matcher;
+struct stats_slot;
+struct trace_run;
+struct watch_file;
+struct watch_tree;
+struct wenv_block;
+struct wtab_arena;
+struct wtab_load;
+
+/* struct watch_snap - state of a file an entry has last seen */
+struct watch_snap {
+	int		valid;		/* whether the state is known */
+	dev_t		dev;		/* device of the file */
+	ino_t		ino;		/* inode of the file */
+	off_t		size;		/* size of the file */
+	nlink_t		nlink;		/* link count of the file */
+	struct timespec	mtime;		/* last modification of the contents */
+	struct timespec	ctime;		/* last change of the inode */
+};
+
 /* struct watch_entry - a single watch table entry */
 struct watch_entry {
+	int		node;		/* WNODE_ENTRY */
 	const char	*path;		/* file path to watch */
-	u_int		events;		/* vnode event set to watch */
-	struct timespec	delay;		/* delay before running command */
+	struct matcher	*glob;		/* compiled path if it has wildcards */
+	u_int		events;		/* WEV_* event set to watch */
+	struct timespec	delay;		/* delay, or quiet window if debounce */
+	struct timespec	max_wait;	/* debounce cap since first event, or 0 */
+	int		debounce;	/* whether new events postpone command */
+	unsigned	max_concurrency;/* maximum number of running commands */
+	unsigned	max_queue;	/* maximum number of runs kept waiting */
+	unsigned	priority;	/* WPRIO_* scheduling class */
+	unsigned	max_output;	/* output bytes logged per stream */
+	int		recursive;	/* whether path is a directory tree */
+	int		persist;	/* WPERSIST_* policy of the file watch */
 	uid_t		uid;		/* uid to set before command */
 	gid_t		gid;		/* gid to set before command */
+	int		owned;		/* whether run as the watchtab owner */
 	const char	*chroot;	/* path to chroot before command */
 	const char	*command;	/* command to execute */
-	char		**envp;		/* environment variables */
-	int		fd;		/* file descriptor in kernel queue */
+	struct wenv_block *env;		/* environment shared with other entries */
+	char		*user_env;	/* LOGNAME, USER and HOME of the entry */
+	struct wtab_arena *arena;	/* owner of the strings above, or null */
+	struct watch_file *file;	/* shared watch while armed, or null */
+	LIST_ENTRY(watch_entry) file_link;
+	struct watch_file *ancestor;	/* directory watched while path missing */
+	size_t		wait_name;	/* offset of the awaited name in path */
+	size_t		wait_len;	/* length of the awaited name */
+	struct watch_snap snap;		/* file when last left or seen */
+	u_int		caught;		/* WEV_* changes found when armed again */
+	LIST_ENTRY(watch_entry) caught_link;
+	u_int		fired;		/* WEV_* set handed out with fired_link */
+	SLIST_ENTRY(watch_entry) fired_link;
+	struct watch_tree *tree;	/* watched directories of a tree or glob */
+	char		*trigger;	/* changed path inside the tree */
+	unsigned	running;	/* number of commands not yet exited */
+	unsigned	queued;		/* runs waiting for a command to exit */
+	unsigned	ready;		/* runs waiting in the global scheduler */
+	struct timespec	ready_since;	/* when the entry reached the queue */
+	TAILQ_ENTRY(watch_entry) ready_link;
+	int		removed;	/* whether no longer in the watchtab */
+	struct timer_node timer;	/* deadline of a delayed command */
+	struct timespec	burst;		/* first event of a debounced burst */
+	struct stats_slot *stats;	/* shared counters, or null */
+	uint64_t	pending_since;	/* earliest trigger not yet run, in ns */
+	struct trace_run *trace_next;	/* stages of the next run, or null */
+	struct trace_run *trace_runs;	/* traced runs not yet complete */
+	unsigned	trace_id;	/* track in the trace file, or 0 */
 	SLIST_ENTRY(watch_entry) next;
 };
 
+/* WENTRY_OF_TIMER - entry containing the given timer node */
+#define WENTRY_OF_TIMER(node) ((struct watch_entry *)(void *) \
+    ((char *)(node) - offsetof(struct watch_entry, timer)))
+
 /* struct watchtab - list of watchtab entries */
 SLIST_HEAD(watchtab, watch_entry);
 
+/* struct wtab_diff - outcome of a watchtab merge */
+struct wtab_diff {
+	size_t		kept;		/* entries reused from the old watchtab */
+	size_t		added;		/* entries only in the new watchtab */
+	size_t		removed;	/* entries only in the old watchtab */
+};
+
+/* struct wtab_lookups - user and group resolution during a load */
+struct wtab_lookups {
+	size_t		hits;		/* lookups answered by the load cache */
+	size_t		misses;		/* lookups sent to the system */
+	uint64_t	time_ns;	/* time spent in system lookups */
+};
+
 /* struct watch_env - dynamic table of environment variables */
 struct watch_env {
 	const char	**environ;	/* environment strings */
 	size_t		size;		/* index of the last NULL pointer */
 	size_t		capacity;	/* number of string slot available */
+	struct wenv_block *shared;	/* snapshot for entries, or null */
+};
+
+/* struct wenv_block - immutable environment shared by entries */
+/*   Variables set for each entry are left out, see wentry_envp(). */
+struct wenv_block {
+	unsigned	refs;		/* number of holders */
+	size_t		size;		/* number of strings */
+	char		*environ[];	/* NULL-terminated, strings follow */
 };
 
 
@@ -73,9 +195,28 @@ wentry_free(struct watch_entry *wentry);
 /* wentry_readline - parse a config file line and fill a struct watch_entry */
 int
 wentry_readline(struct watch_entry *dest, char *line,
-    struct watch_env *base_env, int has_home,
+    struct watch_env *base_env, int has_home, struct wtab_load *load,
     const char *filename, unsigned line_no);
 
+/* wentry_envp - assemble the environment of a command */
+/*   Return an array valid until the next call, or 0 on failure. */
+char **
+wentry_envp(const struct watch_entry *wentry);
+
+/* wentry_allows - whether the owner of an entry may access an open file */
+/*   Access is checked from the permission bits, with the credentials the
+ *   command of an owned entry runs with, mode being a combination of
+ *   R_OK and X_OK. Entries that are not owned, or owned by root, may
+ *   access anything. Return 1 if allowed, 0 if not, -1 on failure. */
+int
+wentry_allows(const struct watch_entry *wentry, int fd, int mode);
+
+/* wentry_reaches - whether the owner of an entry may access a path */
+/*   Like wentry_allows(), every directory on the resolved path needing
+ *   search access on top of mode for the path itself. */
+int
+wentry_reaches(const struct watch_entry *wentry, const char *path, int mode);
+
 
 /* wenv_init - create an empty environment list */
 int
@@ -98,9 +239,13 @@ wenv_set(struct watch_env *wenv, const char *name, const char *value,
 const char *
 wenv_get(struct watch_env *wenv, const char *name);
 
-/* wenv_dup - deep copy environment strings */
-char **
-wenv_dup(struct watch_env *wenv);
+/* wenv_share - reference to an immutable snapshot of the environment */
+struct wenv_block *
+wenv_share(struct watch_env *wenv);
+
+/* wenv_unshare - drop a reference to an environment snapshot */
+void
+wenv_unshare(struct wenv_block *block);
 
 
 /* wtab_release - release children objects but not the struct watchtab */
@@ -108,7 +253,16 @@ void
 wtab_release(struct watchtab *tab);
 
 /* wtab_readfile - parse the given file to build a new watchtab */
+/*   When owner is not null, every entry runs as that user, whatever its
+ *   user field. User and group lookups are accounted in lookups, when
+ *   not null. */
+int
+wtab_readfile(struct watchtab *tab, int fd, const char *filename,
+    const uid_t *owner, struct wtab_lookups *lookups);
+
+/* wtab_merge - replace new entries by identical old ones */
 int
-wtab_readfile(struct watchtab *tab, FILE *input, const char *filename);
+wtab_merge(struct watchtab *tab, struct watchtab *old,
+    struct watchtab *removed, struct wtab_diff *diff);
 
 #endif /* ndef FILEWATCHER_WATCHTAB_H */